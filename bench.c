@@ -0,0 +1,514 @@
+/*
+ * bench.c - drive the daemon's event path with synthetic netlink traffic
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * A generator thread makes up RTM_NEWLINK and RTM_DELLINK messages
+ * for a set of fake interfaces and writes them into one end of a
+ * socketpair; the main thread reads the other end with
+ * netlink_listen(), just as the daemon reads its netlink socket, and
+ * runs them through the same decode and state machine code.  Scripts
+ * are not run: starting one hands out a made-up pid, and it "exits"
+ * successfully once the message that started it has been dealt with.
+ *
+ * Every message decodes to exactly one event, so event ids line up
+ * with the order messages were sent in, and the time from sending a
+ * message to starting the script it calls for can be measured.
+ *
+ * With -j, the main thread only decodes and dispatches, as the daemon
+ * does with -j, and shard threads run the state machine, each letting
+ * its own scripts finish.  Running with -j 1, 2, 4 and so on shows
+ * how throughput scales with the number of shards.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <linux/if_arp.h>
+
+#include "netplug.h"
+
+int use_syslog;
+int debug;
+
+#define MAX_PACK        64
+#define MSG_SPACE       256
+
+static int nifaces = 1000;      /* fake interfaces */
+static int nflaps = 100;        /* carrier down and up again, each */
+static int pack = 1;            /* messages per datagram */
+static int burst = 1;           /* datagrams sent back to back */
+static double rate;             /* messages per second, or 0 for flat out */
+static int delete;              /* remove the interfaces at the end */
+static int nshards;             /* state machine threads, or 0 for none */
+
+static int gen_fd, bench_fd;
+static unsigned long nr_messages;
+static unsigned long long *sent_ns; /* by event id */
+static int finished;
+
+static unsigned long nr_dispatched, nr_handled; /* with -j */
+
+static unsigned long long *latency; /* send to script start, per script */
+static unsigned long nr_latency;
+
+/* scripts yet to "exit", oldest first, in each thread running the
+   state machine */
+static __thread pid_t *running;
+static __thread size_t nr_running, max_running;
+static pid_t next_pid = 1 << 22;
+static unsigned long nr_scripts;
+
+
+static pid_t
+stub_spawn(struct if_info *info, char *action)
+{
+    if (nr_running == max_running) {
+        max_running = max_running ? max_running * 2 : 64;
+        running = realloc(running, max_running * sizeof(*running));
+        if (running == NULL) {
+            do_log(LOG_ERR, "realloc: %m");
+            exit(1);
+        }
+    }
+
+    if (info->event_id && info->event_id <= nr_messages) {
+        unsigned long n = __atomic_fetch_add(&nr_latency, 1,
+                                             __ATOMIC_RELAXED);
+
+        latency[n] = monotonic_ns() - sent_ns[info->event_id];
+    }
+
+    pid_t pid = __atomic_fetch_add(&next_pid, 1, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&nr_scripts, 1, __ATOMIC_RELAXED);
+    running[nr_running++] = pid;
+
+    return pid;
+}
+
+
+/* A script told to stop exits along with the rest, in
+   finish_scripts(), and what is to run after it starts then. */
+static void
+stub_kill(pid_t pid)
+{
+}
+
+
+static void
+stub_signal(pid_t pid, int sig)
+{
+}
+
+
+static void
+finish_scripts(void)
+{
+    while (nr_running) {
+        pid_t pid = running[0];
+
+        memmove(&running[0], &running[1],
+                (nr_running - 1) * sizeof(*running));
+        nr_running--;
+
+        ifsm_scriptdone(pid, 0);
+    }
+}
+
+
+/* What the daemon's handle_interface() does, plus letting scripts
+   finish and noticing the end of the stream. */
+static int
+handle_message(struct nlmsghdr *hdr, void *arg)
+{
+    struct link_event ev;
+    int ret;
+
+    if (hdr->nlmsg_type == NLMSG_DONE) {
+        finished = 1;
+        return 0;
+    }
+
+    if ((ret = link_event_decode(&ev, arg, hdr)) <= 0) {
+        return ret;
+    }
+
+    if (nshards) {
+        nr_dispatched++;
+        shard_dispatch_link(&ev);
+    } else {
+        if_info_handle_event(&ev);
+        finish_scripts();
+    }
+
+    return 0;
+}
+
+
+/* The same, in a shard, for what the main thread dispatched. */
+static void
+shard_event(struct link_event *ev)
+{
+    if_info_handle_event(ev);
+    finish_scripts();
+    __atomic_fetch_add(&nr_handled, 1, __ATOMIC_RELEASE);
+}
+
+
+static void
+shard_child(struct child_exit *ce)
+{
+    ifsm_scriptdone(ce->pid, ce->status);
+}
+
+
+static int
+shard_idle(void)
+{
+    ifsm_expire();
+
+    return ifsm_timeout();
+}
+
+
+static void
+add_attr(struct nlmsghdr *hdr, int type, const void *data, int len)
+{
+    struct rtattr *rta = (void *) ((char *) hdr + NLMSG_ALIGN(hdr->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    hdr->nlmsg_len = NLMSG_ALIGN(hdr->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+
+/* Build the message for interface n, numbered seq, at buf. */
+static int
+make_message(char *buf, int type, int n, unsigned flags, unsigned seq)
+{
+    struct nlmsghdr *hdr = (void *) buf;
+    struct ifinfomsg *ifi = NLMSG_DATA(hdr);
+    char name[IFNAMSIZ];
+    unsigned char mac[6] = { 0x02, 0, n >> 24, n >> 16, n >> 8, n };
+    unsigned mtu = 1500;
+    unsigned char operstate = flags & IFF_RUNNING ? IF_OPER_UP : IF_OPER_DOWN;
+
+    memset(buf, 0, MSG_SPACE);
+    hdr->nlmsg_len = NLMSG_LENGTH(sizeof(*ifi));
+    hdr->nlmsg_type = type;
+    hdr->nlmsg_seq = seq;
+    ifi->ifi_family = AF_UNSPEC;
+    ifi->ifi_type = ARPHRD_ETHER;
+    ifi->ifi_index = n + 1;
+    ifi->ifi_flags = flags;
+    ifi->ifi_change = ~0U;
+
+    snprintf(name, sizeof(name), "bench%d", n);
+    add_attr(hdr, IFLA_IFNAME, name, strlen(name) + 1);
+    add_attr(hdr, IFLA_ADDRESS, mac, sizeof(mac));
+    add_attr(hdr, IFLA_MTU, &mtu, sizeof(mtu));
+    add_attr(hdr, IFLA_OPERSTATE, &operstate, sizeof(operstate));
+
+    return NLMSG_ALIGN(hdr->nlmsg_len);
+}
+
+
+static void
+sleep_until(unsigned long long when)
+{
+    unsigned long long now = monotonic_ns();
+
+    if (now < when) {
+        unsigned long long ns = when - now;
+        struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+static void
+send_datagram(char *buf, int len)
+{
+    while (send(gen_fd, buf, len, 0) == -1) {
+        if (errno != EINTR) {
+            do_log(LOG_ERR, "send: %m");
+            exit(1);
+        }
+    }
+}
+
+
+/* Interfaces come up without carrier, flap nflaps times each, and are
+   optionally deleted.  The flaps of one round go to every interface
+   before the next round starts, so events for an interface are spread
+   out the way they would be on a busy host. */
+static void *
+generate(void *arg)
+{
+    static char buf[MAX_PACK * MSG_SPACE];
+    unsigned long seq = 0;
+    unsigned long long start = monotonic_ns();
+    int len = 0, packed = 0, sent = 0;
+
+    void flush(void) {
+        if (packed == 0)
+            return;
+
+        /* Stamp the messages just before they go. */
+        unsigned long long now = monotonic_ns();
+
+        for (unsigned long s = seq - packed + 1; s <= seq; s++)
+            sent_ns[s] = now;
+
+        send_datagram(buf, len);
+        len = packed = 0;
+
+        if (rate > 0 && ++sent % burst == 0)
+            sleep_until(start + seq * 1e9 / rate);
+    }
+
+    void queue(int type, int n, unsigned flags) {
+        len += make_message(buf + len, type, n, flags, ++seq);
+        if (++packed == pack)
+            flush();
+    }
+
+    for (int n = 0; n < nifaces; n++)
+        queue(RTM_NEWLINK, n, IFF_UP | IFF_BROADCAST | IFF_MULTICAST);
+
+    for (int f = 0; f < nflaps; f++) {
+        for (int n = 0; n < nifaces; n++)
+            queue(RTM_NEWLINK, n, IFF_UP | IFF_BROADCAST | IFF_MULTICAST |
+                  IFF_RUNNING | IFF_LOWER_UP);
+        for (int n = 0; n < nifaces; n++)
+            queue(RTM_NEWLINK, n, IFF_UP | IFF_BROADCAST | IFF_MULTICAST);
+    }
+
+    if (delete) {
+        for (int n = 0; n < nifaces; n++)
+            queue(RTM_DELLINK, n, IFF_BROADCAST | IFF_MULTICAST);
+    }
+
+    flush();
+
+    struct nlmsghdr done = {
+        .nlmsg_len = NLMSG_LENGTH(0),
+        .nlmsg_type = NLMSG_DONE,
+    };
+
+    send_datagram((char *) &done, done.nlmsg_len);
+
+    return NULL;
+}
+
+
+static int
+compare_ull(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+static double
+percentile(double p)
+{
+    if (nr_latency == 0)
+        return 0;
+
+    unsigned long i = p * (nr_latency - 1) + 0.5;
+
+    return latency[i] / 1e3;
+}
+
+
+static void
+usage(char *progname, int exitcode)
+{
+    fprintf(stderr, "Usage: %s [-dv] [-n interfaces] [-f flaps] "
+            "[-p pack] [-b burst] [-r rate] [-j shards]\n", progname);
+
+    fprintf(stderr, "\t-d\t\t"
+            "delete the interfaces at the end\n");
+    fprintf(stderr, "\t-v\t\t"
+            "show the daemon's log messages\n");
+    fprintf(stderr, "\t-n interfaces\t"
+            "number of fake interfaces (default 1000)\n");
+    fprintf(stderr, "\t-f flaps\t"
+            "times each interface loses and regains carrier (default 100)\n");
+    fprintf(stderr, "\t-p pack\t\t"
+            "messages per datagram, up to %d (default 1)\n", MAX_PACK);
+    fprintf(stderr, "\t-b burst\t"
+            "datagrams sent back to back between pauses (default 1)\n");
+    fprintf(stderr, "\t-r rate\t\t"
+            "messages per second, or 0 for as fast as possible (default)\n");
+    fprintf(stderr, "\t-j shards\t"
+            "run the state machine on this many threads, as netplugd -j\n");
+
+    exit(exitcode);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int verbose = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "b:df:hj:n:p:r:v")) != EOF) {
+        switch (c) {
+        case 'b':
+            burst = atoi(optarg);
+            break;
+        case 'd':
+            delete = 1;
+            break;
+        case 'f':
+            nflaps = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0], 0);
+            break;
+        case 'j':
+            nshards = atoi(optarg);
+            break;
+        case 'n':
+            nifaces = atoi(optarg);
+            break;
+        case 'p':
+            pack = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case '?':
+            usage(argv[0], 1);
+        }
+    }
+
+    if (optind != argc || nifaces < 1 || nflaps < 0 || pack < 1 ||
+        pack > MAX_PACK || burst < 1 || rate < 0 || nshards < 0 ||
+        nshards > 64)
+        usage(argv[0], 1);
+
+    if (!verbose)
+        log_threshold = LOG_WARNING;
+
+    save_pattern("*");
+
+    ifsm_hooks.spawn = stub_spawn;
+    ifsm_hooks.kill = stub_kill;
+    ifsm_hooks.signal = stub_signal;
+
+    nr_messages = (unsigned long) nifaces * (1 + 2 * nflaps + delete);
+    sent_ns = xmalloc((nr_messages + 1) * sizeof(*sent_ns));
+    latency = xmalloc((nr_messages + 1) * sizeof(*latency));
+
+    int fds[2];
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == -1) {
+        do_log(LOG_ERR, "socketpair: %m");
+        exit(1);
+    }
+
+    gen_fd = fds[0];
+    bench_fd = fds[1];
+    fcntl(bench_fd, F_SETFL, O_NONBLOCK);
+    netlink_fake_fd = bench_fd;
+
+    struct netns ns = {
+        .id = 0, .nsfd = -1, .nlfd = bench_fd, .sockfd = -1,
+    };
+
+    if (nshards)
+        shard_start(nshards, shard_event, shard_child, shard_idle);
+
+    unsigned long long start = monotonic_ns();
+    pthread_t gen;
+
+    if (pthread_create(&gen, NULL, generate, NULL) != 0) {
+        do_log(LOG_ERR, "can't start generator thread");
+        exit(1);
+    }
+
+    struct pollfd pfd = { .fd = bench_fd, .events = POLLIN };
+
+    while (!finished) {
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            do_log(LOG_ERR, "poll: %m");
+            exit(1);
+        }
+        if (netlink_listen(bench_fd, handle_message, &ns) == 0)
+            break;
+    }
+
+    /* The shards may still be catching up. */
+    while (__atomic_load_n(&nr_handled, __ATOMIC_ACQUIRE) < nr_dispatched) {
+        struct timespec ts = { 0, 100000 };
+
+        nanosleep(&ts, NULL);
+    }
+
+    double secs = (monotonic_ns() - start) / 1e9;
+
+    pthread_join(gen, NULL);
+
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    qsort(latency, nr_latency, sizeof(*latency), compare_ull);
+
+    printf("interfaces:   %d\n", nifaces);
+    if (nshards)
+        printf("shards:       %d\n", nshards);
+    printf("messages:     %lu (%d per datagram)\n", nr_messages, pack);
+    printf("scripts:      %lu\n", nr_scripts);
+    printf("elapsed:      %.6f s\n", secs);
+    if (secs > 0)
+        printf("throughput:   %.0f events/s\n", nr_messages / secs);
+    printf("latency:      p50 %.1f us, p99 %.1f us, max %.1f us\n",
+           percentile(0.5), percentile(0.99), percentile(1));
+    printf("peak rss:     %ld KiB\n", ru.ru_maxrss);
+
+    return 0;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
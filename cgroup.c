@@ -0,0 +1,434 @@
+/*
+ * cgroup.c - run scripts in cgroup v2 leaves of their own
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * With --cgroup DIR, scripts run in this tree:
+ *
+ *   DIR/daemon                 netplugd itself, if it was started in DIR
+ *   DIR/scripts                cpu.weight and cpuset.cpus, for them all
+ *   DIR/scripts/ACTION         probe, in or out, to account each apart
+ *   DIR/scripts/ACTION/PID     one script, with memory.max
+ *
+ * A script makes its own leaf, named after its pid, between fork() and
+ * exec(), so nothing it starts can get out; a process that double
+ * forks leaves its process group, but not its cgroup.  Given a pid,
+ * the daemon finds the leaf again by trying each action, to kill all
+ * of it through cgroup.kill, and to remove it once the script exits.
+ * A leaf something is still running in is left for later, and tried
+ * again each second from the main loop.  CPU time
+ * and peak memory use are read from the action cgroups, which keep
+ * what their removed leaves used.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "netplug.h"
+
+static const char *top;         /* DIR, or NULL without --cgroup */
+static char *scripts;           /* DIR/scripts, once it is set up */
+
+static const char *cpu_weight;
+static const char *memory_max;
+static const char *cpus;
+
+/* Leaves that were still populated when their script exited. */
+static struct leftover {
+    pid_t pid;
+    int action;
+    struct leftover *next;
+} *leftovers;
+
+static pthread_mutex_t leftover_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long last_sweep;
+
+
+void
+cgroup_use(const char *dir)
+{
+    top = dir;
+}
+
+
+void
+cgroup_limit(const char *file, const char *value)
+{
+    if (strcmp(file, "cpu.weight") == 0)
+        cpu_weight = value;
+    else if (strcmp(file, "memory.max") == 0)
+        memory_max = value;
+    else if (strcmp(file, "cpuset.cpus") == 0)
+        cpus = value;
+}
+
+
+static int
+write_file(const char *dir, const char *file, const char *value)
+{
+    char path[PATH_MAX + NAME_MAX + 2];
+    int fd, ret = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    if ((fd = open(path, O_WRONLY | O_CLOEXEC)) == -1)
+        return -1;
+
+    if (write(fd, value, strlen(value)) == -1)
+        ret = -1;
+
+    int saved_errno = errno;    /* for the caller's %m */
+
+    close(fd);
+    errno = saved_errno;
+
+    return ret;
+}
+
+
+static void
+must_write(const char *dir, const char *file, const char *value)
+{
+    if (write_file(dir, file, value) == -1) {
+        do_log(LOG_ERR, "%s/%s: can't write %s: %m", dir, file, value);
+        exit(1);
+    }
+}
+
+
+static void
+must_mkdir(const char *dir)
+{
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        do_log(LOG_ERR, "%s: %m", dir);
+        exit(1);
+    }
+}
+
+
+/* Is this process in dir itself? */
+static int
+in_cgroup(const char *dir)
+{
+    char path[PATH_MAX];
+    FILE *fp;
+    int pid, found = 0;
+
+    snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        do_log(LOG_ERR, "%s: %m", path);
+        exit(1);
+    }
+
+    while (fscanf(fp, "%d", &pid) == 1) {
+        if (pid == getpid())
+            found = 1;
+    }
+
+    fclose(fp);
+
+    return found;
+}
+
+
+/* Build the tree.  This has to wait until we have daemonized, as it
+   may move us, and daemon() changes our pid. */
+void
+cgroup_open(void)
+{
+    char path[PATH_MAX];
+
+    if (top == NULL)
+        return;
+
+    must_mkdir(top);
+
+    /* A cgroup with processes of its own can't give its children
+       controllers, so get out of the way. */
+    if (in_cgroup(top)) {
+        char pid[16];
+
+        snprintf(path, sizeof(path), "%s/daemon", top);
+        must_mkdir(path);
+        snprintf(pid, sizeof(pid), "%d", getpid());
+        must_write(path, "cgroup.procs", pid);
+    }
+
+    if (cpu_weight)
+        must_write(top, "cgroup.subtree_control", "+cpu");
+    if (cpus)
+        must_write(top, "cgroup.subtree_control", "+cpuset");
+    if (memory_max)
+        must_write(top, "cgroup.subtree_control", "+memory");
+
+    if (asprintf(&scripts, "%s/scripts", top) == -1) {
+        do_log(LOG_ERR, "asprintf: %m");
+        exit(1);
+    }
+    must_mkdir(scripts);
+
+    if (cpu_weight)
+        must_write(scripts, "cpu.weight", cpu_weight);
+    if (cpus)
+        must_write(scripts, "cpuset.cpus", cpus);
+    if (memory_max)
+        must_write(scripts, "cgroup.subtree_control", "+memory");
+
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        snprintf(path, sizeof(path), "%s/%s", scripts, action_name(a));
+        must_mkdir(path);
+        if (memory_max)
+            must_write(path, "cgroup.subtree_control", "+memory");
+    }
+
+    do_log(LOG_INFO, "running scripts in cgroups under %s", scripts);
+}
+
+
+/* In a newly forked script: move into a leaf of our own.  If that
+   fails, the script still runs; better that than not at all. */
+void
+cgroup_enter(const char *action)
+{
+    char leaf[PATH_MAX];
+
+    if (scripts == NULL || action_index(action) == -1)
+        return;
+
+    snprintf(leaf, sizeof(leaf), "%s/%s/%d", scripts, action, getpid());
+
+    if ((mkdir(leaf, 0755) == -1 && errno != EEXIST) ||
+        (memory_max && write_file(leaf, "memory.max", memory_max) == -1) ||
+        write_file(leaf, "cgroup.procs", "0") == -1)
+        do_log(LOG_ERR, "%s: %m", leaf);
+}
+
+
+static void
+leaf_path(char *path, size_t size, int action, pid_t pid)
+{
+    snprintf(path, size, "%s/%s/%d", scripts, action_name(action), pid);
+}
+
+
+/* Kill everything in pid's cgroup.  Returns -1 if there is none, for
+   the caller to fall back on signalling its process group. */
+int
+cgroup_kill(pid_t pid)
+{
+    char leaf[PATH_MAX];
+
+    if (scripts == NULL)
+        return -1;
+
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        leaf_path(leaf, sizeof(leaf), a, pid);
+
+        if (write_file(leaf, "cgroup.kill", "1") == 0)
+            return 0;
+        if (errno != ENOENT) {
+            do_log(LOG_ERR, "%s/cgroup.kill: %m", leaf);
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+
+/* Remove a leaf; returns 0 if it is gone, or there wasn't one. */
+static int
+remove_leaf(int action, pid_t pid)
+{
+    char leaf[PATH_MAX];
+
+    leaf_path(leaf, sizeof(leaf), action, pid);
+
+    if (rmdir(leaf) == 0 || errno == ENOENT)
+        return 0;
+
+    if (errno != EBUSY)
+        do_log(LOG_ERR, "%s: %m", leaf);
+
+    return -1;
+}
+
+
+/* Try again with leaves left behind, at most once a second. */
+static void
+sweep(void)
+{
+    unsigned long long now = monotonic_ns();
+
+    if (now - last_sweep < 1000000000ULL)
+        return;
+    last_sweep = now;
+
+    for (struct leftover **lp = &leftovers; *lp != NULL; ) {
+        struct leftover *l = *lp;
+
+        if (remove_leaf(l->action, l->pid) == 0) {
+            *lp = l->next;
+            free(l);
+        } else {
+            lp = &l->next;
+        }
+    }
+}
+
+
+/* pid has exited: remove its leaf, or, if something it started is
+   still running there, remember to remove it later. */
+void
+cgroup_reap(pid_t pid)
+{
+    char leaf[PATH_MAX];
+
+    if (scripts == NULL)
+        return;
+
+    pthread_mutex_lock(&leftover_lock);
+
+    sweep();
+
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        leaf_path(leaf, sizeof(leaf), a, pid);
+
+        if (rmdir(leaf) == 0)
+            break;
+        if (errno == ENOENT)
+            continue;
+        if (errno == EBUSY) {
+            struct leftover *l = xmalloc(sizeof(*l));
+
+            do_log(LOG_DEBUG, "%s: left running after pid %d exited",
+                   leaf, pid);
+            l->pid = pid;
+            l->action = a;
+            l->next = leftovers;
+            leftovers = l;
+        } else {
+            do_log(LOG_ERR, "%s: %m", leaf);
+        }
+        break;
+    }
+
+    pthread_mutex_unlock(&leftover_lock);
+}
+
+
+/* How long until cgroup_tick() has leaves to try again, in
+   milliseconds, or -1 if there are none. */
+int
+cgroup_timeout(void)
+{
+    int timeout = -1;
+
+    pthread_mutex_lock(&leftover_lock);
+
+    if (leftovers != NULL) {
+        unsigned long long now = monotonic_ns();
+        unsigned long long next = last_sweep + 1000000000ULL;
+
+        timeout = next <= now ? 0 : (next - now + 999999) / 1000000;
+    }
+
+    pthread_mutex_unlock(&leftover_lock);
+
+    return timeout;
+}
+
+
+void
+cgroup_tick(void)
+{
+    if (scripts == NULL)
+        return;
+
+    pthread_mutex_lock(&leftover_lock);
+    sweep();
+    pthread_mutex_unlock(&leftover_lock);
+}
+
+
+static int
+read_value(const char *dir, const char *file, const char *key,
+           unsigned long long *value)
+{
+    char path[PATH_MAX + NAME_MAX + 2], name[64];
+    unsigned long long v;
+    FILE *fp;
+    int found = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    if ((fp = fopen(path, "r")) == NULL)
+        return -1;
+
+    if (key == NULL) {
+        if (fscanf(fp, "%llu", value) == 1)
+            found = 0;
+    } else {
+        while (fscanf(fp, "%63s %llu", name, &v) == 2) {
+            if (strcmp(name, key) == 0) {
+                *value = v;
+                found = 0;
+                break;
+            }
+        }
+    }
+
+    fclose(fp);
+
+    return found;
+}
+
+
+/* What scripts run for action have used; -1 where it isn't known. */
+void
+cgroup_usage(int action, long long *cpu_usec, long long *memory_peak)
+{
+    char dir[PATH_MAX];
+    unsigned long long v;
+
+    *cpu_usec = *memory_peak = -1;
+
+    if (scripts == NULL)
+        return;
+
+    snprintf(dir, sizeof(dir), "%s/%s", scripts, action_name(action));
+
+    if (read_value(dir, "cpu.stat", "usage_usec", &v) == 0)
+        *cpu_usec = v;
+    if (read_value(dir, "memory.peak", NULL, &v) == 0)
+        *memory_peak = v;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
@@ -34,7 +34,7 @@ struct if_pat {
 };
 
 static struct if_pat *pats;
-static struct if_pat *memo;
+static __thread struct if_pat *memo;
 
 
 int
@@ -151,7 +151,7 @@ has_meta(char *s)
 int
 try_probe(char *iface)
 {
-    return run_netplug(iface, "probe") == 0 ? 1 : 0;
+    return run_netplug(NULL, iface, "probe") == 0 ? 1 : 0;
 }
 
 
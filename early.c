@@ -0,0 +1,175 @@
+/*
+ * early.c - let scripts say they are done before they exit
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * An "in" script may have the interface usable long before it exits,
+ * with a helper left running, or slow work still to do.  Every script
+ * inherits one end of a datagram socket pair, its number in
+ * NETPLUG_NOTIFY_FD, and may write READY or FAILED to it:
+ *
+ *     echo READY >&$NETPLUG_NOTIFY_FD
+ *
+ * The state machine then takes the script as having exited, with
+ * status 0 or 1, and forgets it; whatever it goes on to do is its own
+ * business, though its exit is still looked for.  With MAX_DETACHED
+ * such scripts for an interface still running, the next one to say
+ * it is done is waited for as usual.  The kernel tells us who sent
+ * each message.  Scripts lead process groups of their own, so one
+ * sent by anything the script started, and left in its group, counts
+ * as the script's.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "netplug.h"
+
+/* Where scripts find their end: shells only manage single digits,
+   as in >&3. */
+#define SCRIPT_FD       3
+
+static int fds[2] = { -1, -1 };  /* ours, and the scripts' */
+
+
+void
+early_open(void)
+{
+    int one = 1;
+
+    if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) == -1) {
+        do_log(LOG_ERR, "can't create script notify socket: %m");
+        exit(1);
+    }
+
+    /* Scripts only ever write to theirs. */
+    shutdown(fds[1], SHUT_RD);
+
+    if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1 ||
+        setsockopt(fds[0], SOL_SOCKET, SO_PASSCRED, &one,
+                   sizeof(one)) == -1) {
+        do_log(LOG_ERR, "can't set up script notify socket: %m");
+        exit(1);
+    }
+}
+
+
+int
+early_fd(void)
+{
+    return fds[0];
+}
+
+
+/* What a script's NETPLUG_NOTIFY_FD is, or -1 if it has none. */
+int
+early_script_fd(void)
+{
+    return fds[1] == -1 ? -1 : SCRIPT_FD;
+}
+
+
+/* In a newly forked script: put the scripts' end where it is said to
+   be, to be kept across exec().  Everything of the daemon's is closed
+   on exec, so whatever was there is no loss. */
+void
+early_inherit(void)
+{
+    if (fds[1] == SCRIPT_FD)
+        fcntl(fds[1], F_SETFD, 0);
+    else if (fds[1] != -1)
+        dup2(fds[1], SCRIPT_FD);
+}
+
+
+/* What the message says, as an exit status, or -1 if it makes no
+   sense. */
+static int
+parse(char *buf, int len)
+{
+    while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+        len--;
+    buf[len] = '\0';
+
+    if (strcmp(buf, "READY") == 0)
+        return 0;
+    if (strcmp(buf, "FAILED") == 0)
+        return 1 << 8;
+
+    return -1;
+}
+
+
+/* Hand each message waiting to func, as the early exit of the script
+   that sent it. */
+void
+early_receive(void (*func)(struct child_exit *))
+{
+    char buf[64];
+    char cbuf[CMSG_SPACE(sizeof(struct ucred))];
+    struct iovec iov = { buf, sizeof(buf) - 1 };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    int len;
+
+    for (;;) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        if ((len = recvmsg(fds[0], &msg, MSG_CMSG_CLOEXEC)) == -1) {
+            if (errno != EAGAIN && errno != EINTR)
+                do_log(LOG_ERR, "script notify socket: %m");
+            return;
+        }
+
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        struct ucred cred;
+
+        if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_CREDENTIALS)
+            continue;
+        memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+
+        struct child_exit ce = { .early = 1 };
+        pid_t group = getpgid(cred.pid);
+
+        /* If it has gone already, take it for the script itself. */
+        ce.pid = group == -1 ? cred.pid : group;
+
+        if ((ce.status = parse(buf, len)) == -1) {
+            do_log(LOG_WARNING, "pid %d sent \"%s\" to NETPLUG_NOTIFY_FD; "
+                   "expected READY or FAILED", cred.pid, buf);
+            continue;
+        }
+
+        func(&ce);
+    }
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
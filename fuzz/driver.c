@@ -0,0 +1,307 @@
+/*
+ * driver.c - run a fuzz target without libFuzzer
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * netplugd is written with GCC's nested functions, which clang does
+ * not have, so the targets can't be linked with libFuzzer.  This runs
+ * them on the files it is given, which is all AFL++ (afl-gcc-fast)
+ * needs, or for a while on random inputs or random mutations of the
+ * files, reporting how fast it went.
+ *
+ * A target that fails aborts, or exits through one of the daemon's
+ * fatal error paths; either way the input is saved to crash-input
+ * first, so that it can be run again.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fuzz.h"
+
+#define MAX_INPUT       65536
+
+static uint8_t input[MAX_INPUT];
+static size_t input_len;
+static int running;
+
+
+static void
+save_input(void)
+{
+    FILE *fp;
+
+    if (!running || (fp = fopen("crash-input", "w")) == NULL)
+        return;
+
+    fwrite(input, 1, input_len, fp);
+    fclose(fp);
+    fprintf(stderr, "input saved in crash-input\n");
+    running = 0;
+}
+
+
+static void
+crashed(int sig)
+{
+    save_input();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+
+static void
+run(void)
+{
+    running = 1;
+    LLVMFuzzerTestOneInput(input, input_len);
+    running = 0;
+}
+
+
+static int
+run_file(const char *path)
+{
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    input_len = fread(input, 1, sizeof(input), fp);
+    if (fp != stdin)
+        fclose(fp);
+
+    run();
+
+    return 0;
+}
+
+
+static unsigned long long
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* xorshift64*: quick, and plenty good enough for making up inputs */
+static uint64_t
+next_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+
+    return *state * 2685821657736338717ULL;
+}
+
+
+static struct seed {
+    uint8_t *data;
+    size_t len;
+} *seeds;
+
+static int nr_seeds;
+
+
+static int
+load_seed(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    if ((seeds = realloc(seeds, (nr_seeds + 1) * sizeof(*seeds))) == NULL ||
+        (seeds[nr_seeds].data = malloc(MAX_INPUT)) == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    seeds[nr_seeds].len = fread(seeds[nr_seeds].data, 1, MAX_INPUT, fp);
+    nr_seeds++;
+    fclose(fp);
+
+    return 0;
+}
+
+
+/* Make up an input, from nothing or from one of the seeds. */
+static void
+make_input(uint64_t *state, size_t max_len)
+{
+    if (nr_seeds == 0) {
+        input_len = next_random(state) % (max_len + 1);
+        for (size_t i = 0; i < input_len; i += 8) {
+            uint64_t r = next_random(state);
+
+            memcpy(&input[i], &r, input_len - i < 8 ? input_len - i : 8);
+        }
+        return;
+    }
+
+    struct seed *s = &seeds[next_random(state) % nr_seeds];
+    int changes = 1 + next_random(state) % 8;
+
+    input_len = s->len;
+    memcpy(input, s->data, input_len);
+
+    while (input_len && changes--) {
+        uint64_t r = next_random(state);
+        size_t at = (r >> 8) % input_len;
+
+        switch (r & 3) {
+        case 0:
+            input[at] ^= 1 << ((r >> 4) & 7);
+            break;
+        case 1:
+            input[at] = r >> 40;
+            break;
+        case 2:
+            input[at] = (r & 4) ? 0xff : 0;
+            break;
+        case 3:
+            input_len = at + 1;
+            break;
+        }
+    }
+}
+
+
+static void
+run_random(int seconds, size_t max_len, uint64_t seed)
+{
+    uint64_t state = seed ? seed : 1;
+    unsigned long long start = now_ns();
+    unsigned long long stop = start + seconds * 1000000000ULL;
+    unsigned long runs = 0;
+    unsigned long long bytes = 0;
+
+    fprintf(stderr, "seed %llu\n", (unsigned long long) seed);
+
+    do {
+        for (int batch = 0; batch < 100; batch++) {
+            make_input(&state, max_len);
+            run();
+            runs++;
+            bytes += input_len;
+        }
+    } while (now_ns() < stop);
+
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("inputs:       %lu\n", runs);
+    printf("bytes:        %llu\n", bytes);
+    printf("elapsed:      %.3f s\n", secs);
+    printf("throughput:   %.0f inputs/s, %.0f steps/s\n",
+           runs / secs, fuzz_ops / secs);
+}
+
+
+static void
+usage(char *progname, int exitcode)
+{
+    fprintf(stderr, "Usage: %s [-m] [-l max-length] [-s seconds] [-S seed] "
+            "[file ...]\n", progname);
+
+    fprintf(stderr, "\t-m\t\t"
+            "make random changes to the files, rather than run them\n");
+    fprintf(stderr, "\t-l max-length\t"
+            "longest random input to make (default 256)\n");
+    fprintf(stderr, "\t-s seconds\t"
+            "how long to make random inputs for (default 10)\n");
+    fprintf(stderr, "\t-S seed\t\t"
+            "start the random inputs from here (default: the time)\n");
+    fprintf(stderr, "With files, and no -m, runs each one once (\"-\" is "
+            "standard input).\n");
+
+    exit(exitcode);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int mutate = 0;
+    int seconds = 10;
+    size_t max_len = 256;
+    uint64_t seed = time(NULL);
+    int c;
+
+    while ((c = getopt(argc, argv, "hl:ms:S:")) != EOF) {
+        switch (c) {
+        case 'm':
+            mutate = 1;
+            break;
+        case 'l':
+            max_len = strtoul(optarg, NULL, 0);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'h':
+            usage(argv[0], 0);
+            break;
+        case '?':
+            usage(argv[0], 1);
+        }
+    }
+
+    if (max_len > MAX_INPUT || seconds < 1)
+        usage(argv[0], 1);
+
+    atexit(save_input);
+    signal(SIGABRT, crashed);
+    signal(SIGSEGV, crashed);
+    signal(SIGBUS, crashed);
+    signal(SIGFPE, crashed);
+
+    if (optind == argc || mutate) {
+        for (int i = optind; i < argc; i++) {
+            if (load_seed(argv[i]) == -1)
+                return 1;
+        }
+        run_random(seconds, max_len, seed);
+        return 0;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (run_file(argv[i]) == -1)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
@@ -0,0 +1,45 @@
+/*
+ * fuzz.h - shared by the fuzz targets and their driver
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef __fuzz_h
+#define __fuzz_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* The libFuzzer entry point, which every target defines. */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+/* State machine operations a target has done, for the driver to
+   report a rate. */
+extern unsigned long fuzz_ops;
+
+/* Scripts that never run, and a clock that only moves when told. */
+void stub_install(void);
+void stub_reset(void);
+int stub_running(void);
+pid_t stub_worker(int n);
+void stub_exited(pid_t pid);
+void stub_tick(unsigned long long ns);
+
+/* Check the n interfaces in infos, or every interface if infos is
+   NULL, and that the scripts the state machine thinks are running
+   are the ones that are; abort() if not. */
+struct if_info;
+void stub_check(const char *after, struct if_info **infos, int n);
+
+#endif /* __fuzz_h */
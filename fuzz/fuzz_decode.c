@@ -0,0 +1,95 @@
+/*
+ * fuzz_decode.c - feed arbitrary netlink datagrams to the daemon
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * The input is taken as one datagram's worth of netlink messages, as
+ * netlink_listen() would have received it.  Messages flagged
+ * NLM_F_MULTI at the start are handled as the initial dump, and the
+ * rest as events, as in the daemon; after each event, every script
+ * that was started "exits", in turn, as the input's last byte says.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "../netplug.h"
+#include "fuzz.h"
+
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static int installed;
+    static struct netns ns = { .id = 0, .nsfd = -1, .nlfd = -1, .sockfd = -1 };
+
+    if (!installed) {
+        stub_install();
+        installed = 1;
+    }
+
+    stub_reset();
+
+    /* Aligned, as a receive buffer would be. */
+    void *buf = malloc(size ? size : 1);
+    int status = size ? data[size - 1] << 8 : 0;
+    int len = size;
+    int dumping = 1;
+
+    memcpy(buf, data, size);
+
+    for (struct nlmsghdr *hdr = buf; NLMSG_OK(hdr, len);
+         hdr = NLMSG_NEXT(hdr, len)) {
+        struct link_event ev;
+
+        if (dumping && (hdr->nlmsg_flags & NLM_F_MULTI)) {
+            if_info_save_interface(hdr, &ns);
+            continue;
+        }
+
+        /* The daemon does this once its dump is in. */
+        if (dumping) {
+            int poll_flags(struct if_info *i) {
+                ifsm_flagpoll(i);
+                return 0;
+            }
+            for_each_iface(poll_flags);
+            dumping = 0;
+        }
+
+        if (link_event_decode(&ev, &ns, hdr) > 0)
+            if_info_handle_event(&ev);
+        stub_check("a message", NULL, 0);
+
+        while (stub_running()) {
+            ifsm_scriptdone(stub_worker(0), status);
+            stub_check("a script exit", NULL, 0);
+        }
+
+        fuzz_ops++;
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
@@ -0,0 +1,258 @@
+/*
+ * fuzz_ifsm.c - random interleavings of flag changes and script exits
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Each input byte is one thing happening to one of four interfaces:
+ *
+ *   bits 0-2   what: 0-2 a link event, 3 one that renames the
+ *              interface, 4 a script exits successfully, 5 one fails,
+ *              6 one is killed by a signal, 7 something else, below
+ *   bits 3-4   which interface
+ *   bit 5      the event has IFF_UP
+ *   bit 6      the event has IFF_RUNNING, if it has IFF_UP; the
+ *              kernel never reports one without the other
+ *   bit 7      a rename is to a name no pattern matches
+ *
+ * For script exits, bits 3-7 pick which of the running scripts it is.
+ * For 7, bits 5-7 say what else:
+ *
+ *   0          a flag poll
+ *   1          two seconds pass, and the watchdog runs
+ *   2-5        the interface's global address comes, tentative, or
+ *              done with duplicate address detection, goes, or fails
+ *              duplicate address detection
+ *   6          an event taking it down was lost, as netlink drops
+ *              them when we fall behind, and it comes up again
+ *   7          its script exits while its state is one that has none,
+ *              as if something had gone wrong, unseen, before
+ *
+ * The last two have the state machine start the interface over.  Its
+ * invariants are checked after every step.
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <wait.h>
+#include <net/if.h>
+#include <linux/if.h>
+#include <linux/if_addr.h>
+#include <linux/rtnetlink.h>
+
+#include "../netplug.h"
+#include "fuzz.h"
+
+#define NIFACES         4
+
+static char names[NIFACES][16];
+
+
+static void
+link_event(int n, unsigned flags)
+{
+    struct link_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.msgtype = RTM_NEWLINK;
+    ev.index = n + 1;
+    ev.flags = flags | IFF_BROADCAST | IFF_MULTICAST;
+    ev.operstate = flags & IFF_RUNNING ? IF_OPER_UP : IF_OPER_DOWN;
+    ev.mtu = 1500;
+    memcpy(ev.name, names[n], sizeof(ev.name));
+
+    if_info_handle_event(&ev);
+}
+
+
+static void
+address_event(int n, int msgtype, unsigned flags)
+{
+    struct link_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.msgtype = msgtype;
+    ev.index = n + 1;
+    ev.ifa.family = AF_INET6;
+    ev.ifa.prefixlen = 64;
+    ev.ifa.scope = RT_SCOPE_UNIVERSE;
+    ev.ifa.flags = flags;
+    ev.ifa.ip[0] = 0x20;
+    ev.ifa.ip[1] = 0x01;
+    ev.ifa.ip[15] = n + 1;
+    memcpy(ev.name, names[n], sizeof(ev.name));
+
+    if_info_handle_event(&ev);
+}
+
+
+static struct if_info *
+find(int n)
+{
+    struct if_info *found = NULL;
+
+    int match(struct if_info *info) {
+        if (info->index == n + 1) {
+            found = info;
+            return 1;
+        }
+        return 0;
+    }
+
+    for_each_iface(match);
+
+    return found;
+}
+
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static int installed;
+
+    if (!installed) {
+        stub_install();
+        installed = 1;
+    }
+
+    struct if_info *infos[NIFACES];
+
+    stub_reset();
+
+    /* Every interface starts out known, and down. */
+    for (int n = 0; n < NIFACES; n++) {
+        snprintf(names[n], sizeof(names[n]), "fuzz%d", n);
+        link_event(n, 0);
+        infos[n] = find(n);
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        int what = data[i] & 7;
+        int n = (data[i] >> 3) & 3;
+        unsigned flags = !(data[i] & 0x20) ? 0 :
+            data[i] & 0x40 ? IFF_UP | IFF_RUNNING | IFF_LOWER_UP : IFF_UP;
+        const char *step;
+
+        stub_tick(1000000);
+
+        switch (what) {
+        case 0: case 1: case 2:
+            link_event(n, flags);
+            step = "a link event";
+            break;
+
+        case 3:
+            if (data[i] & 0x80)
+                snprintf(names[n], sizeof(names[n]), "x%d", n);
+            else
+                snprintf(names[n], sizeof(names[n]), "fuzz%d%s", n,
+                         names[n][0] == 'f' && names[n][5] == '\0' ?
+                         "r" : "");
+            link_event(n, flags);
+            step = "a rename";
+            break;
+
+        case 4: case 5: case 6:
+            if (stub_running() == 0)
+                continue;
+
+            pid_t pid = stub_worker((data[i] >> 3) % stub_running());
+            int status = what == 4 ? 0 : what == 5 ? 1 << 8 : SIGTERM;
+
+            if (!ifsm_scriptdone(pid, status)) {
+                fprintf(stderr, "pid %d exited, but nothing knew it\n", pid);
+                abort();
+            }
+            step = "a script exit";
+            break;
+
+        case 7:
+        default:
+            switch (data[i] >> 5) {
+            case 0:
+                ifsm_flagpoll(infos[n]);
+                step = "a flag poll";
+                break;
+
+            case 1:
+                stub_tick(2000000000ULL);
+                ifsm_expire();
+                step = "the watchdog";
+                break;
+
+            case 2:
+                address_event(n, RTM_NEWADDR, IFA_F_TENTATIVE);
+                step = "a tentative address";
+                break;
+
+            case 3:
+                address_event(n, RTM_NEWADDR, 0);
+                step = "an address";
+                break;
+
+            case 4:
+                address_event(n, RTM_DELADDR, 0);
+                step = "an address going";
+                break;
+
+            case 5:
+                address_event(n, RTM_NEWADDR, IFA_F_DADFAILED);
+                step = "an address failing DAD";
+                break;
+
+            case 6:
+                infos[n]->flags &= ~(IFF_UP | IFF_RUNNING | IFF_LOWER_UP);
+                link_event(n, IFF_UP | IFF_RUNNING | IFF_LOWER_UP);
+                step = "a lost down event";
+                break;
+
+            case 7: {
+                static const enum ifstate none[] = {
+                    ST_INACTIVE, ST_INSANE, ST_DOWN,
+                };
+                pid_t pid = infos[n]->worker;
+
+                if (pid == -1)
+                    continue;
+
+                stub_exited(pid);
+                infos[n]->state = none[pid % 3];
+                if (!ifsm_scriptdone(pid, 0)) {
+                    fprintf(stderr, "pid %d exited, but nothing knew "
+                            "it\n", pid);
+                    abort();
+                }
+                step = "a script exit in the wrong state";
+                break;
+            }
+            }
+            break;
+        }
+
+        fuzz_ops++;
+        stub_check(step, infos, NIFACES);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
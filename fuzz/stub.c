@@ -0,0 +1,241 @@
+/*
+ * stub.c - stand-ins for scripts and the clock, for the fuzz targets
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "../netplug.h"
+#include "fuzz.h"
+
+int use_syslog;
+int debug;
+
+unsigned long fuzz_ops;
+
+#define MAX_RUNNING     1024
+
+/* Scripts "running", in the order they were started; one told to stop
+   runs on until the input says it exits, as one would. */
+static struct script {
+    pid_t pid;
+    struct if_info *info;
+    int stopped;
+} running[MAX_RUNNING];
+
+static int nr_running;
+static pid_t next_pid;
+static unsigned long long now;
+
+
+static pid_t
+stub_spawn(struct if_info *info, char *action)
+{
+    if (nr_running == MAX_RUNNING) {
+        fprintf(stderr, "more than %d scripts running at once\n",
+                MAX_RUNNING);
+        abort();
+    }
+
+    running[nr_running].pid = next_pid;
+    running[nr_running].info = info;
+    running[nr_running].stopped = 0;
+    nr_running++;
+
+    return next_pid++;
+}
+
+
+static void
+stub_kill(pid_t pid)
+{
+    if (pid == -1)
+        return;
+
+    for (int i = 0; i < nr_running; i++) {
+        if (running[i].pid == pid && !running[i].stopped) {
+            running[i].stopped = 1;
+            return;
+        }
+    }
+
+    fprintf(stderr, "killed pid %d, which isn't running\n", pid);
+    abort();
+}
+
+
+/* The script will "exit" when the input says so, signalled or not. */
+static void
+stub_signal(pid_t pid, int sig)
+{
+}
+
+
+static unsigned long long
+stub_clock(void)
+{
+    return now;
+}
+
+
+void
+stub_install(void)
+{
+    /* Only the failed assertions; malformed input is expected. */
+    log_threshold = LOG_CRIT;
+
+    ifsm_hooks.spawn = stub_spawn;
+    ifsm_hooks.kill = stub_kill;
+    ifsm_hooks.signal = stub_signal;
+    ifsm_hooks.clock = stub_clock;
+
+    /* Short enough that the inputs get scripts through every stage of
+       the watchdog, and failed ones retried. */
+    ifsm_set_slow(1);
+    ifsm_set_timeout(-1, 3);
+    ifsm_set_timeout(ACT_OUT, 0);
+    ifsm_set_retry(-1, 2);
+    ifsm_set_retry(ACT_PROBE, 0);
+    ifsm_set_backoff(1000, 3000);
+
+    /* Everything but names starting with x, so that renames can take
+       interfaces out of our hands. */
+    save_pattern("[!x]*");
+}
+
+
+void
+stub_reset(void)
+{
+    if_info_clear();
+    nr_running = 0;
+    next_pid = 1000;
+    now = 1000000000ULL;
+}
+
+
+int
+stub_running(void)
+{
+    return nr_running;
+}
+
+
+/* Take script n off the list, as it is about to "exit". */
+pid_t
+stub_worker(int n)
+{
+    pid_t pid = running[n].pid;
+
+    memmove(&running[n], &running[n + 1],
+            (nr_running - n - 1) * sizeof(running[0]));
+    nr_running--;
+
+    return pid;
+}
+
+
+/* Take pid off the list, as it is about to "exit". */
+void
+stub_exited(pid_t pid)
+{
+    for (int i = 0; i < nr_running; i++) {
+        if (running[i].pid == pid) {
+            stub_worker(i);
+            return;
+        }
+    }
+
+    fprintf(stderr, "pid %d is to exit, but isn't running\n", pid);
+    abort();
+}
+
+
+void
+stub_tick(unsigned long long ns)
+{
+    now += ns;
+}
+
+
+void
+stub_check(const char *after, struct if_info **infos, int n)
+{
+    int workers = 0;
+
+    int check(struct if_info *info) {
+        const char *err = ifsm_check(info);
+
+        if (err) {
+            fprintf(stderr, "after %s, %s in state %s flags 0x%x "
+                    "worker %d: %s\n", after, info->name,
+                    statename(info->state), info->flags, info->worker, err);
+            abort();
+        }
+        if (info->worker != -1)
+            workers++;
+
+        return 0;
+    }
+
+    if (infos) {
+        for (int i = 0; i < n; i++)
+            check(infos[i]);
+    } else {
+        for_each_iface(check);
+    }
+
+    int started = 0;
+
+    for (int i = 0; i < nr_running; i++) {
+        struct script *s = &running[i];
+
+        /* Stopped and SIGKILLed, it has been forgotten in favour of
+           another it was stopped for; it is as good as gone. */
+        if (s->stopped && s->info->stopping != s->pid) {
+            memmove(s, s + 1, (nr_running - i - 1) * sizeof(*s));
+            nr_running--;
+            i--;
+            continue;
+        }
+
+        if (!s->stopped)
+            started++;
+
+        if (s->stopped ? s->info->worker == s->pid :
+            s->info->worker != s->pid) {
+            fprintf(stderr, "after %s, pid %d is %s for %s, whose "
+                    "worker is %d\n", after, s->pid,
+                    s->stopped ? "stopping" : "running",
+                    s->info->name, s->info->worker);
+            abort();
+        }
+    }
+
+    if (workers != started) {
+        fprintf(stderr, "after %s, %d interfaces have workers, but %d "
+                "scripts are running\n", after, workers, started);
+        abort();
+    }
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
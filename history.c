@@ -0,0 +1,166 @@
+/*
+ * history.c - remember each interface's recent state machine events
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Every if_info carries a small ring of its last HISTORY_LEN events,
+ * so recording one is a few stores and never allocates.  The rings
+ * are written out on SIGUSR1 and when an assertion fails.
+ *
+ * A dump on SIGUSR1 reads the rings from the main thread even when
+ * shards own the interfaces.  Interfaces and entries are only counted
+ * once they are fully written, but the oldest entry, being overwritten
+ * at that very moment, may come out garbled.  That is the price of not
+ * stopping the shards for what is only a diagnostic.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "netplug.h"
+
+static const char *history_path;
+
+
+void
+history_set_file(const char *path)
+{
+    history_path = path;
+}
+
+
+/* Note an event that took info from state from and flags oldflags to
+   where it is now.  status is the exit status of the script whose
+   exit caused it, or -1. */
+void
+history_add(struct if_info *info, enum ifstate from, unsigned oldflags,
+            int status)
+{
+    unsigned n = info->history_next;
+    struct history_entry *h = &info->history[n % HISTORY_LEN];
+
+    h->ns = monotonic_ns();
+    h->old_flags = oldflags;
+    h->new_flags = info->flags;
+    h->from = from;
+    h->to = info->state;
+    h->worker = info->worker;
+    h->status = status;
+
+    __atomic_store_n(&info->history_next, n + 1, __ATOMIC_RELEASE);
+}
+
+
+static void
+put(int fd, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+static void
+put(int fd, const char *fmt, ...)
+{
+    char buf[256];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (n >= sizeof(buf))
+        n = sizeof(buf) - 1;
+
+    while (n > 0) {
+        ssize_t w = write(fd, buf, n);
+
+        if (w == -1 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            break;
+        n -= w;
+    }
+}
+
+
+/* Write every interface's history to fd, oldest event first, with
+   times relative to now. */
+void
+history_dump(int fd)
+{
+    unsigned long long now = monotonic_ns();
+
+    int dump_one(struct if_info *info) {
+        unsigned n = __atomic_load_n(&info->history_next, __ATOMIC_ACQUIRE);
+        unsigned first = n > HISTORY_LEN ? n - HISTORY_LEN : 0;
+
+        if (!if_match(info->name))
+            return 0;
+
+        put(fd, "%s (netns %d, index %d): state %s flags 0x%08x worker %d\n",
+            info->name, info->netns, info->index, statename(info->state),
+            info->flags, info->worker);
+
+        for (unsigned i = first; i < n; i++) {
+            struct history_entry *h = &info->history[i % HISTORY_LEN];
+            long long ago = now - h->ns;
+
+            put(fd, "  %+11.6f %-10s -> %-10s flags 0x%08x -> 0x%08x "
+                "worker %d", -ago / 1e9, statename(h->from),
+                statename(h->to), h->old_flags, h->new_flags, h->worker);
+            if (h->status != -1)
+                put(fd, " status %d", h->status);
+            put(fd, "\n");
+        }
+
+        return 0;
+    }
+
+    for_each_iface_all(dump_one);
+}
+
+
+/* Write the history to the history file, or to stderr if there is
+   none.  Returns 0 on success. */
+int
+history_write(void)
+{
+    int fd = STDERR_FILENO;
+
+    if (history_path &&
+        (fd = open(history_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0644)) == -1) {
+        do_log(LOG_ERR, "%s: %m", history_path);
+        return -1;
+    }
+
+    history_dump(fd);
+
+    if (fd != STDERR_FILENO)
+        close(fd);
+
+    return 0;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
@@ -0,0 +1,233 @@
+/*
+ * hooks.c - run a directory of hooks for an action, instead of the script
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * With --hooks, an action with a directory DIR/ACTION.d runs every
+ * executable in it, with the same arguments and environment the
+ * script would have had, instead of the script.  Names are as
+ * run-parts(8) takes them: letters, digits, underscores and hyphens.
+ * One that starts with a number, such as 10-routes, runs after every
+ * hook with a lower number has exited, alongside any others with the
+ * same number; the rest have no order, and all start at once.  If a
+ * numbered hook fails, no later numbers are started.
+ *
+ * The process the state machine starts, and waits for, stays in
+ * between: it is the hooks' parent, and exits, 0 if all of them
+ * succeeded and 1 if not, once the last one has.  It leads their
+ * process group, and is in their cgroup, so they are timed, stopped
+ * and accounted together, as one script would be.
+ *
+ * It is a fork of the daemon that never exec()s, so any lock another
+ * thread held at the time stays held.  do_log() knows, after
+ * log_forked(), and takes none; see log.c.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "netplug.h"
+
+static const char *hooks_dir;   /* DIR, or NULL without --hooks */
+
+struct hook {
+    char path[PATH_MAX];
+    long stage;                 /* its number, or -1 for none */
+    pid_t pid;                  /* while it runs, or -1 */
+};
+
+
+void
+hooks_use(const char *dir)
+{
+    hooks_dir = dir;
+}
+
+
+/* Is there a hook directory for action?  If so, path is set to it. */
+int
+hooks_path(const char *action, char *path, size_t size)
+{
+    struct stat st;
+
+    if (hooks_dir == NULL)
+        return 0;
+
+    snprintf(path, size, "%s/%s.d", hooks_dir, action);
+
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+
+static int
+valid_name(const struct dirent *d)
+{
+    const char *p = d->d_name;
+
+    for (; *p; p++) {
+        if (!isalnum((unsigned char) *p) && *p != '_' && *p != '-')
+            return 0;
+    }
+
+    return 1;
+}
+
+
+static int
+by_stage(const void *a, const void *b)
+{
+    const struct hook *x = a, *y = b;
+
+    return (x->stage > y->stage) - (x->stage < y->stage);
+}
+
+
+/* In a newly forked script: run the hooks in dir, and exit once they
+   are done. */
+void
+hooks_run(const char *dir, char *ifname, char *action)
+{
+    struct dirent **names;
+    int n = scandir(dir, &names, valid_name, alphasort);
+
+    if (n == -1) {
+        do_log(LOG_ERR, "%s: %m", dir);
+        _exit(1);
+    }
+
+    /* Not xmalloc(): its exit() would run the daemon's atexit()
+       handlers here. */
+    struct hook *hooks = malloc((n ? n : 1) * sizeof(*hooks));
+
+    if (hooks == NULL) {
+        do_log(LOG_ERR, "malloc: %m");
+        _exit(1);
+    }
+
+    int nhooks = 0;
+
+    for (int i = 0; i < n; i++) {
+        struct hook *h = &hooks[nhooks];
+        struct stat st;
+
+        snprintf(h->path, sizeof(h->path), "%s/%s", dir, names[i]->d_name);
+        h->stage = isdigit((unsigned char) names[i]->d_name[0]) ?
+            strtol(names[i]->d_name, NULL, 10) : -1;
+        h->pid = -1;
+
+        if (stat(h->path, &st) == 0 && S_ISREG(st.st_mode) &&
+            access(h->path, X_OK) == 0)
+            nhooks++;
+    }
+
+    qsort(hooks, nhooks, sizeof(*hooks), by_stage);
+
+    /* We never exec(), so the daemon's handlers are still here. */
+    for (int sig = 1; sig < NSIG; sig++)
+        signal(sig, SIG_DFL);
+
+    int running = 0, failed = 0, halted = 0;
+
+    void start(struct hook *h) {
+        if ((h->pid = fork()) == 0) {
+            execl(h->path, h->path, ifname, action, NULL);
+            do_log(LOG_ERR, "%s: %m", h->path);
+            _exit(1);
+        }
+
+        if (h->pid == -1) {
+            do_log(LOG_ERR, "fork: %m");
+            failed = 1;
+            halted |= h->stage != -1;
+        } else {
+            running++;
+        }
+    }
+
+    /* Wait for one hook to exit; returns the stage it was in. */
+    long reap(void) {
+        int status;
+        pid_t pid = wait(&status);
+
+        if (pid == -1) {
+            do_log(LOG_ERR, "wait: %m");
+            _exit(1);
+        }
+
+        for (int i = 0; i < nhooks; i++) {
+            if (hooks[i].pid != pid)
+                continue;
+
+            hooks[i].pid = -1;
+            running--;
+            if (status != 0) {
+                if (WIFSIGNALED(status))
+                    do_log(LOG_ERR, "%s %s: %s killed by signal %d",
+                           ifname, action, hooks[i].path, WTERMSIG(status));
+                else
+                    do_log(LOG_ERR, "%s %s: %s failed, exit status %d",
+                           ifname, action, hooks[i].path,
+                           WEXITSTATUS(status));
+                failed = 1;
+                halted |= hooks[i].stage != -1;
+            }
+            return hooks[i].stage;
+        }
+
+        return -1;
+    }
+
+    int i = 0;
+
+    for (; i < nhooks && hooks[i].stage == -1; i++)
+        start(&hooks[i]);
+
+    while (i < nhooks && !halted) {
+        long stage = hooks[i].stage;
+        int before = running;
+
+        for (; i < nhooks && hooks[i].stage == stage; i++)
+            start(&hooks[i]);
+
+        int left = running - before;
+
+        while (left) {
+            if (reap() == stage)
+                left--;
+        }
+    }
+
+    while (running)
+        reap();
+
+    _exit(failed);
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
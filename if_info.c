@@ -18,21 +18,42 @@
  * General Public License for more details.
  */
 
+#include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <assert.h>
+#include <signal.h>
 #include <time.h>
 #include <wait.h>
 #include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if.h>
 
 #include "netplug.h"
 
-#define INFOHASHSZ      16      /* must be a power of 2 */
+#define INFOHASHSZ      4096    /* must be a power of 2 */
 static struct if_info *if_info[INFOHASHSZ];
 
-static const char *
+/* Link events are numbered as they are decoded, whichever thread that
+   is on. */
+static unsigned long long next_event_id;
+
+static inline int
+info_hash(int netns, int index)
+{
+    return (netns * 31 + index) & (INFOHASHSZ-1);
+}
+
+int
+if_info_bucket(int netns, int index)
+{
+    return info_hash(netns, index);
+}
+
+const char *
 statename(enum ifstate s)
 {
     switch(s) {
@@ -95,17 +116,569 @@ flags_str(char *buf, unsigned int fl)
     return buf;
 }
 
+/* As in /sys/class/net/IFNAME/operstate */
+static const char *
+operstate_name(int operstate)
+{
+    static const char *names[] = {
+        [IF_OPER_UNKNOWN] = "unknown",
+        [IF_OPER_NOTPRESENT] = "notpresent",
+        [IF_OPER_DOWN] = "down",
+        [IF_OPER_LOWERLAYERDOWN] = "lowerlayerdown",
+        [IF_OPER_TESTING] = "testing",
+        [IF_OPER_DORMANT] = "dormant",
+        [IF_OPER_UP] = "up",
+    };
+
+    if (operstate < 0 || operstate >= sizeof(names) / sizeof(names[0]) ||
+        names[operstate] == NULL)
+        return "unknown";
+
+    return names[operstate];
+}
+
+struct script_env {
+    char *vars[16];
+    int n;
+    char buf[1024];
+    size_t used;
+};
+
+static void
+env_add(struct script_env *env, const char *fmt, ...)
+    __attribute__ ((format (printf, 2, 3)));
+
+static void
+env_add(struct script_env *env, const char *fmt, ...)
+{
+    size_t room = sizeof(env->buf) - env->used;
+    va_list ap;
+    int n;
+
+    assert(env->n < sizeof(env->vars) / sizeof(env->vars[0]) - 1);
+
+    va_start(ap, fmt);
+    n = vsnprintf(env->buf + env->used, room, fmt, ap);
+    va_end(ap);
+
+    assert(n >= 0 && n < room);
+
+    env->vars[env->n++] = env->buf + env->used;
+    env->vars[env->n] = NULL;
+    env->used += n + 1;
+}
+
+/* Scripts get what we already know of the interface in their
+   environment, so they need not ask the kernel again, and are told
+   which event they are being run for, so that what they log can be
+   matched up with ours. */
+static pid_t
+run_script(struct if_info *info, char *action)
+{
+    struct script_env env = { .n = 0, .used = 0 };
+    char mac[3 * sizeof(info->addr)] = "", *cp = mac;
+
+    if (info->addr_len <= sizeof(info->addr)) {
+        for (int i = 0; i < info->addr_len; i++)
+            cp += sprintf(cp, "%s%02x", i ? ":" : "", info->addr[i]);
+    }
+
+    env_add(&env, "NETPLUG_IFINDEX=%d", info->index);
+    env_add(&env, "NETPLUG_TYPE=%d", info->type);
+    env_add(&env, "NETPLUG_KIND=%s", info->kind);
+    env_add(&env, "NETPLUG_MAC=%s", mac);
+    env_add(&env, "NETPLUG_MTU=%u", info->mtu);
+    env_add(&env, "NETPLUG_OPERSTATE=%s", operstate_name(info->operstate));
+    env_add(&env, "NETPLUG_MASTER_IFINDEX=%d", info->master);
+    env_add(&env, "NETPLUG_CARRIER_CHANGES=%u", info->flaps);
+    env_add(&env, "NETPLUG_PREV_STATE=%s", statename(info->prev_state));
+
+    if (info->event_id) {
+        env_add(&env, "NETPLUG_EVENT_ID=%llu", info->event_id);
+        env_add(&env, "NETPLUG_EVENT_TS=%llu", info->event_rx);
+    }
+
+    if (early_script_fd() != -1)
+        env_add(&env, "NETPLUG_NOTIFY_FD=%d", early_script_fd());
+
+    return run_netplug_bg(netns_get(info->netns), info->name, action,
+                          env.vars);
+}
+
+/* The state machine's view of the outside world.  netplugd-replay
+   swaps in fakes for starting and killing scripts. */
+struct ifsm_hooks ifsm_hooks = {
+    .spawn = run_script,
+    .kill = kill_script,
+    .signal = signal_script,
+    .clock = monotonic_ns,
+};
+
+static void
+transitioned(struct if_info *info, enum ifstate from)
+{
+    /* Each time it is ACTIVE, it is ready once. */
+    if (info->state != ST_ACTIVE)
+        info->ready = 0;
+
+    metrics_inc(transitions[from][info->state]);
+    notify_transition(info, from);
+    state_publish(info);
+    NP_TRACE(transition, info->event_id, info->netns, info->index, from,
+             info->state);
+
+    if (ifsm_hooks.transition)
+        ifsm_hooks.transition(info, from);
+}
+
+/*
+ * The watchdog.  A running script has a timer for the next thing that
+ * is to happen to it: a warning, once it has been running long enough
+ * to be worth one, then SIGTERM at its action's deadline, then
+ * SIGKILL.  wd_stage says which it is waiting for.  The timers are on
+ * the wheel of the thread running the state machine for the
+ * interface, as the interfaces are; see timer.c.
+ */
+#define WD_SLOW         NR_ACTIONS
+#define WD_KILL         (NR_ACTIONS + 1)
+#define WD_STAGES       (NR_ACTIONS + 2)
+
+#define NS_PER_SEC      1000000000ULL
+#define KILL_GRACE      (5 * NS_PER_SEC) /* from SIGTERM to SIGKILL */
+#define STOP_GRACE      (1 * NS_PER_SEC) /* the same, for stop_worker() */
+
+#define timer_info(t, field) \
+    ((struct if_info *) ((char *) (t) - offsetof(struct if_info, field)))
+
+static unsigned long long wd_wait[WD_STAGES] = {
+    [WD_SLOW] = 30 * NS_PER_SEC,
+    [WD_KILL] = KILL_GRACE,
+};
+
+/* How long a script may run before it is killed; 0 for ever.  An
+   action of -1 sets them all. */
 void
-for_each_iface(int (*func)(struct if_info *))
+ifsm_set_timeout(int action, unsigned seconds)
+{
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        if (action == -1 || action == a)
+            wd_wait[a] = seconds * NS_PER_SEC;
+    }
+}
+
+/* How long a script may run before we warn about it; 0 for ever. */
+void
+ifsm_set_slow(unsigned seconds)
+{
+    wd_wait[WD_SLOW] = seconds * NS_PER_SEC;
+}
+
+static void
+wd_unlink(struct if_info *info)
+{
+    timer_cancel(&info->wd_timer);
+    info->wd_stage = -1;
+}
+
+/* Wait for stage, once its wait from since has passed. */
+static void
+wd_append(struct if_info *info, int stage, unsigned long long since)
+{
+    info->wd_stage = stage;
+    timer_add(&info->wd_timer, since + wd_wait[stage]);
+}
+
+/* Start watching the script just started for info. */
+static void
+wd_start(struct if_info *info)
+{
+    unsigned long long slow = wd_wait[WD_SLOW];
+    unsigned long long deadline = wd_wait[info->action];
+
+    wd_unlink(info);
+    info->wd_signal = 0;
+
+    if (slow && (deadline == 0 || slow < deadline))
+        wd_append(info, WD_SLOW, info->spawn_ns);
+    else if (deadline)
+        wd_append(info, info->action, info->spawn_ns);
+}
+
+/* A script's time is up.  One that is both slow and past its deadline
+   goes straight on to the next stage, as that is already due. */
+static void
+wd_expire(struct timer *t)
+{
+    struct if_info *info = timer_info(t, wd_timer);
+    unsigned long long now = ifsm_hooks.clock();
+    unsigned long long ran = now - info->spawn_ns;
+    int stage = info->wd_stage;
+
+    info->wd_stage = -1;
+
+    if (stage == WD_SLOW) {
+        do_log(LOG_WARNING, "%s: %s script pid %d still running "
+               "after %llus", info->name, statename(info->state),
+               info->worker, ran / NS_PER_SEC);
+        metrics_inc(slow);
+        if (wd_wait[info->action])
+            wd_append(info, info->action, info->spawn_ns);
+    } else if (stage == WD_KILL) {
+        do_log(LOG_ERR, "%s: script pid %d ignored SIGTERM; "
+               "killing it", info->name, info->worker);
+        metrics_inc(killed);
+        ifsm_hooks.signal(info->worker, SIGKILL);
+        info->wd_signal = SIGKILL;
+    } else {
+        do_log(LOG_ERR, "%s: %s script pid %d timed out after "
+               "%llus; terminating it", info->name,
+               statename(info->state), info->worker,
+               ran / NS_PER_SEC);
+        metrics_inc(timed_out[stage]);
+        ifsm_hooks.signal(info->worker, SIGTERM);
+        info->wd_signal = SIGTERM;
+        wd_append(info, WD_KILL, now);
+    }
+}
+
+static pid_t spawn(struct if_info *info, enum ifstate from, char *action);
+
+/* Start the script spawn() held back while the one told to stop was
+   still there, if there is one. */
+static void
+start_deferred(struct if_info *info)
+{
+    char *action = info->deferred;
+
+    if (action == NULL)
+        return;
+
+    info->deferred = NULL;
+    info->worker = spawn(info, info->prev_state, action);
+}
+
+/* The worker that was told to stop has had long enough: nothing of it
+   will run once it has SIGKILL, so what is to come next need not wait
+   for it to be reaped as well. */
+static void
+stop_expire(struct timer *t)
+{
+    struct if_info *info = timer_info(t, stop_timer);
+
+    do_log(LOG_ERR, "%s: script pid %d ignored SIGTERM; killing it",
+           info->name, info->stopping);
+    ifsm_hooks.signal(info->stopping, SIGKILL);
+    start_deferred(info);
+}
+
+/* Tell info's worker to stop, and forget it, so that the state machine
+   can move on at once.  It gets SIGTERM now, and SIGKILL if it is
+   still there STOP_GRACE later; its exit is nothing to the state
+   machine.  Until then, the next script spawn() is asked for waits:
+   scripts for one interface never overlap.  Stopping one that has not
+   started yet just forgets it. */
+static void
+stop_worker(struct if_info *info)
+{
+    if (info->worker == -1) {
+        info->deferred = NULL;
+        return;
+    }
+
+    ifsm_hooks.kill(info->worker);
+    wd_unlink(info);
+    info->stopping = info->worker;
+    timer_add(&info->stop_timer, ifsm_hooks.clock() + STOP_GRACE);
+}
+
+/* Forget whatever info was doing, scripts and retries and all, and
+   leave it in state. */
+static void
+start_over(struct if_info *info, enum ifstate state)
+{
+    stop_worker(info);
+    info->worker = -1;
+    info->action = -1;
+    timer_cancel(&info->retry_timer);
+    info->retries = 0;
+    info->state = state;
+}
+
+/* Something has happened that info's state has no way to take, so an
+   event before it must have been lost, or misread.  Rather than take
+   every other interface down with us, info starts over from what its
+   flags are now, as if it had just turned up. */
+static void
+recover(struct if_info *info, unsigned flags, const char *what)
+{
+    do_log(LOG_ERR, "%s: %s in state %s; starting it over", info->name,
+           what, statename(info->state));
+    metrics_inc(recovered);
+    start_over(info, flags & IFF_UP ? ST_INACTIVE : ST_DOWN);
+}
+
+/*
+ * Retries.  A script that fails is run again, if its action allows
+ * any, up to that many times, after a wait that starts at
+ * retry_initial and doubles each time, up to retry_max, less up to
+ * half of it at random, so that interfaces and hosts that failed
+ * together spread their retries out.
+ */
+static unsigned retry_attempts[NR_ACTIONS];
+static unsigned long long retry_initial = 1 * NS_PER_SEC;
+static unsigned long long retry_max = 60 * NS_PER_SEC;
+
+/* How many times a failed script is run again; 0 for never.  An
+   action of -1 sets them all. */
+void
+ifsm_set_retry(int action, unsigned attempts)
+{
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        if (action == -1 || action == a)
+            retry_attempts[a] = attempts;
+    }
+}
+
+/* The first wait before a retry, and the longest, in milliseconds. */
+void
+ifsm_set_backoff(unsigned initial_ms, unsigned max_ms)
+{
+    retry_initial = initial_ms * 1000000ULL;
+    retry_max = max_ms * 1000000ULL;
+}
+
+/* info's script for action has failed, at now; run it again later,
+   if it has tries left, and its failure left it where a retry can
+   start from; see retry_run(). */
+static void
+retry_schedule(struct if_info *info, int action, unsigned long long now)
+{
+    static const enum ifstate from[NR_ACTIONS] = {
+        [ACT_PROBE] = ST_DOWN,
+        [ACT_IN] = ST_INSANE,
+        [ACT_OUT] = ST_INACTIVE,
+        [ACT_READY] = ST_ACTIVE,
+    };
+
+    if (action < 0 || retry_attempts[action] == 0 ||
+        info->state != from[action])
+        return;
+
+    if (info->retries >= retry_attempts[action]) {
+        do_log(LOG_WARNING, "%s: %s script failed %u times; giving up",
+               info->name, action_name(action), info->retries + 1);
+        return;
+    }
+
+    unsigned long long wait = retry_initial;
+
+    for (unsigned n = 0; n < info->retries && wait < retry_max; n++)
+        wait *= 2;
+    if (wait > retry_max)
+        wait = retry_max;
+
+    /* Jitter, from the time and the interface: no two hosts, or
+       interfaces, are likely to agree on either. */
+    unsigned long long r = (now ^ (info->index * 0x9e3779b97f4a7c15ULL) ^
+                            info->netns) * 0xbf58476d1ce4e5b9ULL;
+
+    r ^= r >> 31;
+    if (wait / 2)
+        wait -= r % (wait / 2);
+
+    info->retries++;
+    info->retry_action = action;
+    timer_add(&info->retry_timer, now + wait);
+
+    do_log(LOG_INFO, "%s: retrying %s script in %llums (attempt %u of %u)",
+           info->name, action_name(action), wait / 1000000,
+           info->retries, retry_attempts[action]);
+}
+
+/* How long until the watchdog, or a retry, next has something to do,
+   in milliseconds, or -1 if neither has anything waiting. */
+int
+ifsm_timeout(void)
+{
+    return timer_timeout(ifsm_hooks.clock());
+}
+
+/* Deal with every script whose time is up, and start any retries that
+   are due. */
+void
+ifsm_expire(void)
+{
+    timer_run(ifsm_hooks.clock());
+}
+
+/* Start a script for info, which was in state from before whatever
+   caused it, keeping track of what it is and when it started. */
+static pid_t
+spawn(struct if_info *info, enum ifstate from, char *action)
+{
+    unsigned long long start = ifsm_hooks.clock();
+
+    info->prev_state = from;
+    info->action = action_index(action);
+    timer_cancel(&info->retry_timer);
+
+    if (timer_pending(&info->stop_timer)) {
+        do_log(LOG_DEBUG, "%s: %s waits for pid %d to stop", info->name,
+               action, info->stopping);
+        info->deferred = action;
+        return -1;
+    }
+
+    pid_t pid = ifsm_hooks.spawn(info, action);
+    unsigned long long now = ifsm_hooks.clock();
+
+    info->spawn_ns = now;
+    info->worker_event = info->event_id;
+    info->worker = pid;
+    info->spawned++;
+    wd_start(info);
+
+    NP_TRACE(spawn, info->event_id, info->netns, info->index, pid, action);
+    do_log(LOG_DEBUG, "span event %llu spawn %s %s pid %d %lluus",
+           info->event_id, info->name, action, pid, (now - start) / 1000);
+
+    metrics_inc(started[info->action]);
+    hist_observe(&metrics.spawn, now - start);
+
+    if (info->event_ns) {
+        hist_observe(&metrics.event_to_spawn, now - info->event_ns);
+        info->event_ns = 0;
+    }
+
+    return pid;
+}
+
+/* A retry is due: run the script again, if info is still where its
+   failure left it. */
+static void
+retry_run(struct timer *t)
+{
+    struct if_info *info = timer_info(t, retry_timer);
+    enum ifstate state = info->state;
+    unsigned up = (info->flags & (IFF_UP | IFF_RUNNING));
+
+    switch (info->retry_action) {
+    case ACT_PROBE:
+        if (state == ST_DOWN && !(up & IFF_UP)) {
+            info->worker = spawn(info, state, "probe");
+            info->state = ST_PROBING;
+        }
+        break;
+
+    case ACT_IN:
+        if (state == ST_INSANE && up == (IFF_UP | IFF_RUNNING)) {
+            info->worker = spawn(info, state, "in");
+            info->state = ST_INNING;
+        }
+        break;
+
+    case ACT_OUT:
+        if (state == ST_INACTIVE && !(up & IFF_RUNNING)) {
+            info->worker = spawn(info, state, "out");
+            info->state = ST_OUTING;
+        }
+        break;
+
+    case ACT_READY:
+        if (state == ST_ACTIVE && info->ready && info->worker == -1)
+            info->worker = spawn(info, state, "ready");
+        break;
+    }
+
+    if (info->worker == -1 && info->deferred == NULL) {
+        do_log(LOG_INFO, "%s: no %s retry in state %s", info->name,
+               action_name(info->retry_action), statename(state));
+        info->retries = 0;
+        return;
+    }
+
+    metrics_inc(retries[info->retry_action]);
+
+    if (info->state != state) {
+        history_add(info, state, info->flags, -1);
+        transitioned(info, state);
+    }
+
+    online_check(info);
+}
+
+/* Inside a state machine shard, only that shard's buckets are visited;
+   see shard.c.  Other threads may walk them too, while the shard adds
+   to them: see if_info_get_interface(). */
+static void
+walk(int first, int step, int (*func)(struct if_info *))
 {
-    for(int i = 0; i < INFOHASHSZ; i++) {
-        for(struct if_info *info = if_info[i]; info != NULL; info = info->next) {
+    for(int i = first; i < INFOHASHSZ; i += step) {
+        for(struct if_info *info = __atomic_load_n(&if_info[i], __ATOMIC_ACQUIRE);
+            info != NULL;
+            info = __atomic_load_n(&info->next, __ATOMIC_ACQUIRE)) {
             if ((*func)(info))
                 return;
         }
     }
 }
 
+void
+for_each_iface(int (*func)(struct if_info *))
+{
+    if (shard_self >= 0)
+        walk(shard_self, shard_count(), func);
+    else
+        walk(0, 1, func);
+}
+
+/* Forget every interface, as if we had just started. */
+void
+if_info_clear(void)
+{
+    for (int i = 0; i < INFOHASHSZ; i++) {
+        while (if_info[i] != NULL) {
+            struct if_info *info = if_info[i];
+
+            if_info[i] = info->next;
+            free(info);
+        }
+    }
+
+    timer_clear();
+}
+
+/* Every interface, whichever shard owns it; for diagnostics only. */
+void
+for_each_iface_all(int (*func)(struct if_info *))
+{
+    walk(0, 1, func);
+}
+
+/* An interface's addresses are ready once it has one of global scope,
+   and none is still waiting on IPv6 duplicate address detection; an
+   optimistic address may be used meanwhile, and one that failed never
+   will be.  Without --addresses, it has none. */
+static int
+addresses_ready(const struct if_info *info)
+{
+    int global = 0;
+
+    for (int n = 0; n < info->naddrs; n++) {
+        const struct if_addr *a = &info->addrs[n];
+
+        if (a->flags & IFA_F_DADFAILED)
+            continue;
+        if ((a->flags & (IFA_F_TENTATIVE | IFA_F_OPTIMISTIC)) ==
+            IFA_F_TENTATIVE)
+            return 0;
+        if (a->scope == RT_SCOPE_UNIVERSE)
+            global = 1;
+    }
+
+    return global;
+}
+
 /* Reevaluate the state machine based on the current state and flag settings */
 void
 ifsm_flagpoll(struct if_info *info)
@@ -120,11 +693,11 @@ ifsm_flagpoll(struct if_info *info)
     case ST_INACTIVE:
         if (!(info->flags & IFF_UP)) {
             assert(info->worker == -1);
-            info->worker = run_netplug_bg(info->name, "probe");
+            info->worker = spawn(info, state, "probe");
             info->state = ST_PROBING;
         } else if (info->flags & IFF_RUNNING) {
             assert(info->worker == -1);
-            info->worker = run_netplug_bg(info->name, "in");
+            info->worker = spawn(info, state, "in");
             info->state = ST_INNING;
         }
         break;
@@ -142,9 +715,17 @@ ifsm_flagpoll(struct if_info *info)
 
     case ST_ACTIVE:
         if (!(info->flags & IFF_RUNNING)) {
-            assert(info->worker == -1);
-            info->worker = run_netplug_bg(info->name, "out");
+            stop_worker(info);
+            info->worker = spawn(info, state, "out");
             info->state = ST_OUTING;
+        } else if (!info->ready && addresses_ready(info)) {
+            /* The "ready" script runs with the interface ACTIVE, and
+               is killed if carrier goes before it is done. */
+            assert(info->worker == -1);
+            info->ready = 1;
+            do_log(LOG_INFO, "%s: addresses ready", info->name);
+            notify_ready(info);
+            info->worker = spawn(info, state, "ready");
         }
         break;
 
@@ -157,9 +738,14 @@ ifsm_flagpoll(struct if_info *info)
         break;
     }
 
-    if (info->state != state)
+    if (info->state != state) {
         do_log(LOG_DEBUG, "ifsm_flagpoll %s: moved from state %s to %s",
                info->name, statename(state), statename(info->state));
+        history_add(info, state, info->flags, -1);
+        transitioned(info, state);
+    }
+
+    online_check(info);
 }
 
 /* if_info state machine transitions caused by interface flag changes (edge triggered) */
@@ -171,11 +757,20 @@ ifsm_flagchange(struct if_info *info, unsigned int newflags)
     if (changed == 0)
         return;
 
-    char buf1[512], buf2[512];
-    do_log(LOG_INFO, "%s: state %s flags 0x%08x %s -> 0x%08x %s", info->name,
-           statename(info->state),
-           info->flags, flags_str(buf1, info->flags),
-           newflags, flags_str(buf2, newflags));
+    enum ifstate state = info->state;
+
+    do_log(LOG_INFO, "%s: state %s flags 0x%08x -> 0x%08x", info->name,
+           statename(info->state), info->flags, newflags);
+
+    /* Spelling the flags out is only worth it if someone will see it. */
+    if (log_enabled(LOG_DEBUG)) {
+        char buf1[512], buf2[512];
+        do_log(LOG_DEBUG, "%s: flags %s -> %s", info->name,
+               flags_str(buf1, info->flags), flags_str(buf2, newflags));
+    }
+
+    /* Whatever failed may go better now. */
+    info->retries = 0;
 
     /* XXX put interface state-change rate limiting here */
     if (0 /* flapping */) {
@@ -193,9 +788,17 @@ ifsm_flagchange(struct if_info *info, unsigned int newflags)
                 info->state = ST_PROBING_UP;
                 break;
 
+            case ST_DOWNANDOUT:
+                /* back up before the OUT script finished; let it,
+                   then take it from there */
+                info->state = ST_OUTING;
+                break;
+
             default:
-                do_log(LOG_ERR, "%s: unexpected state %s for UP", info->name, statename(info->state));
-                exit(1);
+                /* the RUNNING change, if any, and the flag poll
+                   below take it from there */
+                recover(info, newflags, "came UP");
+                break;
             }
         } else {
             /* interface went down */
@@ -222,20 +825,26 @@ ifsm_flagchange(struct if_info *info, unsigned int newflags)
                 /* All other states: kill off any scripts currently
                    running, and go into the PROBING state, attempting
                    to bring it up */
-                kill_script(info->worker);
+                stop_worker(info);
                 info->state = ST_PROBING;
-                info->worker = run_netplug_bg(info->name, "probe");
+                info->worker = spawn(info, state, "probe");
             }
         }
     }
 
     if (changed & IFF_RUNNING) {
+        info->flaps++;
+
         switch(info->state) {
         case ST_INACTIVE:
-            assert(!(info->flags & IFF_RUNNING));
             assert(info->worker == -1);
 
-            info->worker = run_netplug_bg(info->name, "in");
+            /* carrier that came while we weren't looking has gone
+               again; nothing was started for it */
+            if (!(newflags & IFF_RUNNING))
+                break;
+
+            info->worker = spawn(info, state, "in");
             info->state = ST_INNING;
             break;
 
@@ -250,9 +859,9 @@ ifsm_flagchange(struct if_info *info, unsigned int newflags)
 
         case ST_ACTIVE:
             assert(info->flags & IFF_RUNNING);
-            assert(info->worker == -1);
 
-            info->worker = run_netplug_bg(info->name, "out");
+            stop_worker(info);
+            info->worker = spawn(info, state, "out");
             info->state = ST_OUTING;
             break;
 
@@ -280,39 +889,142 @@ ifsm_flagchange(struct if_info *info, unsigned int newflags)
 
     do_log(LOG_DEBUG, "%s: moved to state %s; worker %d",
            info->name, statename(info->state), info->worker);
+    unsigned oldflags = info->flags;
+
     info->flags = newflags;
     info->lastchange = time(0);
+
+    history_add(info, state, oldflags, -1);
+
+    if (info->state != state)
+        transitioned(info, state);
+
+    /* Coming UP with carrier already there leaves us INACTIVE, with
+       nothing to say the carrier changed. */
+    if (info->state == ST_INACTIVE)
+        ifsm_flagpoll(info);
+
+    online_check(info);
 }
 
-/* handle a script termination and update the state accordingly */
-void ifsm_scriptdone(pid_t pid, int exitstatus)
+/* Check what must hold of info between events, whatever has happened
+   to it.  Returns NULL if all is well, or what is wrong. */
+const char *
+ifsm_check(const struct if_info *info)
 {
-    int exitok = WIFEXITED(exitstatus) && WEXITSTATUS(exitstatus) == 0;
-    struct if_info *info;
-    assert(WIFEXITED(exitstatus) || WIFSIGNALED(exitstatus));
+    int action = -1;
 
-    int find_pid(struct if_info *i) {
-        if (i->worker == pid) {
-            info = i;
-            return 1;
-        }
-        return 0;
+    switch (info->state) {
+    case ST_PROBING:
+    case ST_PROBING_UP:
+        action = ACT_PROBE;
+        break;
+
+    case ST_INNING:
+    case ST_WAIT_IN:
+        action = ACT_IN;
+        break;
+
+    case ST_OUTING:
+    case ST_DOWNANDOUT:
+        action = ACT_OUT;
+        break;
+
+    case ST_ACTIVE:
+        if ((info->flags & (IFF_UP|IFF_RUNNING)) != (IFF_UP|IFF_RUNNING))
+            return "ACTIVE, but not UP and RUNNING";
+        if (info->worker != -1 || info->deferred)
+            action = ACT_READY;
+        if (action != -1 && !info->ready)
+            return "a ready script is running, but it was never ready";
+        break;
+
+    case ST_INACTIVE:
+        if (!(info->flags & IFF_UP))
+            return "INACTIVE, but not UP";
+        break;
+
+    case ST_DOWN:
+    case ST_INSANE:
+        break;
+
+    default:
+        return "no such state";
     }
 
-    info = NULL;
-    for_each_iface(find_pid);
+    if (info->worker != -1 && info->deferred)
+        return "a script is both running and waiting to start";
+    if (info->deferred && !timer_pending(&info->stop_timer))
+        return "a script is waiting for nothing to stop";
+    if (action == -1 && (info->worker != -1 || info->deferred))
+        return "a script is running in a state that has none";
+    if (action != -1 && info->worker == -1 && !info->deferred)
+        return "no script is running in a state that needs one";
+    if (info->action != action)
+        return "the script running is the wrong one for the state";
+    if (info->worker == -1 && timer_pending(&info->wd_timer))
+        return "the watchdog is timing a script that is not running";
+    if (timer_pending(&info->wd_timer) != (info->wd_stage != -1))
+        return "the watchdog is waiting for nothing";
+    if (info->wd_stage >= 0 && info->wd_stage < NR_ACTIONS &&
+        info->wd_stage != info->action)
+        return "the watchdog has the script down as the wrong action";
+    if (info->stopping != -1 && info->stopping == info->worker)
+        return "the worker is being stopped";
+    if (info->stopping == -1 && timer_pending(&info->stop_timer))
+        return "the watchdog is timing a stopped script that is not there";
+    if (timer_pending(&info->retry_timer) && info->worker != -1)
+        return "a retry is waiting, but a script is running";
+
+    return NULL;
+}
 
-    if (info == NULL) {
-        do_log(LOG_INFO, "Unexpected child %d exited with status %d",
-               pid, exitstatus);
-        return;
+/* info's worker, pid, is done with: it has exited, or, if early, it
+   has said it is done, and keeps running on its own. */
+static void
+script_finished(struct if_info *info, pid_t pid, int exitstatus, int early)
+{
+    int exitok = WIFEXITED(exitstatus) && WEXITSTATUS(exitstatus) == 0;
+
+    if (early)
+        do_log(LOG_INFO, "%s: state %s pid %d says it has %s",
+               info->name, statename(info->state), pid,
+               exitok ? "succeeded" : "failed");
+    else
+        do_log(LOG_INFO, "%s: state %s pid %d exited status %d%s",
+               info->name, statename(info->state), pid, exitstatus,
+               info->wd_signal ? " after timing out" : "");
+
+    enum ifstate state = info->state;
+    int action = info->action;
+    unsigned long long now = ifsm_hooks.clock();
+    unsigned long long ran = now - info->spawn_ns;
+
+    NP_TRACE(script_done, info->worker_event, info->netns, info->index, pid,
+             exitstatus, ran);
+    do_log(LOG_DEBUG, "span event %llu script %s pid %d status %d %lluus",
+           info->worker_event, info->name, pid, exitstatus, ran / 1000);
+
+    if (info->action >= 0) {
+        hist_observe(&metrics.script[info->action], ran);
+        if (exitok)
+            metrics_inc(exited_ok[info->action]);
+        else
+            metrics_inc(exited_failed[info->action]);
     }
 
-    do_log(LOG_INFO, "%s: state %s pid %d exited status %d",
-           info->name, statename(info->state), pid, exitstatus);
+    /* Whatever a script that timed out left behind goes with it. */
+    if (info->wd_signal && !early)
+        ifsm_hooks.signal(pid, SIGKILL);
 
+    wd_unlink(info);
     info->worker = -1;
+    info->action = -1;
 
+    /* A script the watchdog killed has failed, and takes the same way
+       out of its state as any other failure: a probe leaves us DOWN,
+       an "in" INSANE, and an "out" INACTIVE, there to wait for a
+       retry, if there are any. */
     switch(info->state) {
     case ST_PROBING:
         /* If we're still in PROBING state, then it means that the
@@ -336,7 +1048,7 @@ void ifsm_scriptdone(pid_t pid, int exitstatus)
            probe script for this interface */
         info->state = ST_PROBING;
         assert(info->worker == -1);
-        info->worker = run_netplug_bg(info->name, "probe");
+        info->worker = spawn(info, state, "probe");
         break;
 
     case ST_INNING:
@@ -347,78 +1059,474 @@ void ifsm_scriptdone(pid_t pid, int exitstatus)
         break;
 
     case ST_OUTING:
-        /* What if !exitok?  What if interface is still active? ->ST_INSANE? */
+        /* What if !exitok?  If the interface is active again, see
+           below. */
         info->state = ST_INACTIVE;
         break;
 
     case ST_WAIT_IN:
         assert(info->worker == -1);
 
-        info->worker = run_netplug_bg(info->name, "out");
+        info->worker = spawn(info, state, "out");
         info->state = ST_OUTING;
         break;
 
-    case ST_INACTIVE:
     case ST_ACTIVE:
+        /* the "ready" script; ACTIVE either way */
+        if (!exitok)
+            do_log(LOG_WARNING, "%s: ready script failed", info->name);
+        break;
+
+    case ST_INACTIVE:
     case ST_INSANE:
     case ST_DOWN:
-        do_log(LOG_ERR, "ifsm_scriptdone: %s: bad state %s for script termination",
-               info->name, statename(info->state));
-        exit(1);
+        recover(info, info->flags, "script exited");
+        break;
     }
 
     do_log(LOG_DEBUG, "%s: moved to state %s", info->name, statename(info->state));
+    history_add(info, state, info->flags, exitstatus);
+
+    if (exitok)
+        info->retries = 0;
+    else
+        retry_schedule(info, action, now);
+
+    if (info->state != state)
+        transitioned(info, state);
+
+    /* The flags may have changed while the script ran, say carrier
+       coming back during an OUT script, and nothing else will look at
+       them again until they next change; likewise the addresses, while
+       an "in" script ran. */
+    if (info->state == ST_INACTIVE || info->state == ST_ACTIVE)
+        ifsm_flagpoll(info);
+
+    online_check(info);
 }
 
-void
-parse_rtattrs(struct rtattr *tb[], int max, struct rtattr *rta, int len)
+/* Where pid is in info's detached scripts, or -1. */
+static int
+detached_slot(const struct if_info *info, pid_t pid)
 {
-    memset(tb, 0, sizeof(tb) * (max + 1));
+    for (int n = 0; n < MAX_DETACHED; n++) {
+        if (info->detached[n] == pid)
+            return n;
+    }
+
+    return -1;
+}
+
+static struct if_info *
+find_worker(pid_t pid, int detached_too)
+{
+    struct if_info *info = NULL;
+
+    int find_pid(struct if_info *i) {
+        if (i->worker == pid ||
+            (detached_too && (detached_slot(i, pid) != -1 ||
+                              i->stopping == pid))) {
+            info = i;
+            return 1;
+        }
+        return 0;
+    }
+
+    for_each_iface(find_pid);
+
+    return info;
+}
+
+/* handle a script termination and update the state accordingly;
+   returns 0 if no interface we know of was running the script */
+int ifsm_scriptdone(pid_t pid, int exitstatus)
+{
+    assert(WIFEXITED(exitstatus) || WIFSIGNALED(exitstatus));
+
+    struct if_info *info = find_worker(pid, 1);
+    int slot;
+
+    if (info == NULL) {
+        return 0;
+    }
 
-    while (RTA_OK(rta, len)) {
-        if (rta->rta_type <= max)
-            tb[rta->rta_type] = rta;
-        rta = RTA_NEXT(rta,len);
+    /* The state machine was done with it when it said so. */
+    if ((slot = detached_slot(info, pid)) != -1) {
+        do_log(LOG_INFO, "%s: pid %d, done with since it said so, exited "
+               "status %d", info->name, pid, exitstatus);
+        info->detached[slot] = -1;
+        return 1;
     }
+
+    /* Or when it was told to stop; whatever it left behind goes with
+       it, as it would have had it been waited for. */
+    if (info->stopping == pid) {
+        do_log(LOG_INFO, "%s: pid %d, told to stop, exited status %d",
+               info->name, pid, exitstatus);
+        ifsm_hooks.signal(pid, SIGKILL);
+        timer_cancel(&info->stop_timer);
+        info->stopping = -1;
+        start_deferred(info);
+        return 1;
+    }
+
+    script_finished(info, pid, exitstatus, 0);
+
+    return 1;
+}
+
+/* A script has said, through NETPLUG_NOTIFY_FD, that it is done, and
+   how it went, as an exit status would; it may go on running, but the
+   state takes its course now.  Returns 0 if it isn't a script we are
+   waiting for.  If MAX_DETACHED of info's scripts that said so are
+   still running, this one is waited for after all, so that its exit
+   is known when it comes. */
+int ifsm_scriptnotify(pid_t pid, int exitstatus)
+{
+    struct if_info *info = find_worker(pid, 0);
+    int slot;
+
+    if (info == NULL) {
+        return 0;
+    }
+
+    if ((slot = detached_slot(info, -1)) == -1) {
+        do_log(LOG_WARNING, "%s: pid %d says it is done, but %d scripts "
+               "that said so are still running; waiting for it to exit",
+               info->name, pid, MAX_DETACHED);
+        return 1;
+    }
+
+    metrics_inc(early[info->action]);
+    info->detached[slot] = pid;
+    script_finished(info, pid, exitstatus, 1);
+
+    return 1;
+}
+
+/* Pull what we need out of an RTM_NEWLINK or RTM_DELLINK message
+   into a self-contained event, so that it no longer refers to the
+   receive buffer.  The attributes are walked once, and only the ones
+   we use are looked at.  Returns 1 if there is an event, 0 if the
+   message is of no interest, and -1 if it is malformed. */
+static int
+address_event_decode(struct link_event *ev, struct netns *ns,
+                     struct nlmsghdr *hdr);
+
+int
+link_event_decode(struct link_event *ev, struct netns *ns,
+                  struct nlmsghdr *hdr)
+{
+    if (hdr->nlmsg_type == RTM_NEWADDR || hdr->nlmsg_type == RTM_DELADDR) {
+        return address_event_decode(ev, ns, hdr);
+    }
+
+    if (hdr->nlmsg_type != RTM_NEWLINK && hdr->nlmsg_type != RTM_DELLINK) {
+        return 0;
+    }
+
+    struct ifinfomsg *info = NLMSG_DATA(hdr);
+    int len = hdr->nlmsg_len - NLMSG_LENGTH(sizeof(*info));
+
+    if (len < 0) {
+        do_log(LOG_ERR, "Malformed netlink packet length");
+        return -1;
+    }
+
+    if (info->ifi_flags & IFF_LOOPBACK) {
+        return 0;
+    }
+
+    unsigned long long start = monotonic_ns();
+
+    ev->rx_ns = netlink_rx_ns ? netlink_rx_ns : start;
+    ev->id = __atomic_add_fetch(&next_event_id, 1, __ATOMIC_RELAXED);
+    ev->netns = ns->id;
+    ev->msgtype = hdr->nlmsg_type;
+    ev->index = info->ifi_index;
+    ev->type = info->ifi_type;
+    ev->flags = info->ifi_flags;
+    ev->addr_len = 0;
+    ev->operstate = IF_OPER_UNKNOWN;
+    ev->master = 0;
+    ev->mtu = 0;
+    ev->name[0] = '\0';
+    ev->kind[0] = '\0';
+    ev->wait_online = 0;
+
+    struct rtattr *rta;
+
+    for (rta = IFLA_RTA(info); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        void *data = RTA_DATA(rta);
+        int plen = RTA_PAYLOAD(rta);
+
+        switch (rta->rta_type & NLA_TYPE_MASK) {
+        case IFLA_IFNAME: {
+            int n = strnlen(data, plen);
+
+            if (n >= sizeof(ev->name))
+                n = sizeof(ev->name) - 1;
+            memcpy(ev->name, data, n);
+            ev->name[n] = '\0';
+            break;
+        }
+        case IFLA_ADDRESS:
+            ev->addr_len = plen;
+            memcpy(ev->addr, data,
+                   plen < sizeof(ev->addr) ? plen : sizeof(ev->addr));
+            break;
+        case IFLA_OPERSTATE:
+            if (plen >= 1)
+                ev->operstate = *(unsigned char *) data;
+            break;
+        case IFLA_MASTER:
+            if (plen >= sizeof(ev->master))
+                memcpy(&ev->master, data, sizeof(ev->master));
+            break;
+        case IFLA_MTU:
+            if (plen >= sizeof(ev->mtu))
+                memcpy(&ev->mtu, data, sizeof(ev->mtu));
+            break;
+        case IFLA_LINKINFO: {
+            int ilen = plen;
+
+            for (struct rtattr *nested = data; RTA_OK(nested, ilen);
+                 nested = RTA_NEXT(nested, ilen)) {
+                if ((nested->rta_type & NLA_TYPE_MASK) != IFLA_INFO_KIND)
+                    continue;
+
+                int n = strnlen(RTA_DATA(nested), RTA_PAYLOAD(nested));
+
+                if (n >= sizeof(ev->kind))
+                    n = sizeof(ev->kind) - 1;
+                memcpy(ev->kind, RTA_DATA(nested), n);
+                ev->kind[n] = '\0';
+            }
+            break;
+        }
+        }
+    }
+
     if (len) {
         do_log(LOG_ERR, "Badness! Deficit %d, rta_len=%d", len, rta->rta_len);
-        abort();
+        return -1;
+    }
+
+    if (ev->name[0] == '\0') {
+        do_log(LOG_ERR, "No interface name");
+        return -1;
     }
+
+    /* Dumps may have left the others out already; see netlink.c. */
+    if (netlink_kind && strcmp(ev->kind, netlink_kind) != 0)
+        return 0;
+
+    metrics_inc(events);
+    hist_observe(&metrics.decode, monotonic_ns() - start);
+    NP_TRACE(event_rx, ev->id, ev->netns, ev->index, ev->flags, ev->rx_ns);
+
+    return 1;
 }
 
-int if_info_save_interface(struct nlmsghdr *hdr, void *arg)
+
+/* The same for RTM_NEWADDR and RTM_DELADDR.  These carry no interface
+   name, so whether the interface is one of ours is left until it is
+   looked up. */
+static int
+address_event_decode(struct link_event *ev, struct netns *ns,
+                     struct nlmsghdr *hdr)
 {
-    struct rtattr *attrs[IFLA_MAX + 1];
-    struct ifinfomsg *info = NLMSG_DATA(hdr);
+    struct ifaddrmsg *ifa = NLMSG_DATA(hdr);
+    int len = hdr->nlmsg_len - NLMSG_LENGTH(sizeof(*ifa));
 
-    parse_rtattrs(attrs, IFLA_MAX, IFLA_RTA(info), IFLA_PAYLOAD(hdr));
+    if (len < 0) {
+        do_log(LOG_ERR, "Malformed netlink packet length");
+        return -1;
+    }
 
-    return if_info_update_interface(hdr, attrs) ? 0 : -1;
+    if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6) {
+        return 0;
+    }
+
+    unsigned long long start = monotonic_ns();
+    int have_local = 0;
+
+    memset(ev, 0, sizeof(*ev));
+    ev->rx_ns = netlink_rx_ns ? netlink_rx_ns : start;
+    ev->id = __atomic_add_fetch(&next_event_id, 1, __ATOMIC_RELAXED);
+    ev->netns = ns->id;
+    ev->msgtype = hdr->nlmsg_type;
+    ev->index = ifa->ifa_index;
+    ev->operstate = IF_OPER_UNKNOWN;
+    ev->ifa.family = ifa->ifa_family;
+    ev->ifa.prefixlen = ifa->ifa_prefixlen;
+    ev->ifa.scope = ifa->ifa_scope;
+    ev->ifa.flags = ifa->ifa_flags;
+
+    int alen = ifa->ifa_family == AF_INET ? 4 : 16;
+    struct rtattr *rta;
+
+    for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        void *data = RTA_DATA(rta);
+        int plen = RTA_PAYLOAD(rta);
+
+        switch (rta->rta_type & NLA_TYPE_MASK) {
+        case IFA_LOCAL:
+            /* IPv4's own end of a point-to-point link; IFA_ADDRESS
+               is then the peer's */
+            if (plen >= alen) {
+                memcpy(ev->ifa.ip, data, alen);
+                have_local = 1;
+            }
+            break;
+        case IFA_ADDRESS:
+            if (plen >= alen && !have_local)
+                memcpy(ev->ifa.ip, data, alen);
+            break;
+        case IFA_FLAGS:
+            /* the whole of them; ifa_flags has only the low 8 */
+            if (plen >= sizeof(ev->ifa.flags))
+                memcpy(&ev->ifa.flags, data, sizeof(ev->ifa.flags));
+            break;
+        }
+    }
+
+    if (len) {
+        do_log(LOG_ERR, "Badness! Deficit %d, rta_len=%d", len, rta->rta_len);
+        return -1;
+    }
+
+    metrics_inc(events);
+    hist_observe(&metrics.decode, monotonic_ns() - start);
+    NP_TRACE(event_rx, ev->id, ev->netns, ev->index, ev->flags, ev->rx_ns);
+
+    return 1;
 }
 
 
-struct if_info *
-if_info_get_interface(struct nlmsghdr *hdr, struct rtattr *attrs[])
+static struct if_info *
+find_interface(int netns, int index)
 {
-    if (hdr->nlmsg_type != RTM_NEWLINK) {
-        return NULL;
+    struct if_info *i;
+
+    for (i = if_info[info_hash(netns, index)]; i != NULL; i = i->next) {
+        if (i->index == index && i->netns == netns)
+            break;
     }
 
-    struct ifinfomsg *info = NLMSG_DATA(hdr);
+    return i;
+}
 
-    if (hdr->nlmsg_len < NLMSG_LENGTH(sizeof(info))) {
-        return NULL;
+
+static const char *
+address_str(char *buf, size_t size, const struct if_addr *a)
+{
+    int n;
+
+    inet_ntop(a->family, a->ip, buf, size);
+    n = strlen(buf);
+    snprintf(buf + n, size - n, "/%d", a->prefixlen);
+
+    return buf;
+}
+
+
+/* Bring i's addresses up to date with an address event. */
+static void
+update_address(struct if_info *i, const struct link_event *ev)
+{
+    const struct if_addr *a = &ev->ifa;
+    char buf[INET6_ADDRSTRLEN + 4];
+    int n;
+
+    for (n = 0; n < i->naddrs; n++) {
+        const struct if_addr *b = &i->addrs[n];
+
+        if (b->family == a->family && b->prefixlen == a->prefixlen &&
+            memcmp(b->ip, a->ip, sizeof(b->ip)) == 0)
+            break;
+    }
+
+    if (ev->msgtype == RTM_DELADDR) {
+        if (n < i->naddrs)
+            i->addrs[n] = i->addrs[--i->naddrs];
+        return;
+    }
+
+    if (n == i->naddrs) {
+        if (n == MAX_ADDRS) {
+            do_log(LOG_WARNING, "%s: more than %d addresses; not keeping "
+                   "track of %s", i->name, MAX_ADDRS,
+                   address_str(buf, sizeof(buf), a));
+            return;
+        }
+        i->naddrs++;
+        i->addrs[n].flags = 0;
+    }
+
+    if ((a->flags & IFA_F_DADFAILED) &&
+        !(i->addrs[n].flags & IFA_F_DADFAILED)) {
+        do_log(LOG_WARNING, "%s: %s failed duplicate address detection",
+               i->name, address_str(buf, sizeof(buf), a));
+        metrics_inc(dad_failed);
+    }
+
+    do_log(LOG_DEBUG, "%s: address %s scope %d flags 0x%x", i->name,
+           address_str(buf, sizeof(buf), a), a->scope, a->flags);
+
+    i->addrs[n] = *a;
+}
+
+
+int if_info_save_interface(struct nlmsghdr *hdr, void *arg)
+{
+    struct link_event ev;
+    int ret;
+
+    if ((ret = link_event_decode(&ev, arg, hdr)) <= 0) {
+        return ret;
+    }
+
+    ev.wait_online = ev.msgtype == RTM_NEWLINK;
+    if (udev_hold(&ev))
+        return 0;
+
+    /* Addresses are dumped after links, so their interfaces are
+       known; the state machine looks at them once it starts. */
+    if (ev.msgtype == RTM_NEWADDR) {
+        struct if_info *i = find_interface(ev.netns, ev.index);
+
+        if (i != NULL)
+            update_address(i, &ev);
+        return 0;
+    }
+
+    struct if_info *i = if_info_get_interface(&ev);
+
+    if (i != NULL) {
+        if_info_update_interface(i, &ev);
+        if (if_match(i->name)) {
+            state_publish(i);
+            online_pending(i);
+        }
     }
 
-    if (attrs[IFLA_IFNAME] == NULL) {
+    return 0;
+}
+
+
+struct if_info *
+if_info_get_interface(const struct link_event *ev)
+{
+    if (ev->msgtype != RTM_NEWLINK) {
         return NULL;
     }
 
-    int x = info->ifi_index & (INFOHASHSZ-1);
+    int x = info_hash(ev->netns, ev->index);
     struct if_info *i, **ip;
 
     for (ip = &if_info[x]; (i = *ip) != NULL; ip = &i->next) {
-        if (i->index == info->ifi_index) {
+        if (i->index == ev->index && i->netns == ev->netns) {
             break;
         }
     }
@@ -426,45 +1534,188 @@ if_info_get_interface(struct nlmsghdr *hdr, struct rtattr *attrs[])
     if (i == NULL) {
         i = xmalloc(sizeof(*i));
         i->next = *ip;
-        i->index = info->ifi_index;
-        *ip = i;
+        i->netns = ev->netns;
+        i->index = ev->index;
+        i->name[0] = '\0';
 
         /* initialize state machine fields */
+        i->flags = 0;
         i->state = ST_DOWN;
+        i->prev_state = ST_DOWN;
         i->lastchange = 0;
         i->worker = -1;
+        for (int n = 0; n < MAX_DETACHED; n++)
+            i->detached[n] = -1;
+        i->action = -1;
+        i->event_ns = 0;
+        i->event_id = 0;
+        i->event_rx = 0;
+        i->worker_event = 0;
+        i->flaps = 0;
+        i->spawned = 0;
+        i->wd_stage = -1;
+        i->wd_signal = 0;
+        i->wd_timer = (struct timer) { .func = wd_expire };
+        i->stopping = -1;
+        i->stop_timer = (struct timer) { .func = stop_expire };
+        i->deferred = NULL;
+        i->retries = 0;
+        i->retry_timer = (struct timer) { .func = retry_run };
+        i->state_slot = -1;
+        i->wait_online = 0;
+        i->ready = 0;
+        i->naddrs = 0;
+        i->history_next = 0;
+
+        /* Only now can for_each_iface_all(), on another thread, be
+           let see it. */
+        __atomic_store_n(ip, i, __ATOMIC_RELEASE);
     }
     return i;
 }
 
 
-struct if_info *
-if_info_update_interface(struct nlmsghdr *hdr, struct rtattr *attrs[])
+static void
+update_attributes(struct if_info *i, const struct link_event *ev)
 {
-    struct ifinfomsg *info = NLMSG_DATA(hdr);
-    struct if_info *i;
+    i->type = ev->type;
+    i->addr_len = ev->addr_len;
+    memcpy(i->addr, ev->addr, sizeof(i->addr));
+    memcpy(i->name, ev->name, sizeof(i->name));
+    i->operstate = ev->operstate;
+    i->master = ev->master;
+    i->mtu = ev->mtu;
+    memcpy(i->kind, ev->kind, sizeof(i->kind));
+}
 
-    if ((i = if_info_get_interface(hdr, attrs)) == NULL) {
-        return NULL;
+
+/* An address came or went.  That only matters to an ACTIVE interface,
+   which may now be ready. */
+static void
+handle_address(struct link_event *ev)
+{
+    struct if_info *i = find_interface(ev->netns, ev->index);
+
+    if (i == NULL || !if_match(i->name)) {
+        metrics_inc(ignored);
+        return;
     }
 
-    i->type = info->ifi_type;
-    i->flags = info->ifi_flags;
+    update_address(i, ev);
 
-    if (attrs[IFLA_ADDRESS]) {
-        int alen;
-        i->addr_len = alen = RTA_PAYLOAD(attrs[IFLA_ADDRESS]);
-        if (alen > sizeof(i->addr))
-            alen = sizeof(i->addr);
-        memcpy(i->addr, RTA_DATA(attrs[IFLA_ADDRESS]), alen);
-    } else {
-        i->addr_len = 0;
-        memset(i->addr, 0, sizeof(i->addr));
+    if (i->state == ST_ACTIVE) {
+        i->event_ns = ev->rx_ns;
+        ifsm_flagpoll(i);
+        i->event_ns = 0;
     }
+}
 
-    strcpy(i->name, RTA_DATA(attrs[IFLA_IFNAME]));
 
-    return i;
+/* info is now called name.  Anything started for it under its old
+   name, if that was one of ours, was for that name: it is stopped,
+   and the interface starts over, as if it had just appeared, for the
+   patterns to have another look at. */
+static void
+renamed(struct if_info *info, const char *name)
+{
+    do_log(LOG_INFO, "%s: renamed to %s", info->name, name);
+
+    if (if_match(info->name)) {
+        enum ifstate state = info->state;
+        unsigned oldflags = info->flags;
+
+        if (info->spawned) {
+            do_log(LOG_WARNING, "%s: %u scripts were run for it as %s",
+                   name, info->spawned, info->name);
+            metrics_add(renamed_scripts, info->spawned);
+        }
+
+        start_over(info, ST_DOWN);
+        info->flags = 0;
+
+        history_add(info, state, oldflags, -1);
+        if (info->state != state)
+            transitioned(info, state);
+        online_check(info);
+    }
+
+    info->spawned = 0;
+    memcpy(info->name, name, sizeof(info->name));
+    state_publish(info);
+}
+
+
+/* Run a decoded link or address event through the state machine. */
+void
+if_info_handle_event(struct link_event *ev)
+{
+    unsigned long long start = monotonic_ns();
+
+    if (ev->msgtype == RTM_NEWADDR || ev->msgtype == RTM_DELADDR) {
+        handle_address(ev);
+        goto done;
+    }
+
+    /* Before the patterns are looked at, as they may see the new name
+       differently. */
+    if (ev->msgtype == RTM_NEWLINK) {
+        struct if_info *i = find_interface(ev->netns, ev->index);
+
+        if (i != NULL && strcmp(i->name, ev->name) != 0)
+            renamed(i, ev->name);
+    }
+
+    if (!if_match(ev->name)) {
+        do_log(LOG_INFO, "%s: ignoring event", ev->name);
+        metrics_inc(ignored);
+        goto done;
+    }
+
+    struct if_info *i = if_info_get_interface(ev);
+
+    if (i == NULL)
+        goto done;
+
+    /* Held back by udev.c since the initial dump, it holds up readiness
+       as it would have then. */
+    if (ev->wait_online)
+        online_pending(i);
+
+    NP_TRACE(event_handle, ev->id, ev->netns, ev->index, start - ev->rx_ns);
+    do_log(LOG_DEBUG, "span event %llu queue %s %lluus", ev->id, ev->name,
+           (start - ev->rx_ns) / 1000);
+
+    /* Anything a script is started for from here on, now or once the
+       current one exits, is down to this event. */
+    if ((i->flags ^ ev->flags) & (IFF_UP | IFF_RUNNING)) {
+        i->event_id = ev->id;
+        i->event_rx = ev->rx_ns;
+    }
+
+    /* Take in everything but the flags first, so that scripts the
+       flag change starts see the interface as it is now. */
+    update_attributes(i, ev);
+
+    i->event_ns = ev->rx_ns;
+    ifsm_flagchange(i, ev->flags);
+    i->event_ns = 0;
+
+    i->flags = ev->flags;
+    state_publish(i);
+    online_check(i);
+
+ done:
+    if (ev->wait_online)
+        online_unhold();
+    hist_observe(&metrics.event, monotonic_ns() - start);
+}
+
+
+void
+if_info_update_interface(struct if_info *i, const struct link_event *ev)
+{
+    update_attributes(i, ev);
+    i->flags = ev->flags;
 }
 
 
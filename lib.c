@@ -19,71 +19,22 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <stdarg.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/wait.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "netplug.h"
 
 const char *script_file = NP_SCRIPT_DIR "/netplug";
 
-void
-do_log(int pri, const char *fmt, ...)
-{
-    extern int use_syslog;
-    va_list ap;
-    va_start(ap, fmt);
-
-    if (pri == LOG_DEBUG && !debug)
-        return;
-
-    if (use_syslog) {
-        vsyslog(pri, fmt, ap);
-    } else {
-        FILE *fp;
-
-        switch (pri) {
-        case LOG_INFO:
-        case LOG_NOTICE:
-        case LOG_DEBUG:
-            fp = stdout;
-            break;
-        default:
-            fp = stderr;
-            break;
-        }
-
-        switch (pri) {
-        case LOG_WARNING:
-            fputs("Warning: ", fp);
-            break;
-        case LOG_NOTICE:
-            fputs("Notice: ", fp);
-            break;
-        case LOG_CRIT:
-        case LOG_ERR:
-            fputs("Error: ", fp);
-            break;
-        case LOG_INFO:
-        case LOG_DEBUG:
-            break;
-        default:
-            fprintf(fp, "Log type %d: ", pri);
-            break;
-        }
-
-        vfprintf(fp, fmt, ap);
-        fputc('\n', fp);
-    }
-
-    va_end(ap);
-}
-
-
 void
 close_on_exec(int fd)
 {
@@ -94,35 +45,72 @@ close_on_exec(int fd)
 }
 
 
+/* env, if not NULL, is a NULL-terminated list of NAME=value strings
+   to add to the script's environment. */
 pid_t
-run_netplug_bg(char *ifname, char *action)
+run_netplug_bg(struct netns *ns, char *ifname, char *action, char **env)
 {
+    char hooks[PATH_MAX];
+    int use_hooks = hooks_path(action, hooks, sizeof(hooks));
+    const char *what = use_hooks ? hooks : script_file;
     pid_t pid;
 
-    if ((pid = fork()) == -1) {
+    shard_fork_begin();
+    pid = fork();
+    if (pid != 0)
+        shard_fork_end(pid);
+
+    if (pid == -1) {
         do_log(LOG_ERR, "fork: %m");
         exit(1);
     }
     else if (pid != 0) {
+        /* Log from the parent: with a reader thread around, another
+           thread may hold the syslog lock at the moment we fork. */
+        if (ns && ns->name)
+            do_log(LOG_INFO, "%s %s %s [netns %s] -> pid %d",
+                   what, ifname, action, ns->name, pid);
+        else
+            do_log(LOG_INFO, "%s %s %s -> pid %d",
+                   what, ifname, action, pid);
         return pid;
     }
 
+    log_forked();
+
+    /* Scripts started from a shard would otherwise keep its thread's
+       signal mask, with SIGTERM blocked, across exec(). */
+    sigset_t none;
+
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+
     setpgrp();                  /* become group leader */
+    cgroup_enter(action);
+    /* Before early_inherit() puts the completion pipe on fd 3, which
+       the namespace's own fd may be. */
+    netns_enter(ns);
+    early_inherit();
+
+    for (; env && *env; env++)
+        putenv(*env);
 
-    do_log(LOG_INFO, "%s %s %s -> pid %d",
-           script_file, ifname, action, getpid());
+    if (use_hooks)
+        hooks_run(hooks, ifname, action);
 
     execl(script_file, script_file, ifname, action, NULL);
 
+    /* Not exit(): the daemon's atexit handlers would remove its
+       sockets and files out from under it. */
     do_log(LOG_ERR, "%s: %m", script_file);
-    exit(1);
+    _exit(1);
 }
 
 
 int
-run_netplug(char *ifname, char *action)
+run_netplug(struct netns *ns, char *ifname, char *action)
 {
-    pid_t pid = run_netplug_bg(ifname, action);
+    pid_t pid = run_netplug_bg(ns, ifname, action, NULL);
     int status, ret;
 
     if ((ret = waitpid(pid, &status, 0)) == -1) {
@@ -134,56 +122,73 @@ run_netplug(char *ifname, char *action)
 }
 
 
-/*
-   Synchronously kill a script
-
-   Assumes the pid is actually a leader of a group.  Kills first with
-   SIGTERM at first; if that doesn't work, follow up with a SIGKILL.
- */
+/* Ask a script to stop, with SIGTERM to its process group.  This
+   doesn't wait: the state machine follows up with SIGKILL if it is
+   still there a second later, and its exit is seen, as any other, by
+   the SIGCHLD handler. */
 void
 kill_script(pid_t pid)
 {
-    pid_t ret;
-    int status;
-    sigset_t mask, origmask;
+    signal_script(pid, SIGTERM);
+}
 
+
+/* Send sig to a script's process group, and leave it at that: its
+   exit is seen, as any other, by the SIGCHLD handler. */
+void
+signal_script(pid_t pid, int sig)
+{
     if (pid == -1)
         return;
 
     assert(pid > 0);
 
-    /* Block SIGCHLD while we go around killing things, so the SIGCHLD
-       handler doesn't steal things behind our back. */
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGCHLD);
-    sigprocmask(SIG_BLOCK, &mask, &origmask);
+    /* A cgroup has everything the script started, where its process
+       group may not. */
+    if (sig == SIGKILL && cgroup_kill(pid) == 0)
+        return;
 
-    /* ask nicely */
-    if (killpg(pid, SIGTERM) == -1) {
-        do_log(LOG_ERR, "Can't kill script pgrp %d: %m", pid);
-        goto done;
-    }
+    /* ESRCH: it has exited, and we will hear about it shortly. */
+    if (killpg(pid, sig) == -1 && errno != ESRCH)
+        do_log(LOG_ERR, "Can't signal script pgrp %d: %m", pid);
+}
+
+
+/* Start a detached helper thread.  Signals, SIGCHLD in particular,
+   are only ever handled by the main thread, so the new thread starts
+   with all of them blocked. */
+void
+thread_start(void *(*func)(void *), void *arg)
+{
+    pthread_t thread;
+    sigset_t all, orig;
+    int err;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &orig);
 
-    sleep(1);
+    err = pthread_create(&thread, NULL, func, arg);
 
-    ret = waitpid(pid, &status, WNOHANG);
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
 
-    if (ret == -1) {
-        do_log(LOG_ERR, "Failed to wait for %d: %m?!", pid);
-        goto done;
-    } else if (ret == 0) {
-        /* no more Mr. nice guy */
-        if (killpg(pid, SIGKILL) == -1) {
-            do_log(LOG_ERR, "2nd kill %d failed: %m?!", pid);
-            goto done;
-        }
-        ret = waitpid(pid, &status, 0);
+    if (err != 0) {
+        errno = err;
+        do_log(LOG_ERR, "can't start thread: %m");
+        exit(1);
     }
 
-    assert(ret == pid);
+    pthread_detach(thread);
+}
+
 
- done:
-    sigprocmask(SIG_SETMASK, &origmask, NULL);
+unsigned long long
+monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 
@@ -211,6 +216,11 @@ __assert_fail(const char *assertion, const char *file,
            function ? ": " : "",
            assertion);
 
+    /* Whatever led up to this is most likely in some interface's
+       history. */
+    log_flush();
+    history_write();
+
     abort();
 }
 
@@ -0,0 +1,789 @@
+/*
+ * log.c - logging, rate limited and written out by a background thread
+ *
+ * Copyright 2003 PathScale, Inc.
+ * Copyright 2003, 2004, 2005 Bryan O'Sullivan
+ * Copyright 2003 Jeremy Fitzhardinge
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Until log_start() is called, and always in netplugd-replay, messages
+ * are formatted and written as soon as they are logged.
+ *
+ * After log_start(), a thread that logs copies the format string's
+ * address and the raw arguments into a ring of its own, and a flusher
+ * thread formats and writes them out later.  A full ring loses the
+ * message rather than wait; the loss is counted and reported.  Errors
+ * are still written at once, after everything queued ahead of them,
+ * since one is usually followed by exit().
+ *
+ * Each call site, identified by its format string, may log RATE_BURST
+ * messages every RATE_INTERVAL seconds.  Beyond that, messages are
+ * counted and summed up once the interval is over.  Errors, and worse,
+ * are never held back.
+ *
+ * A child forked from the daemon may find the syslog and stdio locks
+ * held for good by threads that are not there.  After log_forked(),
+ * messages are formatted on the stack and go out with a single
+ * write(), or sendto() to syslog's socket, and no locks are taken.
+ */
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "netplug.h"
+
+#define RATE_SITES      512     /* must be a power of 2 */
+#define RATE_BURST      10
+#define RATE_INTERVAL   5       /* seconds */
+
+#define LOG_RING_SIZE   256     /* per thread; must be a power of 2 */
+#define MAX_LOG_RINGS   128
+
+/* Messages less important than this are dropped. */
+int log_threshold = LOG_DEBUG;
+
+struct site {
+    const char *fmt;
+    int pri;
+    unsigned window;            /* RATE_INTERVAL periods since boot */
+    unsigned count;             /* logged in this window */
+    unsigned suppressed;        /* not logged in this window */
+};
+
+static struct site sites[RATE_SITES];
+
+enum arg_kind { A_NONE, A_INT, A_LONG, A_LLONG, A_DOUBLE, A_PTR, A_STR,
+                A_BAD };
+
+struct conv {
+    int stars;                  /* '*' widths and precisions */
+    enum arg_kind kind;
+};
+
+struct log_rec {
+    const char *fmt;            /* NULL if text is already formatted */
+    short pri;
+    int err;                    /* errno, for %m */
+    char args[496];             /* or the text */
+};
+
+static int log_async;
+static int log_in_child;
+static struct ring *log_rings[MAX_LOG_RINGS];
+static int nr_log_rings;
+static __thread struct ring *my_ring;
+static pthread_mutex_t register_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int flushing;   /* this thread holds flush_lock */
+static int new_ring_fd = -1;
+static unsigned long dropped;
+
+
+static void
+emit(int pri, const char *text)
+{
+    extern int use_syslog;
+
+    if (use_syslog) {
+        syslog(pri, "%s", text);
+        return;
+    }
+
+    FILE *fp;
+
+    switch (pri) {
+    case LOG_INFO:
+    case LOG_NOTICE:
+    case LOG_DEBUG:
+        fp = stdout;
+        break;
+    default:
+        fp = stderr;
+        break;
+    }
+
+    switch (pri) {
+    case LOG_WARNING:
+        fputs("Warning: ", fp);
+        break;
+    case LOG_NOTICE:
+        fputs("Notice: ", fp);
+        break;
+    case LOG_CRIT:
+    case LOG_ERR:
+        fputs("Error: ", fp);
+        break;
+    case LOG_INFO:
+    case LOG_DEBUG:
+        break;
+    default:
+        fprintf(fp, "Log type %d: ", pri);
+        break;
+    }
+
+    fputs(text, fp);
+    fputc('\n', fp);
+}
+
+
+/* emit(), for a forked child. */
+static void
+emit_forked(int pri, const char *text)
+{
+    extern int use_syslog;
+    char buf[1024];
+    int n;
+
+    if (use_syslog) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX,
+                                    .sun_path = "/dev/log" };
+        int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+        n = snprintf(buf, sizeof(buf), "<%d>netplugd[%d]: %s",
+                     LOG_DAEMON | pri, getpid(), text);
+        if (fd != -1) {
+            if (sendto(fd, buf, n < sizeof(buf) ? n : sizeof(buf) - 1, 0,
+                       (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+                /* nobody to tell */
+            }
+            close(fd);
+        }
+        return;
+    }
+
+    n = snprintf(buf, sizeof(buf), "%s%s\n",
+                 pri <= LOG_ERR ? "Error: " :
+                 pri == LOG_WARNING ? "Warning: " : "", text);
+    if (write(STDERR_FILENO, buf, n < sizeof(buf) ? n : sizeof(buf) - 1) == -1) {
+        /* nobody to tell */
+    }
+}
+
+
+/* Parse the conversion starting at the '%' at p.  Returns a pointer
+   to just past it. */
+static const char *
+parse_conv(const char *p, struct conv *c)
+{
+    int len = 0;                /* 1: long, 2: long long, 3: long double */
+
+    c->stars = 0;
+    c->kind = A_NONE;
+
+    if (*++p == '%')
+        return p + 1;
+
+    while (*p && strchr("-+ #0'I", *p))
+        p++;
+
+    if (*p == '*') {
+        c->stars++;
+        p++;
+    } else {
+        while (isdigit(*p))
+            p++;
+    }
+
+    if (*p == '.') {
+        if (*++p == '*') {
+            c->stars++;
+            p++;
+        } else {
+            while (isdigit(*p))
+                p++;
+        }
+    }
+
+    while (*p == 'h')
+        p++;
+
+    if (*p == 'l') {
+        len = *++p == 'l' ? 2 : 1;
+        if (len == 2)
+            p++;
+    } else if (*p == 'q' || *p == 'j') {
+        len = 2;
+        p++;
+    } else if (*p == 'z' || *p == 't') {
+        len = 1;
+        p++;
+    } else if (*p == 'L') {
+        len = 3;
+        p++;
+    }
+
+    switch (*p) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+        c->kind = (enum arg_kind[]) { A_INT, A_LONG, A_LLONG, A_BAD }[len];
+        break;
+    case 'c':
+        c->kind = len ? A_BAD : A_INT;
+        break;
+    case 'e': case 'E': case 'f': case 'F':
+    case 'g': case 'G': case 'a': case 'A':
+        c->kind = len == 3 ? A_BAD : A_DOUBLE;
+        break;
+    case 's':
+        c->kind = len ? A_BAD : A_STR;
+        break;
+    case 'p':
+        c->kind = A_PTR;
+        break;
+    case 'm':
+        break;
+    default:
+        c->kind = A_BAD;        /* including %n and the end of fmt */
+        return *p ? p + 1 : p;
+    }
+
+    return p + 1;
+}
+
+
+/* Copy the arguments fmt refers to into r.  Returns -1 if they don't
+   fit, or are of a kind we don't handle. */
+static int
+capture(struct log_rec *r, const char *fmt, va_list ap)
+{
+    char *out = r->args, *end = r->args + sizeof(r->args);
+
+#define PUT(type, v) do {                       \
+        type x = (v);                           \
+        if (out + sizeof(x) > end)              \
+            return -1;                          \
+        memcpy(out, &x, sizeof(x));             \
+        out += sizeof(x);                       \
+    } while (0)
+
+    for (const char *p = fmt; (p = strchr(p, '%')) != NULL; ) {
+        struct conv c;
+        const char *q = parse_conv(p, &c);
+
+        for (int i = 0; i < c.stars; i++) {
+            PUT(int, va_arg(ap, int));
+        }
+
+        switch (c.kind) {
+        case A_NONE:
+            break;
+        case A_INT:
+            PUT(int, va_arg(ap, int));
+            break;
+        case A_LONG:
+            PUT(long, va_arg(ap, long));
+            break;
+        case A_LLONG:
+            PUT(long long, va_arg(ap, long long));
+            break;
+        case A_DOUBLE:
+            PUT(double, va_arg(ap, double));
+            break;
+        case A_PTR:
+            PUT(void *, va_arg(ap, void *));
+            break;
+        case A_STR: {
+            const char *s = va_arg(ap, const char *);
+            size_t n;
+
+            if (s == NULL)
+                s = "(null)";
+            n = strlen(s) + 1;
+            if (out + n > end)
+                return -1;
+            memcpy(out, s, n);
+            out += n;
+            break;
+        }
+        case A_BAD:
+            return -1;
+        }
+
+        p = q;
+    }
+
+#undef PUT
+
+    return 0;
+}
+
+
+/* Format a captured message into buf. */
+static void
+render(const struct log_rec *r, char *buf, size_t size)
+{
+    const char *in = r->args;
+    size_t n = 0;
+
+#define GET(type) ({ type x; memcpy(&x, in, sizeof(x)); in += sizeof(x); x; })
+
+    for (const char *p = r->fmt; *p && n < size - 1; ) {
+        const char *pct = strchrnul(p, '%');
+        size_t lit = pct - p;
+
+        if (lit > size - 1 - n)
+            lit = size - 1 - n;
+        memcpy(buf + n, p, lit);
+        n += lit;
+
+        if (*pct == '\0')
+            break;
+
+        struct conv c;
+        const char *q = parse_conv(pct, &c);
+        char spec[32];
+        int star[2] = { 0, 0 };
+        int ret;
+
+        if (q - pct >= sizeof(spec))
+            break;
+        memcpy(spec, pct, q - pct);
+        spec[q - pct] = '\0';
+
+        for (int i = 0; i < c.stars; i++) {
+            star[i] = GET(int);
+        }
+
+        char *dst = buf + n;
+        size_t room = size - n;
+
+#define FMT(v) (c.stars == 0 ? snprintf(dst, room, spec, v) :            \
+                c.stars == 1 ? snprintf(dst, room, spec, star[0], v) :    \
+                snprintf(dst, room, spec, star[0], star[1], v))
+
+        errno = r->err;
+
+        switch (c.kind) {
+        case A_INT:
+            ret = FMT(GET(int));
+            break;
+        case A_LONG:
+            ret = FMT(GET(long));
+            break;
+        case A_LLONG:
+            ret = FMT(GET(long long));
+            break;
+        case A_DOUBLE:
+            ret = FMT(GET(double));
+            break;
+        case A_PTR:
+            ret = FMT(GET(void *));
+            break;
+        case A_STR:
+            ret = FMT(in);
+            in += strlen(in) + 1;
+            break;
+        default:
+            ret = snprintf(dst, room, spec, 0);
+            break;
+        }
+
+#undef FMT
+
+        if (ret > 0)
+            n += (size_t) ret < room ? ret : room - 1;
+        p = q;
+    }
+
+#undef GET
+
+    buf[n] = '\0';
+}
+
+
+static void
+deliver(void *arg)
+{
+    struct log_rec *r = arg;
+    char buf[1024];
+
+    if (r->fmt == NULL) {
+        emit(r->pri, r->args);
+        return;
+    }
+
+    render(r, buf, sizeof(buf));
+    emit(r->pri, buf);
+}
+
+
+static struct ring *
+thread_ring(void)
+{
+    if (my_ring)
+        return my_ring;
+
+    pthread_mutex_lock(&register_lock);
+
+    if (nr_log_rings < MAX_LOG_RINGS) {
+        uint64_t one = 1;
+
+        my_ring = xmalloc(sizeof(*my_ring));
+        ring_init(my_ring, LOG_RING_SIZE, sizeof(struct log_rec));
+        log_rings[nr_log_rings] = my_ring;
+        __atomic_store_n(&nr_log_rings, nr_log_rings + 1, __ATOMIC_RELEASE);
+
+        if (write(new_ring_fd, &one, sizeof(one)) == -1) {
+            /* can only be a full counter, which wakes it anyway */
+        }
+    }
+
+    pthread_mutex_unlock(&register_lock);
+
+    return my_ring;
+}
+
+
+static void
+enqueue(int pri, const char *fmt, va_list ap)
+{
+    struct ring *ring = thread_ring();
+    struct log_rec *r;
+    int err = errno;
+
+    if (ring == NULL || (r = ring_try_slot(ring)) == NULL) {
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    va_list copy;
+
+    va_copy(copy, ap);
+
+    r->pri = pri;
+    r->err = err;
+    r->fmt = fmt;
+
+    if (capture(r, fmt, copy) == -1) {
+        errno = err;
+        r->fmt = NULL;
+        vsnprintf(r->args, sizeof(r->args), fmt, ap);
+    }
+
+    va_end(copy);
+
+    ring_commit(ring);
+}
+
+
+/* Write out everything queued so far.  Caller holds flush_lock. */
+static void
+drain(void)
+{
+    int n = __atomic_load_n(&nr_log_rings, __ATOMIC_ACQUIRE);
+
+    for (int i = 0; i < n; i++) {
+        ring_consume(log_rings[i], deliver);
+    }
+
+    unsigned long lost = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+
+    if (lost) {
+        char buf[64];
+
+        snprintf(buf, sizeof(buf), "dropped %lu log messages", lost);
+        emit(LOG_WARNING, buf);
+    }
+}
+
+
+static unsigned
+now_window(void)
+{
+    return monotonic_ns() / (RATE_INTERVAL * 1000000000ULL);
+}
+
+
+static struct site *
+find_site(int pri, const char *fmt)
+{
+    unsigned h = ((uintptr_t) fmt >> 2) * 2654435761u;
+
+    for (int i = 0; i < 16; i++) {
+        struct site *s = &sites[(h + i) & (RATE_SITES - 1)];
+        const char *f = __atomic_load_n(&s->fmt, __ATOMIC_ACQUIRE);
+
+        if (f == NULL) {
+            if (__atomic_compare_exchange_n(&s->fmt, &f, fmt, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                s->pri = pri;
+                return s;
+            }
+        }
+
+        if (f == fmt)
+            return s;
+    }
+
+    return NULL;                /* too many sites; don't limit this one */
+}
+
+
+/* Start a new window for s if it is due one.  Returns how many
+   messages were suppressed in the window just ended. */
+static unsigned
+roll(struct site *s, unsigned now)
+{
+    unsigned w = __atomic_load_n(&s->window, __ATOMIC_RELAXED);
+
+    if (w == now ||
+        !__atomic_compare_exchange_n(&s->window, &w, now, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return 0;
+
+    __atomic_store_n(&s->count, 0, __ATOMIC_RELAXED);
+
+    return __atomic_exchange_n(&s->suppressed, 0, __ATOMIC_RELAXED);
+}
+
+
+static void log_vmessage(int pri, const char *fmt, va_list ap);
+
+static void
+log_raw(int pri, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    log_vmessage(pri, fmt, ap);
+    va_end(ap);
+}
+
+
+#define SUPPRESSED_FMT  "suppressed %u messages like \"%s\""
+
+/* Returns 1 if this message may be logged. */
+static int
+rate_ok(int pri, const char *fmt)
+{
+    struct site *s = find_site(pri, fmt);
+
+    if (s == NULL)
+        return 1;
+
+    unsigned n = roll(s, now_window());
+
+    if (n)
+        log_raw(s->pri, SUPPRESSED_FMT, n, s->fmt);
+
+    if (__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED) < RATE_BURST)
+        return 1;
+
+    __atomic_fetch_add(&s->suppressed, 1, __ATOMIC_RELAXED);
+
+    return 0;
+}
+
+
+/* Sum up sites that went quiet after being suppressed, since nothing
+   else will.  Caller holds flush_lock. */
+static void
+sweep(void)
+{
+    unsigned now = now_window();
+
+    for (int i = 0; i < RATE_SITES; i++) {
+        struct site *s = &sites[i];
+
+        if (__atomic_load_n(&s->suppressed, __ATOMIC_RELAXED) == 0)
+            continue;
+
+        unsigned n = roll(s, now);
+
+        if (n) {
+            char buf[512];
+
+            snprintf(buf, sizeof(buf), SUPPRESSED_FMT, n, s->fmt);
+            emit(s->pri, buf);
+        }
+    }
+}
+
+
+static void
+write_now(int pri, const char *fmt, va_list ap)
+{
+    char buf[1024];
+
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    emit(pri, buf);
+}
+
+
+static void
+flush_begin(void)
+{
+    pthread_mutex_lock(&flush_lock);
+    flushing = 1;
+}
+
+
+static void
+flush_end(void)
+{
+    flushing = 0;
+    pthread_mutex_unlock(&flush_lock);
+}
+
+
+/* An error from a thread that is already writing out the queue, such
+   as a failed assertion in drain(), goes straight out: waiting for
+   flush_lock would be waiting for ourselves. */
+static void
+log_vmessage(int pri, const char *fmt, va_list ap)
+{
+    if (!log_async || (pri <= LOG_ERR && flushing)) {
+        write_now(pri, fmt, ap);
+    } else if (pri > LOG_ERR) {
+        enqueue(pri, fmt, ap);
+    } else {
+        int err = errno;
+
+        flush_begin();
+        drain();
+        errno = err;
+        write_now(pri, fmt, ap);
+        flush_end();
+    }
+}
+
+
+/* Use do_log(), which lets LOG_DEBUG messages be compiled out. */
+void
+log_message(int pri, const char *fmt, ...)
+{
+    va_list ap;
+    int err = errno;
+
+    if (log_in_child) {
+        char buf[1024];
+
+        if (!log_enabled(pri))
+            return;
+        va_start(ap, fmt);
+        vsnprintf(buf, sizeof(buf), fmt, ap);
+        va_end(ap);
+        emit_forked(pri, buf);
+        return;
+    }
+
+    if (!log_enabled(pri) || (pri > LOG_ERR && !rate_ok(pri, fmt)))
+        return;
+
+    errno = err;
+    va_start(ap, fmt);
+    log_vmessage(pri, fmt, ap);
+    va_end(ap);
+}
+
+
+static void *
+flusher_main(void *arg)
+{
+    struct pollfd fds[MAX_LOG_RINGS + 1];
+
+    fds[0].fd = new_ring_fd;
+    fds[0].events = POLLIN;
+
+    for (;;) {
+        int n = __atomic_load_n(&nr_log_rings, __ATOMIC_ACQUIRE);
+
+        for (int i = 0; i < n; i++) {
+            fds[i + 1].fd = log_rings[i]->wake_fd;
+            fds[i + 1].events = POLLIN;
+        }
+
+        if (poll(fds, n + 1, RATE_INTERVAL * 1000) == -1 && errno != EINTR) {
+            emit(LOG_ERR, "log flusher can't poll; logging synchronously");
+            log_async = 0;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t x;
+
+            if (read(new_ring_fd, &x, sizeof(x)) == -1) {
+                /* nothing to do; we look at every ring anyway */
+            }
+        }
+
+        flush_begin();
+        drain();
+        sweep();
+        flush_end();
+    }
+
+    return NULL;
+}
+
+
+/* Write out whatever is still queued, unless this thread is in the
+   middle of doing so already, and would only deadlock. */
+void
+log_flush(void)
+{
+    if (!log_async || flushing)
+        return;
+
+    flush_begin();
+    drain();
+    flush_end();
+}
+
+
+/* From here on, hand messages to a flusher thread. */
+void
+log_start(void)
+{
+    if ((new_ring_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        do_log(LOG_ERR, "can't create eventfd: %m");
+        exit(1);
+    }
+
+    log_async = 1;
+    atexit(log_flush);
+    thread_start(flusher_main, NULL);
+}
+
+
+/* In a child we have just forked, there is no flusher, and other
+   threads' locks may be held forever; see emit_forked(). */
+void
+log_forked(void)
+{
+    log_async = 0;
+    log_in_child = 1;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
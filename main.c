@@ -32,66 +32,52 @@
 #include <wait.h>
 #include <errno.h>
 #include <string.h>
+#include <getopt.h>
 #include <sys/ioctl.h>
 
 #include "netplug.h"
 
 
+#define ONLINE_FILE     "/var/run/netplugd.online"
+
 int use_syslog;
 static char *pid_file;
 
+/* Where decoded link events go: straight to the state machine, or to
+   the shard that owns the interface. */
+static void (*link_sink)(struct link_event *) = if_info_handle_event;
+
+
 static int
 handle_interface(struct nlmsghdr *hdr, void *arg)
 {
-    if (hdr->nlmsg_type != RTM_NEWLINK && hdr->nlmsg_type != RTM_DELLINK) {
-        return 0;
-    }
-
-    struct ifinfomsg *info = NLMSG_DATA(hdr);
-    int len = hdr->nlmsg_len - NLMSG_LENGTH(sizeof(*info));
-
-    if (info->ifi_flags & IFF_LOOPBACK) {
-        return 0;
-    }
-
-    if (len < 0) {
-        do_log(LOG_ERR, "Malformed netlink packet length");
-        return -1;
-    }
-
-    struct rtattr *attrs[IFLA_MAX + 1];
-
-    parse_rtattrs(attrs, IFLA_MAX, IFLA_RTA(info), len);
-
-    if (attrs[IFLA_IFNAME] == NULL) {
-        do_log(LOG_ERR, "No interface name");
-        return -1;
-    }
-
-    char *name = RTA_DATA(attrs[IFLA_IFNAME]);
+    struct link_event ev;
+    int ret;
 
-    if (!if_match(name)) {
-        do_log(LOG_INFO, "%s: ignoring event", name);
-        return 0;
+    if ((ret = link_event_decode(&ev, arg, hdr)) <= 0) {
+        return ret;
     }
 
-    struct if_info *i = if_info_get_interface(hdr, attrs);
+    if (!udev_hold(&ev))
+        link_sink(&ev);
 
-    if (i == NULL)
-        return 0;
-
-    ifsm_flagchange(i, info->ifi_flags);
+    return 0;
+}
 
-    if_info_update_interface(hdr, attrs);
 
-    return 0;
+/* The same, for events from the reader thread. */
+static void
+handle_link_event(struct link_event *ev)
+{
+    if (!udev_hold(ev))
+        link_sink(ev);
 }
 
 
 static void
 usage(char *progname, int exitcode)
 {
-    fprintf(stderr, "Usage: %s [-DFP] [-c config-file] [-s script-file] [-i interface] [-p pid-file]\n",
+    fprintf(stderr, "Usage: %s [-DFPt] [-c config-file] [-s script-file] [-i interface] [-j shards] [-n netns] [-p pid-file] [-r record-file]\n",
             progname);
 
     fprintf(stderr, "\t-D\t\t"
@@ -100,14 +86,69 @@ usage(char *progname, int exitcode)
             "run in foreground (don't become a daemon)\n");
     fprintf(stderr, "\t-P\t\t"
             "do not autoprobe for interfaces (use with care)\n");
+    fprintf(stderr, "\t-t\t\t"
+            "read netlink messages on a separate thread\n");
     fprintf(stderr, "\t-c config_file\t"
             "read interface patterns from this config file\n");
     fprintf(stderr, "\t-s script_file\t"
             "script file for probing interfaces, bringing them up or down\n");
     fprintf(stderr, "\t-i interface\t"
             "only handle interfaces matching this pattern\n");
+    fprintf(stderr, "\t-j shards\t"
+            "run the state machine on this many threads\n");
+    fprintf(stderr, "\t-n netns\t"
+            "also watch interfaces in this network namespace\n");
     fprintf(stderr, "\t-p pid_file\t"
             "write daemon process ID to pid_file\n");
+    fprintf(stderr, "\t-r, --record file\n\t\t\t"
+            "append every netlink message received to file\n");
+    fprintf(stderr, "\t--metrics-socket path\n\t\t\t"
+            "serve metrics to clients connecting to this socket\n");
+    fprintf(stderr, "\t--metrics-file path\n\t\t\t"
+            "write metrics to this file periodically\n");
+    fprintf(stderr, "\t--metrics-interval seconds\n\t\t\t"
+            "how often to write the metrics file (default 10)\n");
+    fprintf(stderr, "\t--notify-socket path\n\t\t\t"
+            "tell clients of this socket about interface state changes\n");
+    fprintf(stderr, "\t--state-file path\n\t\t\t"
+            "publish interface state in this memory-mapped file\n");
+    fprintf(stderr, "\t--history-file path\n\t\t\t"
+            "where SIGUSR1 writes each interface's recent events\n");
+    fprintf(stderr, "\t--script-timeout [action=]seconds\n\t\t\t"
+            "kill scripts (or just probe, in or out) running this long\n");
+    fprintf(stderr, "\t--slow-script seconds\n\t\t\t"
+            "warn of scripts running this long (default 30)\n");
+    fprintf(stderr, "\t--script-retry [action=]attempts\n\t\t\t"
+            "retry failed scripts (or just probe, in...) this many times\n");
+    fprintf(stderr, "\t--retry-backoff initial[,max]\n\t\t\t"
+            "seconds to wait before the first retry, and at most "
+            "(1,60)\n");
+    fprintf(stderr, "\t--hooks[=dir]\n\t\t\t"
+            "run each executable in dir/action.d, if there is one, instead\n"
+            "\t\t\tof the script (default " NP_SCRIPT_DIR ")\n");
+    fprintf(stderr, "\t--cgroup dir\n\t\t\t"
+            "run each script in a cgroup of its own under this one\n");
+    fprintf(stderr, "\t--script-cpu-weight weight\n\t\t\t"
+            "cpu.weight for all scripts together, with --cgroup\n");
+    fprintf(stderr, "\t--script-memory-max bytes\n\t\t\t"
+            "memory.max for each script, with --cgroup\n");
+    fprintf(stderr, "\t--script-cpus cpus\n\t\t\t"
+            "CPUs scripts may run on, such as 0-1, with --cgroup\n");
+    fprintf(stderr, "\t--link-kind kind\n\t\t\t"
+            "only handle links of this kind, such as veth\n");
+    fprintf(stderr, "\t--udev\n\t\t\t"
+            "leave new interfaces be until udev has renamed them, and\n"
+            "\t\t\tis otherwise done with them\n");
+    fprintf(stderr, "\t--addresses\n\t\t\t"
+            "run the ready action once an ACTIVE interface's addresses\n"
+            "\t\t\tare usable\n");
+    fprintf(stderr, "\t--online-file path\n\t\t\t"
+            "say here when interfaces have settled (default "
+            ONLINE_FILE ")\n");
+    fprintf(stderr, "\t--online-timeout seconds\n\t\t\t"
+            "how long to wait for them, at most (default 60)\n");
+    fprintf(stderr, "\t--wait-online[=seconds]\n\t\t\t"
+            "wait for a running netplugd to say so, and exit\n");
 
     exit(exitcode);
 }
@@ -144,35 +185,32 @@ exit_handler(int sig)
     exit(1);
 }
 
-struct child_exit
+static volatile sig_atomic_t history_wanted;
+
+static void
+history_handler(int sig)
 {
-    pid_t       pid;
-    int         status;
-};
+    history_wanted = 1;
+}
 
 static int child_handler_pipe[2];
 
+/* Just wake the main loop, which does the reaping.  One byte will do
+   for any number of exits, so EAGAIN, from a full pipe, is as good as
+   a byte written. */
 static void
 child_handler(int sig, siginfo_t *info, void *v)
 {
-    struct child_exit ce;
-    int ret;
-    ssize_t s = 0;
+    int saved_errno = errno;
+    char c = 0;
 
     assert(sig == SIGCHLD);
 
-    ce.pid = info->si_pid;
-    ret = waitpid(info->si_pid, &ce.status, 0);
-    if (ret == info->si_pid)
-    {
-        s = write(child_handler_pipe[1], &ce, sizeof(ce));
-
-	if (s == -1)
-	{
-	    do_log(LOG_ERR, "can't write into pipe");
-	    exit(1);
-	}
+    if (write(child_handler_pipe[1], &c, 1) == -1) {
+        /* nothing to be done about it here */
     }
+
+    errno = saved_errno;
 }
 
 /* Poll the existing interface state, so we can catch any state
@@ -180,17 +218,6 @@ child_handler(int sig, siginfo_t *info, void *v)
 static void
 poll_interfaces(void)
 {
-    static int sockfd = -1;
-
-    if (sockfd == -1) {
-        sockfd = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP);
-        if (sockfd == -1) {
-            do_log(LOG_ERR, "can't create interface socket: %m");
-            exit(1);
-        }
-        close_on_exec(sockfd);
-    }
-
     int pollflags(struct if_info *info) {
         struct ifreq ifr;
 
@@ -198,9 +225,11 @@ poll_interfaces(void)
             return 0;
 
         memcpy(ifr.ifr_name, info->name, sizeof(ifr.ifr_name));
-        if (ioctl(sockfd, SIOCGIFFLAGS, &ifr) < 0)
+        if (ioctl(netns_get(info->netns)->sockfd, SIOCGIFFLAGS, &ifr) < 0)
             do_log(LOG_ERR, "%s: can't get flags: %m", info->name);
         else {
+            if ((info->flags ^ ifr.ifr_flags) & (IFF_UP | IFF_RUNNING))
+                metrics_inc(poll_missed);
             ifsm_flagchange(info, ifr.ifr_flags);
             ifsm_flagpoll(info);
         }
@@ -211,17 +240,181 @@ poll_interfaces(void)
     for_each_iface(pollflags);
 }
 
+static void
+handle_child(struct child_exit *ce)
+{
+    /* A script that says it is done just before it exits is likely
+       to have been reaped first. */
+    if (ce->early) {
+        if (!ifsm_scriptnotify(ce->pid, ce->status))
+            do_log(LOG_DEBUG, "pid %d said it was done, but nothing was "
+                   "waiting for it", ce->pid);
+        return;
+    }
+
+    if (!ifsm_scriptdone(ce->pid, ce->status))
+        do_log(LOG_INFO, "Unexpected child %d exited with status %d",
+               ce->pid, ce->status);
+}
+
+/* What a shard does between events; the watchdog says when it next
+   needs to be run. */
+static int
+shard_idle(void)
+{
+    poll_interfaces();
+    ifsm_expire();
+
+    return ifsm_timeout();
+}
+
+/* The sooner of two poll() timeouts, where -1 is never. */
+static int
+sooner(int a, int b)
+{
+    if (a == -1)
+        return b;
+    if (b == -1)
+        return a;
+    return a < b ? a : b;
+}
+
+/* An exit comes only to the shard that started the script; see
+   shard_reap().  One whose pid no shard noted, such as a helper we
+   forked ourselves, goes to every shard, where nobody knows it, so
+   there is nothing to complain about here. */
+static void
+handle_shard_child(struct child_exit *ce)
+{
+    if (ce->early)
+        ifsm_scriptnotify(ce->pid, ce->status);
+    else
+        ifsm_scriptdone(ce->pid, ce->status);
+}
+
 int debug = 0;
 
+/* long options with no short equivalent */
+enum {
+    OPT_METRICS_SOCKET = 256,
+    OPT_METRICS_FILE,
+    OPT_METRICS_INTERVAL,
+    OPT_NOTIFY_SOCKET,
+    OPT_STATE_FILE,
+    OPT_HISTORY_FILE,
+    OPT_SCRIPT_TIMEOUT,
+    OPT_SLOW_SCRIPT,
+    OPT_CGROUP,
+    OPT_SCRIPT_CPU_WEIGHT,
+    OPT_SCRIPT_MEMORY_MAX,
+    OPT_SCRIPT_CPUS,
+    OPT_ONLINE_FILE,
+    OPT_ONLINE_TIMEOUT,
+    OPT_WAIT_ONLINE,
+    OPT_ADDRESSES,
+    OPT_SCRIPT_RETRY,
+    OPT_RETRY_BACKOFF,
+    OPT_HOOKS,
+    OPT_LINK_KIND,
+    OPT_UDEV,
+};
+
+/* --script-timeout and --script-retry: [action=]number */
+static void
+set_per_action(const char *opt, char *arg, void (*set)(int, unsigned))
+{
+    char *eq = strchr(arg, '=');
+    int action = -1;
+    char *end;
+
+    if (eq) {
+        for (int a = 0; a < NR_ACTIONS; a++) {
+            if (strncmp(arg, action_name(a), eq - arg) == 0 &&
+                action_name(a)[eq - arg] == '\0')
+                action = a;
+        }
+        if (action == -1) {
+            fprintf(stderr, "Bad action for '--%s %s'\n", opt, arg);
+            exit(1);
+        }
+    }
+
+    long n = strtol(eq ? eq + 1 : arg, &end, 10);
+
+    if (*end != '\0' || end == (eq ? eq + 1 : arg) || n < 0) {
+        fprintf(stderr, "Bad number for '--%s %s'\n", opt, arg);
+        exit(1);
+    }
+
+    set(action, n);
+}
+
+/* --retry-backoff initial[,max], in seconds */
+static void
+set_backoff(char *arg)
+{
+    char *end;
+    double initial = strtod(arg, &end), max = 60;
+
+    if (*end == ',')
+        max = strtod(end + 1, &end);
+
+    if (*end != '\0' || end == arg || initial <= 0 || max < initial) {
+        fprintf(stderr, "Bad backoff for '--retry-backoff %s'\n", arg);
+        exit(1);
+    }
+
+    ifsm_set_backoff(initial * 1000, max * 1000);
+}
+
 int
 main(int argc, char *argv[])
 {
     int foreground = 0;
     int cfg_read = 0;
     int probe = 1;
+    int threaded = 0;
+    int nshards = 0;
+    int use_udev = 0;
+    char *metrics_socket = NULL;
+    char *metrics_file = NULL;
+    char *history_file = NULL;
+    int metrics_interval = 10;
+    char *online_file = ONLINE_FILE;
+    int wait_secs = -1;
     int c;
 
-    while ((c = getopt(argc, argv, "DFPc:s:hi:p:")) != EOF) {
+    static const struct option longopts[] = {
+        { "record", required_argument, NULL, 'r' },
+        { "metrics-socket", required_argument, NULL, OPT_METRICS_SOCKET },
+        { "metrics-file", required_argument, NULL, OPT_METRICS_FILE },
+        { "metrics-interval", required_argument, NULL,
+          OPT_METRICS_INTERVAL },
+        { "notify-socket", required_argument, NULL, OPT_NOTIFY_SOCKET },
+        { "state-file", required_argument, NULL, OPT_STATE_FILE },
+        { "history-file", required_argument, NULL, OPT_HISTORY_FILE },
+        { "script-timeout", required_argument, NULL, OPT_SCRIPT_TIMEOUT },
+        { "slow-script", required_argument, NULL, OPT_SLOW_SCRIPT },
+        { "cgroup", required_argument, NULL, OPT_CGROUP },
+        { "script-cpu-weight", required_argument, NULL,
+          OPT_SCRIPT_CPU_WEIGHT },
+        { "script-memory-max", required_argument, NULL,
+          OPT_SCRIPT_MEMORY_MAX },
+        { "script-cpus", required_argument, NULL, OPT_SCRIPT_CPUS },
+        { "online-file", required_argument, NULL, OPT_ONLINE_FILE },
+        { "online-timeout", required_argument, NULL, OPT_ONLINE_TIMEOUT },
+        { "wait-online", optional_argument, NULL, OPT_WAIT_ONLINE },
+        { "addresses", no_argument, NULL, OPT_ADDRESSES },
+        { "script-retry", required_argument, NULL, OPT_SCRIPT_RETRY },
+        { "retry-backoff", required_argument, NULL, OPT_RETRY_BACKOFF },
+        { "hooks", optional_argument, NULL, OPT_HOOKS },
+        { "link-kind", required_argument, NULL, OPT_LINK_KIND },
+        { "udev", no_argument, NULL, OPT_UDEV },
+        { NULL, 0, NULL, 0 },
+    };
+
+    while ((c = getopt_long(argc, argv, "DFPtc:s:hi:j:n:p:r:",
+                            longopts, NULL)) != EOF) {
         switch (c) {
         case 'D':
             debug = 1;
@@ -232,6 +425,9 @@ main(int argc, char *argv[])
         case 'P':
             probe = 0;
             break;
+        case 't':
+            threaded = 1;
+            break;
         case 'c':
             read_config(optarg);
             cfg_read = 1;
@@ -249,18 +445,136 @@ main(int argc, char *argv[])
                 exit(1);
             }
             break;
+        case 'j':
+            nshards = atoi(optarg);
+            if (nshards < 1 || nshards > 64) {
+                fprintf(stderr, "Bad shard count for '-j %s'\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'n':
+            if (netns_add(optarg) == -1) {
+                fprintf(stderr, "Bad namespace for '-n %s'\n", optarg);
+                exit(1);
+            }
+            break;
         case 'p':
             pid_file = optarg;
             break;
+        case 'r':
+            record_open(optarg);
+            break;
+        case OPT_METRICS_SOCKET:
+            metrics_socket = optarg;
+            break;
+        case OPT_METRICS_FILE:
+            metrics_file = optarg;
+            break;
+        case OPT_METRICS_INTERVAL:
+            metrics_interval = atoi(optarg);
+            if (metrics_interval < 1) {
+                fprintf(stderr, "Bad interval for '--metrics-interval %s'\n",
+                        optarg);
+                exit(1);
+            }
+            break;
+        case OPT_NOTIFY_SOCKET:
+            notify_open(optarg);
+            break;
+        case OPT_STATE_FILE:
+            state_open(optarg);
+            break;
+        case OPT_HISTORY_FILE:
+            history_file = optarg;
+            break;
+        case OPT_SCRIPT_TIMEOUT:
+            set_per_action("script-timeout", optarg, ifsm_set_timeout);
+            break;
+        case OPT_SLOW_SCRIPT:
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "Bad time for '--slow-script %s'\n", optarg);
+                exit(1);
+            }
+            ifsm_set_slow(atoi(optarg));
+            break;
+        case OPT_CGROUP:
+            cgroup_use(optarg);
+            break;
+        case OPT_SCRIPT_CPU_WEIGHT:
+            cgroup_limit("cpu.weight", optarg);
+            break;
+        case OPT_SCRIPT_MEMORY_MAX:
+            cgroup_limit("memory.max", optarg);
+            break;
+        case OPT_SCRIPT_CPUS:
+            cgroup_limit("cpuset.cpus", optarg);
+            break;
+        case OPT_ONLINE_FILE:
+            online_file = optarg;
+            break;
+        case OPT_ONLINE_TIMEOUT:
+            if (atoi(optarg) < 0) {
+                fprintf(stderr, "Bad timeout for '--online-timeout %s'\n",
+                        optarg);
+                exit(1);
+            }
+            online_set_timeout(atoi(optarg));
+            break;
+        case OPT_WAIT_ONLINE:
+            wait_secs = optarg ? atoi(optarg) : 0;
+            if (wait_secs < 0) {
+                fprintf(stderr, "Bad timeout for '--wait-online=%s'\n",
+                        optarg);
+                exit(1);
+            }
+            break;
+        case OPT_ADDRESSES:
+            netlink_addresses = 1;
+            break;
+        case OPT_SCRIPT_RETRY:
+            set_per_action("script-retry", optarg, ifsm_set_retry);
+            break;
+        case OPT_RETRY_BACKOFF:
+            set_backoff(optarg);
+            break;
+        case OPT_HOOKS:
+            hooks_use(optarg ? optarg : NP_SCRIPT_DIR);
+            break;
+        case OPT_LINK_KIND:
+            if (optarg[0] == '\0' || strlen(optarg) >= IFNAMSIZ) {
+                fprintf(stderr, "Bad kind for '--link-kind %s'\n", optarg);
+                exit(1);
+            }
+            netlink_kind = optarg;
+            break;
+        case OPT_UDEV:
+            use_udev = 1;
+            break;
         case '?':
             usage(argv[0], 1);
         }
     }
 
+    /* Not the daemon at all, but something waiting for it. */
+    if (wait_secs != -1)
+        return wait_online(online_file, wait_secs);
+
+    online_set_file(online_file);
+
     if (!cfg_read) {
         read_config(NP_ETC_DIR "/netplugd.conf");
     }
 
+    /* A daemon's stderr goes nowhere. */
+    if (history_file == NULL && !foreground)
+        history_file = "/var/run/netplugd.history";
+    history_set_file(history_file);
+
+    if (metrics_socket)
+        metrics_to_socket(metrics_socket);
+    if (metrics_file)
+        metrics_to_file(metrics_file, metrics_interval);
+
     if (getuid() != 0) {
         do_log(LOG_WARNING, "This daemon will not work properly unless "
                "run by root");
@@ -290,6 +604,16 @@ main(int argc, char *argv[])
         exit(1);
     }
 
+    struct sigaction hist_act = {
+        .sa_handler = history_handler,
+        .sa_flags = SA_RESTART,
+    };
+
+    if (sigaction(SIGUSR1, &hist_act, NULL) == -1) {
+        do_log(LOG_ERR, "can't catch user signal: %m");
+        exit(1);
+    }
+
     if (!foreground) {
         use_syslog = 1;
         openlog("netplugd", LOG_PID, LOG_DAEMON);
@@ -303,7 +627,10 @@ main(int argc, char *argv[])
     close_on_exec(child_handler_pipe[0]);
     close_on_exec(child_handler_pipe[1]);
 
-    if (fcntl(child_handler_pipe[0], F_SETFL, O_NONBLOCK) == -1) {
+    /* Both ends: the handler must never block, whatever the main
+       loop is doing. */
+    if (fcntl(child_handler_pipe[0], F_SETFL, O_NONBLOCK) == -1 ||
+        fcntl(child_handler_pipe[1], F_SETFL, O_NONBLOCK) == -1) {
         do_log(LOG_ERR, "can't set pipe non-blocking: %m");
         exit(1);
     }
@@ -318,14 +645,26 @@ main(int argc, char *argv[])
         exit(1);
     }
 
-    int fd = netlink_open();
+    /* Before the dump, so that what it finds can be held. */
+    if (use_udev)
+        udev_open();
 
-    netlink_request_dump(fd);
-    netlink_receive_dump(fd, if_info_save_interface, NULL);
+    netns_open_all();
 
-    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
-        do_log(LOG_ERR, "can't set socket non-blocking: %m");
-        exit(1);
+    int nfds = netns_count();
+
+    for (int n = 0; n < nfds; n++) {
+        struct netns *ns = netns_get(n);
+
+        netlink_dump(ns->nlfd, RTM_GETLINK, if_info_save_interface, ns);
+
+        if (netlink_addresses)
+            netlink_dump(ns->nlfd, RTM_GETADDR, if_info_save_interface, ns);
+
+        if (fcntl(ns->nlfd, F_SETFL, O_NONBLOCK) == -1) {
+            do_log(LOG_ERR, "can't set socket non-blocking: %m");
+            exit(1);
+        }
     }
 
     if (!foreground) {
@@ -334,21 +673,52 @@ main(int argc, char *argv[])
 	    exit(1);
 	}
 
+        state_set_pid();
+
         if (pid_file) {
             atexit(tidy_pid);
             write_pid();
         }
     }
 
-    struct pollfd fds[] = {
-        { fd, POLLIN, 0 },
-        { child_handler_pipe[0], POLLIN, 0 },
-    };
-
-    {
+    cgroup_open();
+    early_open();
+    log_start();
+
+    /* One netlink socket per namespace, then the child pipe, then the
+       metrics socket, if any, then the scripts' notify socket, then
+       udev's, with --udev.  With a reader thread, the netlink sockets
+       belong to it, and we only watch for its wakeups. */
+    struct pollfd *fds = xmalloc((nfds + 4) * sizeof(*fds));
+
+    if (threaded) {
+        nfds = 1;
+        fds[0].fd = reader_start();
+        fds[0].events = POLLIN;
+    } else {
+        for (int n = 0; n < nfds; n++) {
+            fds[n].fd = netns_get(n)->nlfd;
+            fds[n].events = POLLIN;
+        }
+    }
+    fds[nfds].fd = child_handler_pipe[0];
+    fds[nfds].events = POLLIN;
+    fds[nfds + 1].fd = metrics_fd();
+    fds[nfds + 1].events = POLLIN;
+    fds[nfds + 2].fd = early_fd();
+    fds[nfds + 2].events = POLLIN;
+    fds[nfds + 3].fd = udev_fd();
+    fds[nfds + 3].events = POLLIN;
+
+    notify_start(nshards);
+    online_start();
+
+    if (!nshards) {
         /* Run over each of the interfaces we know and care about, and
            make sure the state machine has done the appropriate thing
-           for their current state. */
+           for their current state.  Shards do this for themselves
+           when they start, so that the scripts it starts are on their
+           timer wheels. */
         int poll_flags(struct if_info *i) {
             if (if_match(i->name))
                 ifsm_flagpoll(i);
@@ -357,13 +727,38 @@ main(int argc, char *argv[])
         for_each_iface(poll_flags);
     }
 
+    /* From here on, the shards own the interfaces, and we just pass
+       events along to them. */
+    if (nshards) {
+        shard_start(nshards, if_info_handle_event, handle_shard_child,
+                    shard_idle);
+        link_sink = shard_dispatch_link;
+    }
+
     for(;;) {
         int ret;
 
+        record_flush();
+
+        if (history_wanted) {
+            history_wanted = 0;
+            if (history_write() == 0)
+                do_log(LOG_NOTICE, "wrote interface history");
+        }
+
         /* Make sure we don't miss anything interesting */
-        poll_interfaces();
+        if (!nshards)
+            poll_interfaces();
+
+        int timeout = sooner(metrics_timeout(), online_timeout());
+
+        timeout = sooner(timeout, udev_timeout());
+        timeout = sooner(timeout, cgroup_timeout());
+
+        if (!nshards)
+            timeout = sooner(timeout, ifsm_timeout());
 
-        ret = poll(fds, sizeof(fds)/sizeof(fds[0]), -1);
+        ret = poll(fds, nfds + 4, timeout);
 
         if (ret == -1) {
             if (errno == EINTR)
@@ -371,37 +766,72 @@ main(int argc, char *argv[])
             do_log(LOG_ERR, "poll failed: %m");
             exit(1);
         }
-        if (ret == 0) {         /* XXX??? */
-            sleep(1);           /* don't spin */
+
+        metrics_tick();
+        online_tick();
+        udev_release(link_sink);
+        cgroup_tick();
+        if (!nshards)
+            ifsm_expire();
+
+        if (ret == 0)
             continue;
-        }
 
-        if (fds[0].revents & POLLIN) {
-            /* interface flag state change */
-            if (netlink_listen(fd, handle_interface, NULL) == 0)
+        if (fds[nfds + 1].revents & POLLIN)
+            metrics_accept();
+
+        if (threaded) {
+            if ((fds[0].revents & POLLIN) &&
+                reader_drain(handle_link_event) == 0)
                 break;          /* done */
+        } else for (int n = 0; n < nfds; n++) {
+            if (fds[n].revents & POLLIN) {
+                /* interface flag state change */
+                if (netlink_listen(fds[n].fd, handle_interface,
+                                   netns_get(n)) == 0)
+                    goto out;   /* done */
+            }
         }
 
-        if (fds[1].revents & POLLIN) {
-            /* netplug script finished */
+        if (fds[nfds].revents & POLLIN) {
+            /* netplug scripts finished */
+            char buf[256];
             int ret;
             struct child_exit ce;
 
-            do {
-                ret = read(child_handler_pipe[0], &ce, sizeof(ce));
+            /* Empty the pipe first: a SIGCHLD from here on wakes us
+               again, for anything the loop below misses. */
+            while ((ret = read(child_handler_pipe[0], buf, sizeof(buf))) > 0)
+                ;
+            if (ret == -1 && errno != EAGAIN) {
+                do_log(LOG_ERR, "pipe read failed: %m");
+                exit(1);
+            }
 
-                assert(ret == 0 || ret == -1 || ret == sizeof(ce));
+            /* SIGCHLDs that arrive together are delivered as one, so
+               reap every child that has exited. */
+            while (shard_reap(&ce)) {
+                cgroup_reap(ce.pid);
 
-                if (ret == sizeof(ce))
-                    ifsm_scriptdone(ce.pid, ce.status);
-                else if (ret == -1 && errno != EAGAIN) {
-                    do_log(LOG_ERR, "pipe read failed: %m");
-                    exit(1);
-                }
-            } while(ret == sizeof(ce));
+                if (nshards)
+                    shard_dispatch_child(&ce);
+                else
+                    handle_child(&ce);
+            }
         }
+
+        /* after exits, so a script that said it was done, and then
+           exited, is not taken for one still running */
+        if (fds[nfds + 2].revents & POLLIN)
+            early_receive(nshards ? shard_dispatch_child : handle_child);
+
+        /* What it says is acted on at the top of the loop; see
+           udev_timeout(). */
+        if (fds[nfds + 3].revents & POLLIN)
+            udev_receive();
     }
 
+ out:
     return 0;
 }
 
@@ -0,0 +1,434 @@
+/*
+ * metrics.c - counters and latency histograms, in Prometheus format
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Everything here may be updated from the reader and shard threads
+ * as well as the main thread, so updates are relaxed atomic adds.
+ * Nobody needs a consistent snapshot across several counters.
+ *
+ * Histograms have power-of-two buckets in nanoseconds, from 1us up
+ * to about 68s, plus one for everything longer.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "netplug.h"
+
+#define HIST_SHIFT      10      /* first bucket is < 2^10ns */
+
+struct metrics metrics = {
+    .decode = { "netplugd_decode_seconds",
+                "Time to decode one netlink link message" },
+    .event = { "netplugd_event_seconds",
+               "Time to match a link event and run it through the "
+               "state machine" },
+    .event_to_spawn = { "netplugd_event_to_spawn_seconds",
+                        "Time from receiving a link event to starting "
+                        "the script it caused" },
+    .spawn = { "netplugd_spawn_seconds",
+               "Time taken to fork a script" },
+    .script = {
+        [ACT_PROBE] = { "netplugd_script_seconds", "Script run time",
+                        "probe" },
+        [ACT_IN] = { "netplugd_script_seconds", "Script run time", "in" },
+        [ACT_OUT] = { "netplugd_script_seconds", "Script run time",
+                      "out" },
+        [ACT_READY] = { "netplugd_script_seconds", "Script run time",
+                        "ready" },
+    },
+};
+
+static const char *metrics_file;
+static char *metrics_tmp;
+static int metrics_interval = 10;
+static unsigned long long next_write;
+static int listen_fd = -1;
+static const char *socket_path;
+
+
+void
+hist_observe(struct histogram *h, unsigned long long ns)
+{
+    int b = ns < (1ULL << HIST_SHIFT) ? 0 :
+        64 - HIST_SHIFT - __builtin_clzll(ns);
+
+    if (b >= HIST_BUCKETS)
+        b = HIST_BUCKETS - 1;
+
+    __atomic_fetch_add(&h->bucket[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+}
+
+
+int
+action_index(const char *action)
+{
+    switch (action[0]) {
+    case 'p': return ACT_PROBE;
+    case 'i': return ACT_IN;
+    case 'o': return ACT_OUT;
+    case 'r': return ACT_READY;
+    default: return -1;
+    }
+}
+
+
+static const char *action_names[] = {
+    [ACT_PROBE] = "probe",
+    [ACT_IN] = "in",
+    [ACT_OUT] = "out",
+    [ACT_READY] = "ready",
+};
+
+
+const char *
+action_name(int action)
+{
+    return action_names[action];
+}
+
+
+static unsigned long long
+get(unsigned long long *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+
+static void
+write_counter(FILE *fp, const char *name, const char *help,
+              unsigned long long value)
+{
+    fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            name, help, name, name, value);
+}
+
+
+static void
+write_histogram(FILE *fp, struct histogram *h, int header)
+{
+    char label[64] = "";
+    unsigned long long cum = 0;
+
+    if (header)
+        fprintf(fp, "# HELP %s %s\n# TYPE %s histogram\n",
+                h->name, h->help, h->name);
+
+    if (h->action)
+        snprintf(label, sizeof(label), "action=\"%s\",", h->action);
+
+    for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+        cum += get(&h->bucket[b]);
+        fprintf(fp, "%s_bucket{%sle=\"%.9g\"} %llu\n", h->name, label,
+                (double) (1ULL << (b + HIST_SHIFT)) / 1e9, cum);
+    }
+    cum += get(&h->bucket[HIST_BUCKETS - 1]);
+    fprintf(fp, "%s_bucket{%sle=\"+Inf\"} %llu\n", h->name, label, cum);
+
+    if (h->action)
+        snprintf(label, sizeof(label), "{action=\"%s\"}", h->action);
+
+    fprintf(fp, "%s_sum%s %.9f\n", h->name, label, get(&h->sum) / 1e9);
+    fprintf(fp, "%s_count%s %llu\n", h->name, label, get(&h->count));
+}
+
+
+void
+metrics_write(FILE *fp)
+{
+    write_counter(fp, "netplugd_netlink_messages_total",
+                  "Netlink messages received",
+                  get(&metrics.messages));
+    write_counter(fp, "netplugd_link_events_total",
+                  "Link messages decoded into events",
+                  get(&metrics.events));
+    write_counter(fp, "netplugd_events_ignored_total",
+                  "Link events for interfaces matching no pattern",
+                  get(&metrics.ignored));
+    write_counter(fp, "netplugd_poll_missed_changes_total",
+                  "Flag changes found by polling that netlink missed",
+                  get(&metrics.poll_missed));
+
+    fprintf(fp, "# HELP netplugd_scripts_started_total Scripts started\n"
+            "# TYPE netplugd_scripts_started_total counter\n");
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        fprintf(fp, "netplugd_scripts_started_total{action=\"%s\"} %llu\n",
+                action_names[a], get(&metrics.started[a]));
+    }
+
+    fprintf(fp, "# HELP netplugd_scripts_exited_total Scripts exited\n"
+            "# TYPE netplugd_scripts_exited_total counter\n");
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        fprintf(fp, "netplugd_scripts_exited_total{action=\"%s\","
+                "result=\"ok\"} %llu\n",
+                action_names[a], get(&metrics.exited_ok[a]));
+        fprintf(fp, "netplugd_scripts_exited_total{action=\"%s\","
+                "result=\"failed\"} %llu\n",
+                action_names[a], get(&metrics.exited_failed[a]));
+    }
+
+    write_counter(fp, "netplugd_scripts_slow_total",
+                  "Scripts still running after --slow-script seconds",
+                  get(&metrics.slow));
+
+    fprintf(fp, "# HELP netplugd_scripts_timed_out_total "
+            "Scripts sent SIGTERM for running past their deadline\n"
+            "# TYPE netplugd_scripts_timed_out_total counter\n");
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        fprintf(fp, "netplugd_scripts_timed_out_total{action=\"%s\"} %llu\n",
+                action_names[a], get(&metrics.timed_out[a]));
+    }
+
+    write_counter(fp, "netplugd_scripts_killed_total",
+                  "Timed out scripts sent SIGKILL for ignoring SIGTERM",
+                  get(&metrics.killed));
+
+    fprintf(fp, "# HELP netplugd_script_retries_total "
+            "Failed scripts run again\n"
+            "# TYPE netplugd_script_retries_total counter\n");
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        fprintf(fp, "netplugd_script_retries_total{action=\"%s\"} %llu\n",
+                action_names[a], get(&metrics.retries[a]));
+    }
+
+    fprintf(fp, "# HELP netplugd_scripts_early_total "
+            "Scripts that said they were done before exiting\n"
+            "# TYPE netplugd_scripts_early_total counter\n");
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        fprintf(fp, "netplugd_scripts_early_total{action=\"%s\"} %llu\n",
+                action_names[a], get(&metrics.early[a]));
+    }
+
+    write_counter(fp, "netplugd_dad_failed_total",
+                  "IPv6 addresses that failed duplicate address detection",
+                  get(&metrics.dad_failed));
+
+    write_counter(fp, "netplugd_dump_retries_total",
+                  "Link and address dumps done again after being interrupted",
+                  get(&metrics.dump_retries));
+
+    write_counter(fp, "netplugd_udev_held_total",
+                  "New interfaces held back until udev was done with them",
+                  get(&metrics.udev_held));
+
+    write_counter(fp, "netplugd_renamed_scripts_total",
+                  "Scripts run for an interface under a name it then lost",
+                  get(&metrics.renamed_scripts));
+
+    write_counter(fp, "netplugd_state_recoveries_total",
+                  "Interfaces started over after an event their state "
+                  "had no way to take",
+                  get(&metrics.recovered));
+
+    long long cpu[NR_ACTIONS], memory[NR_ACTIONS];
+
+    for (int a = 0; a < NR_ACTIONS; a++)
+        cgroup_usage(a, &cpu[a], &memory[a]);
+
+    if (cpu[0] != -1) {
+        fprintf(fp, "# HELP netplugd_script_cpu_seconds_total "
+                "CPU time used by scripts, from their cgroups\n"
+                "# TYPE netplugd_script_cpu_seconds_total counter\n");
+        for (int a = 0; a < NR_ACTIONS; a++) {
+            fprintf(fp, "netplugd_script_cpu_seconds_total{action=\"%s\"} "
+                    "%.6f\n", action_names[a], cpu[a] / 1e6);
+        }
+    }
+
+    if (memory[0] != -1) {
+        fprintf(fp, "# HELP netplugd_script_memory_peak_bytes "
+                "Most memory scripts have used at once, from their "
+                "cgroups\n"
+                "# TYPE netplugd_script_memory_peak_bytes gauge\n");
+        for (int a = 0; a < NR_ACTIONS; a++) {
+            fprintf(fp, "netplugd_script_memory_peak_bytes"
+                    "{action=\"%s\"} %lld\n", action_names[a], memory[a]);
+        }
+    }
+
+    fprintf(fp, "# HELP netplugd_state_transitions_total "
+            "Interface state machine transitions\n"
+            "# TYPE netplugd_state_transitions_total counter\n");
+    for (int from = 0; from < NR_STATES; from++) {
+        for (int to = 0; to < NR_STATES; to++) {
+            unsigned long long n = get(&metrics.transitions[from][to]);
+
+            if (n)
+                fprintf(fp, "netplugd_state_transitions_total"
+                        "{from=\"%s\",to=\"%s\"} %llu\n",
+                        statename(from), statename(to), n);
+        }
+    }
+
+    fprintf(fp, "# HELP netplugd_event_queue_high_water "
+            "Deepest the netlink reader's event queue has been\n"
+            "# TYPE netplugd_event_queue_high_water gauge\n"
+            "netplugd_event_queue_high_water %u\n",
+            __atomic_load_n(&metrics.queue_high_water, __ATOMIC_RELAXED));
+
+    write_histogram(fp, &metrics.decode, 1);
+    write_histogram(fp, &metrics.event, 1);
+    write_histogram(fp, &metrics.event_to_spawn, 1);
+    write_histogram(fp, &metrics.spawn, 1);
+    for (int a = 0; a < NR_ACTIONS; a++) {
+        write_histogram(fp, &metrics.script[a], a == 0);
+    }
+}
+
+
+/* Export metrics by rewriting path every interval seconds. */
+void
+metrics_to_file(const char *path, int interval)
+{
+    metrics_file = path;
+    metrics_interval = interval;
+
+    if (asprintf(&metrics_tmp, "%s.tmp", path) == -1) {
+        do_log(LOG_ERR, "asprintf: %m");
+        exit(1);
+    }
+}
+
+
+static void
+tidy_socket(void)
+{
+    unlink(socket_path);
+}
+
+
+/* Export metrics to anyone who connects to a Unix socket at path. */
+void
+metrics_to_socket(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        do_log(LOG_ERR, "%s: socket path too long", path);
+        exit(1);
+    }
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+                            SOCK_CLOEXEC, 0)) == -1) {
+        do_log(LOG_ERR, "can't create metrics socket: %m");
+        exit(1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 16) == -1) {
+        do_log(LOG_ERR, "%s: %m", path);
+        exit(1);
+    }
+
+    socket_path = path;
+    atexit(tidy_socket);
+}
+
+
+int
+metrics_fd(void)
+{
+    return listen_fd;
+}
+
+
+void
+metrics_accept(void)
+{
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        char *buf;
+        size_t len;
+        FILE *fp = open_memstream(&buf, &len);
+
+        if (fp == NULL) {
+            close(fd);
+            continue;
+        }
+
+        metrics_write(fp);
+        fclose(fp);
+
+        /* A few kilobytes fit in any socket buffer; a client that
+           can't take them all at once gets what fitted. */
+        if (write(fd, buf, len) == -1 && errno != EAGAIN)
+            do_log(LOG_WARNING, "can't send metrics: %m");
+
+        free(buf);
+        close(fd);
+    }
+}
+
+
+/* How long the main loop may sleep before the metrics file is due,
+   in milliseconds, or -1 if it never is. */
+int
+metrics_timeout(void)
+{
+    if (metrics_file == NULL)
+        return -1;
+
+    unsigned long long now = monotonic_ns();
+
+    if (next_write <= now)
+        return 0;
+
+    return (next_write - now + 999999) / 1000000;
+}
+
+
+void
+metrics_tick(void)
+{
+    if (metrics_file == NULL || monotonic_ns() < next_write)
+        return;
+
+    FILE *fp = fopen(metrics_tmp, "w");
+
+    if (fp == NULL) {
+        do_log(LOG_ERR, "%s: %m", metrics_tmp);
+    } else {
+        metrics_write(fp);
+        if (fclose(fp) == EOF || rename(metrics_tmp, metrics_file) == -1)
+            do_log(LOG_ERR, "%s: %m", metrics_file);
+    }
+
+    next_write = monotonic_ns() + metrics_interval * 1000000000ULL;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
@@ -25,19 +25,60 @@
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
+#include <time.h>
 
 #include "netplug.h"
 
 
 static int seq, dump;
 
+/* When the datagram being handled was received, on CLOCK_MONOTONIC. */
+__thread unsigned long long netlink_rx_ns;
 
-void
-netlink_request_dump(int fd)
+/* If set, sees every message before it is handed to a callback. */
+void (*netlink_tap)(struct nlmsghdr *hdr, void *arg, int dump);
+
+/* netplugd-bench feeds netlink_listen() from one end of a socketpair,
+   which has no sender address to check. */
+int netlink_fake_fd = -1;
+
+/* Also listen for addresses coming and going; see --addresses. */
+int netlink_addresses;
+
+
+/* Only links of this kind, such as "veth"; see --link-kind. */
+const char *netlink_kind;
+
+/* The kernel checks dump requests strictly, and so may filter them. */
+static int strict;
+
+
+static void
+add_attr(struct nlmsghdr *hdr, int type, const void *data, int len)
+{
+    struct rtattr *rta = (void *) ((char *) hdr + NLMSG_ALIGN(hdr->nlmsg_len));
+
+    rta->rta_type = type;
+    rta->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(rta), data, len);
+    hdr->nlmsg_len = NLMSG_ALIGN(hdr->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+}
+
+
+/* Ask for every link, or with RTM_GETADDR, every address.  Links come
+   without their statistics, which are most of each message, and which
+   we never look at, and with --link-kind, only of that kind, if the
+   kernel can be asked for that. */
+static void
+request_dump(int fd, int type)
 {
     struct {
         struct nlmsghdr hdr;
-        struct rtgenmsg msg;
+        union {
+            struct ifinfomsg ifi;
+            struct ifaddrmsg ifa;
+        } msg;
+        char attrs[64];
     } req;
     struct sockaddr_nl addr;
 
@@ -45,14 +86,34 @@ netlink_request_dump(int fd)
     addr.nl_family = AF_NETLINK;
 
     memset(&req, 0, sizeof(req));
-    req.hdr.nlmsg_len = sizeof(req);
-    req.hdr.nlmsg_type = RTM_GETLINK;
-    req.hdr.nlmsg_flags = NLM_F_ROOT | NLM_F_MATCH | NLM_F_REQUEST;
+    req.hdr.nlmsg_len = NLMSG_LENGTH(type == RTM_GETADDR ?
+                                     sizeof(req.msg.ifa) :
+                                     sizeof(req.msg.ifi));
+    req.hdr.nlmsg_type = type;
+    req.hdr.nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST;
     req.hdr.nlmsg_pid = 0;
     req.hdr.nlmsg_seq = dump = ++seq;
-    req.msg.rtgen_family = AF_UNSPEC;
+    req.msg.ifi.ifi_family = AF_UNSPEC;
+
+    if (type == RTM_GETLINK) {
+        unsigned mask = RTEXT_FILTER_SKIP_STATS;
+
+        add_attr(&req.hdr, IFLA_EXT_MASK, &mask, sizeof(mask));
+
+        if (netlink_kind && strict) {
+            struct rtattr *info = (void *) ((char *) &req +
+                                            NLMSG_ALIGN(req.hdr.nlmsg_len));
 
-    if (sendto(fd, (void*) &req, sizeof(req), 0,
+            info->rta_type = IFLA_LINKINFO;
+            req.hdr.nlmsg_len = NLMSG_ALIGN(req.hdr.nlmsg_len) +
+                RTA_LENGTH(0);
+            add_attr(&req.hdr, IFLA_INFO_KIND, netlink_kind,
+                     strlen(netlink_kind) + 1);
+            info->rta_len = (char *) &req + req.hdr.nlmsg_len - (char *) info;
+        }
+    }
+
+    if (sendto(fd, (void*) &req, req.hdr.nlmsg_len, 0,
                (struct sockaddr *) &addr, sizeof(addr)) == -1) {
         do_log(LOG_ERR, "Could not request interface dump: %m");
         exit(1);
@@ -69,9 +130,42 @@ typedef enum {
 } todo;
 
 
+/* Prefer the kernel's own receive time, if it gave us one, but
+   netlink sockets don't, as of this writing; then now will do. */
+static unsigned long long
+rx_time(struct msghdr *msg)
+{
+    unsigned long long now = monotonic_ns();
+    struct cmsghdr *cmsg;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec stamp, real;
+
+            memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+            clock_gettime(CLOCK_REALTIME, &real);
+
+            long long age = (real.tv_sec - stamp.tv_sec) * 1000000000LL +
+                real.tv_nsec - stamp.tv_nsec;
+
+            if (age >= 0 && age < now)
+                return now - age;
+        }
+    }
+
+    return now;
+}
+
+
 static todo
 receive(int fd, struct msghdr *msg, int *status)
 {
+    char cbuf[CMSG_SPACE(sizeof(struct timespec))];
+
+    msg->msg_control = cbuf;
+    msg->msg_controllen = sizeof(cbuf);
+
     *status = recvmsg(fd, msg, 0);
 
     if (*status == -1) {
@@ -91,6 +185,11 @@ receive(int fd, struct msghdr *msg, int *status)
 	return bail;
     }
 
+    netlink_rx_ns = rx_time(msg);
+
+    if (fd == netlink_fake_fd)
+        return ok;
+
     if (msg->msg_namelen != sizeof(struct sockaddr_nl)) {
 	do_log(LOG_ERR, "Unexpected sender address length: got %d, expected %d",
 	       msg->msg_namelen, (int) sizeof(struct sockaddr_nl));
@@ -161,6 +260,11 @@ netlink_listen(int fd, netlink_callback callback, void *arg)
                 return 1;
             }
 
+            metrics_inc(messages);
+
+            if (netlink_tap)
+                netlink_tap(hdr, arg, 0);
+
             if (callback) {
                 int err;
 
@@ -187,22 +291,39 @@ netlink_listen(int fd, netlink_callback callback, void *arg)
 }
 
 
-void
-netlink_receive_dump(int fd, netlink_callback callback, void *arg)
+/* Hand each message of the dump to callback.  Returns 0 once it is
+   all in, or -1 if it has to be done again: the kernel says links or
+   addresses changed while it was being put together, so it may have
+   missed some, or we lost part of it. */
+static int
+receive_dump(int fd, netlink_callback callback, void *arg)
 {
-    char buf[8192];
+    size_t size = 32768;
+    char *buf = xmalloc(size);
     struct sockaddr_nl addr;
-    struct iovec iov = { buf, sizeof(buf) };
+    struct iovec iov = { buf, size };
     struct msghdr msg = {
         .msg_name        = (void *) &addr,
         .msg_namelen = sizeof(addr),
         .msg_iov     = &iov,
         .msg_iovlen  = 1,
     };
+    int again = 0;
 
     while (1) {
 	int status;
-	
+
+        /* One message about a link with many VFs can be bigger than
+           the kernel's usual 32KB, so see how big the next is. */
+        ssize_t next = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+
+        if (next > (ssize_t) size) {
+            free(buf);
+            size = next;
+            iov.iov_base = buf = xmalloc(size);
+            iov.iov_len = size;
+        }
+
 	switch (receive(fd, &msg, &status)) {
 	case bail:
 	case done:
@@ -222,8 +343,12 @@ netlink_receive_dump(int fd, netlink_callback callback, void *arg)
                 goto skip_it;
             }
 
+            if (hdr->nlmsg_flags & NLM_F_DUMP_INTR)
+                again = 1;
+
             if (hdr->nlmsg_type == NLMSG_DONE) {
-                return;
+                free(buf);
+                return again ? -1 : 0;
             }
             else if (hdr->nlmsg_type == NLMSG_ERROR) {
                 struct nlmsgerr *err = (struct nlmsgerr *) NLMSG_DATA(hdr);
@@ -237,6 +362,11 @@ netlink_receive_dump(int fd, netlink_callback callback, void *arg)
                 exit(1);
             }
 
+            metrics_inc(messages);
+
+            if (netlink_tap)
+                netlink_tap(hdr, arg, 1);
+
             if (callback) {
 		int err;
 
@@ -251,9 +381,9 @@ netlink_receive_dump(int fd, netlink_callback callback, void *arg)
         }
         if (msg.msg_flags & MSG_TRUNC) {
             do_log(LOG_ERR, "Message truncated");
-            exit(1);
+            again = 1;
         }
-        if (status) {
+        else if (status) {
             do_log(LOG_ERR, "Dangling remnant of size %d!", status);
             exit(1);
         }
@@ -261,6 +391,35 @@ netlink_receive_dump(int fd, netlink_callback callback, void *arg)
 }
 
 
+#define DUMP_TRIES      5
+
+/* Dump every link, or with RTM_GETADDR, every address, to callback.
+   One that was interrupted is done again, a few times: whatever was
+   handed on from the first try is just seen again. */
+void
+netlink_dump(int fd, int type, netlink_callback callback, void *arg)
+{
+    for (int tries = 1; ; tries++) {
+        request_dump(fd, type);
+
+        if (receive_dump(fd, callback, arg) == 0)
+            return;
+
+        metrics_inc(dump_retries);
+
+        if (tries == DUMP_TRIES) {
+            do_log(LOG_WARNING, "%s dump still interrupted after %d tries; "
+                   "going with it", type == RTM_GETADDR ? "address" : "link",
+                   tries);
+            return;
+        }
+
+        do_log(LOG_INFO, "%s dump interrupted; trying again",
+               type == RTM_GETADDR ? "address" : "link");
+    }
+}
+
+
 int
 netlink_open(void)
 {
@@ -273,11 +432,23 @@ netlink_open(void)
 
     close_on_exec(fd);
 
+    /* Not fatal if this fails, or does nothing; see rx_time(). */
+    int one = 1;
+
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+
+    /* Nor this: older kernels ignore what they don't check. */
+    if (setsockopt(fd, SOL_NETLINK, NETLINK_GET_STRICT_CHK, &one,
+                   sizeof(one)) == 0)
+        strict = 1;
+
     struct sockaddr_nl addr;
 
     memset(&addr, 0, sizeof(addr));
     addr.nl_family = AF_NETLINK;
     addr.nl_groups = RTMGRP_LINK;
+    if (netlink_addresses)
+        addr.nl_groups |= RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
 
     if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
         do_log(LOG_ERR, "Could not bind netlink socket: %m");
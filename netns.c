@@ -0,0 +1,202 @@
+/*
+ * netns.c - watch interfaces in more than one network namespace
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "netplug.h"
+
+#define NETNS_RUN_DIR   "/run/netns"
+
+/* Slot 0 is always the namespace the daemon was started in. */
+static struct netns *namespaces;
+static int nr_namespaces = 1;
+
+
+static void
+init_home(void)
+{
+    if (namespaces != NULL)
+        return;
+
+    namespaces = xmalloc(sizeof(*namespaces));
+    memset(namespaces, 0, sizeof(*namespaces));
+    namespaces->nsfd = namespaces->nlfd = namespaces->sockfd = -1;
+}
+
+
+int
+netns_add(const char *name)
+{
+    if (*name == '\0')
+        return -1;
+
+    init_home();
+
+    for (int i = 1; i < nr_namespaces; i++) {
+        if (strcmp(namespaces[i].name, name) == 0)
+            return 0;
+    }
+
+    struct netns *ns = realloc(namespaces,
+                               (nr_namespaces + 1) * sizeof(*ns));
+
+    if (ns == NULL) {
+        do_log(LOG_ERR, "realloc: %m");
+        exit(1);
+    }
+
+    namespaces = ns;
+    ns = &namespaces[nr_namespaces];
+    memset(ns, 0, sizeof(*ns));
+    ns->id = nr_namespaces++;
+    ns->name = name;
+    ns->nsfd = ns->nlfd = ns->sockfd = -1;
+
+    return 0;
+}
+
+
+static int
+open_ns_file(const char *name)
+{
+    char path[4096];
+    int fd;
+
+    /* Anything with a slash in it is taken to be a path, such as
+       /proc/PID/ns/net; otherwise it is a name made by "ip netns". */
+    if (strchr(name, '/'))
+        snprintf(path, sizeof(path), "%s", name);
+    else
+        snprintf(path, sizeof(path), NETNS_RUN_DIR "/%s", name);
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        do_log(LOG_ERR, "%s: %m", path);
+        exit(1);
+    }
+
+    close_on_exec(fd);
+
+    return fd;
+}
+
+
+static void
+open_sockets(struct netns *ns)
+{
+    ns->nlfd = netlink_open();
+
+    if ((ns->sockfd = socket(PF_INET, SOCK_DGRAM, IPPROTO_IP)) == -1) {
+        do_log(LOG_ERR, "can't create interface socket: %m");
+        exit(1);
+    }
+
+    close_on_exec(ns->sockfd);
+}
+
+
+/* Sockets belong to the namespace they were created in, so we hop
+   into each namespace just long enough to create its sockets, then
+   come back home. */
+void
+netns_open_all(void)
+{
+    init_home();
+    open_sockets(&namespaces[0]);
+
+    if (nr_namespaces == 1)
+        return;
+
+    int home = open_ns_file("/proc/self/ns/net");
+
+    for (int i = 1; i < nr_namespaces; i++) {
+        struct netns *ns = &namespaces[i];
+
+        ns->nsfd = open_ns_file(ns->name);
+
+        if (setns(ns->nsfd, CLONE_NEWNET) == -1) {
+            do_log(LOG_ERR, "%s: can't enter network namespace: %m",
+                   ns->name);
+            exit(1);
+        }
+
+        open_sockets(ns);
+
+        if (setns(home, CLONE_NEWNET) == -1) {
+            do_log(LOG_ERR, "can't return to own network namespace: %m");
+            exit(1);
+        }
+
+        do_log(LOG_DEBUG, "watching network namespace %s", ns->name);
+    }
+
+    close(home);
+}
+
+
+/* Called in a freshly forked child, before exec'ing a script. */
+void
+netns_enter(const struct netns *ns)
+{
+    if (ns == NULL || ns->nsfd == -1)
+        return;
+
+    if (setns(ns->nsfd, CLONE_NEWNET) == -1) {
+        do_log(LOG_ERR, "%s: can't enter network namespace: %m", ns->name);
+        _exit(1);
+    }
+
+    setenv("NETPLUG_NETNS", ns->name, 1);
+}
+
+
+struct netns *
+netns_get(int id)
+{
+    if (id < 0 || id >= nr_namespaces)
+        return NULL;
+
+    return &namespaces[id];
+}
+
+
+int
+netns_count(void)
+{
+    return nr_namespaces;
+}
+
+
+const char *
+netns_name(const struct netns *ns)
+{
+    return ns && ns->name ? ns->name : "";
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
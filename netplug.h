@@ -22,6 +22,7 @@
 
 
 #include <asm/types.h>
+#include <stdio.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
@@ -38,27 +39,116 @@ void close_on_exec(int fd);
 extern const char *script_file;
 
 extern int debug;
+extern int log_threshold;
 
 /* netlink interfacing */
 
 typedef int (*netlink_callback)(struct nlmsghdr *hdr, void *arg);
 
 int netlink_open(void);
-void netlink_request_dump(int fd);
-void netlink_receive_dump(int fd, netlink_callback callback, void *arg);
+void netlink_dump(int fd, int type, netlink_callback callback, void *arg);
 int  netlink_listen(int fd, netlink_callback callback, void *arg);
 
+extern void (*netlink_tap)(struct nlmsghdr *hdr, void *arg, int dump);
+extern __thread unsigned long long netlink_rx_ns;
+extern int netlink_fake_fd;
+extern int netlink_addresses;
+extern const char *netlink_kind;
+
+/* recording and replaying netlink traffic */
+
+struct record_hdr {
+    unsigned long long ts;      /* CLOCK_MONOTONIC, in nanoseconds */
+    unsigned int len;           /* length of the message that follows */
+    unsigned short netns;       /* namespace id, in -n order */
+    unsigned char dump;         /* part of an interface dump */
+    unsigned char pad;
+};
+
+void record_open(const char *path);
+void record_flush(void);
+FILE *record_open_replay(const char *path);
+int record_read(FILE *fp, struct record_hdr *rh, void *buf, size_t size);
+
+
+/* network namespaces */
+
+struct netns {
+    int id;                     /* 0 is the daemon's own namespace */
+    const char *name;           /* NULL for the daemon's own namespace */
+    int nsfd;                   /* namespace file, for setns() */
+    int nlfd;                   /* netlink socket in this namespace */
+    int sockfd;                 /* socket for interface ioctls */
+};
+
+int netns_add(const char *name);
+void netns_open_all(void);
+void netns_enter(const struct netns *ns);
+struct netns *netns_get(int id);
+int netns_count(void);
+const char *netns_name(const struct netns *ns);
 
 /* network interface info management */
 
+#define HISTORY_LEN     16      /* events remembered per interface */
+
+struct history_entry {
+    unsigned long long ns;      /* CLOCK_MONOTONIC */
+    unsigned old_flags;
+    unsigned new_flags;
+    unsigned char from;         /* enum ifstate */
+    unsigned char to;
+    pid_t worker;               /* script running afterwards, or -1 */
+    int status;                 /* exit status that caused it, or -1 */
+};
+
+/* timers, on a wheel for each thread; see timer.c */
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;       /* NULL unless pending */
+    unsigned long long when;    /* by ifsm_hooks.clock */
+    void (*func)(struct timer *t);
+    unsigned char level;
+    unsigned char slot;
+};
+
+void timer_add(struct timer *t, unsigned long long when);
+void timer_cancel(struct timer *t);
+int timer_timeout(unsigned long long now);
+void timer_run(unsigned long long now);
+void timer_clear(void);
+
+static inline int
+timer_pending(const struct timer *t)
+{
+    return t->pprev != NULL;
+}
+
+#define MAX_ADDRS       8       /* addresses tracked per interface */
+#define MAX_DETACHED    4       /* scripts done early, still running */
+
+struct if_addr {
+    unsigned char family;       /* AF_INET or AF_INET6 */
+    unsigned char prefixlen;
+    unsigned char scope;        /* RT_SCOPE_* */
+    unsigned flags;             /* IFA_F_* */
+    unsigned char ip[16];
+};
+
 struct if_info {
     struct if_info *next;
+    int netns;                  /* interfaces are keyed by (netns, index) */
     int index;
     int type;
     unsigned flags;
     int addr_len;
     unsigned char addr[8];
     char name[16];
+    int operstate;              /* IF_OPER_* */
+    int master;                 /* ifindex of bond/bridge master, or 0 */
+    unsigned mtu;
+    char kind[16];              /* IFLA_INFO_KIND, such as "veth", or "" */
 
     enum ifstate {
         ST_DOWN,                /* uninitialized */
@@ -72,30 +162,321 @@ struct if_info {
         ST_OUTING,              /* plugout script is running */
         ST_INSANE,              /* interface seems to be flapping */
     }           state;
+    enum ifstate prev_state;    /* before what the worker was started for */
 
     pid_t       worker;         /* pid of current in/out script */
+    pid_t       detached[MAX_DETACHED]; /* workers that said they were
+                                           done early, or -1 */
+    int         action;         /* ACT_* the worker is running */
     time_t      lastchange;     /* timestamp of last state change */
+    unsigned long long spawn_ns; /* monotonic time the worker started */
+    unsigned long long event_ns; /* receive time of event being handled */
+    unsigned long long event_id; /* last event to change UP or RUNNING */
+    unsigned long long event_rx; /* and when it was received */
+    unsigned long long worker_event; /* event_id the worker was started for */
+    unsigned    flaps;          /* times carrier has come or gone */
+    unsigned    spawned;        /* scripts started under its current name */
+    int         wd_stage;       /* what the watchdog waits for, or -1 */
+    int         wd_signal;      /* last signal the watchdog sent it, or 0 */
+    struct timer wd_timer;
+    pid_t       stopping;       /* worker told to stop, not yet gone */
+    struct timer stop_timer;    /* when it gets SIGKILL */
+    char        *deferred;      /* action to start once it is gone, or NULL */
+    unsigned    retries;        /* times the failed script was retried */
+    int         retry_action;   /* ACT_* to retry */
+    struct timer retry_timer;
+    int         state_slot;     /* in the shared state table, or -1 */
+    int         wait_online;    /* holding up readiness; see online.c */
+    int         ready;          /* addresses were ready while ACTIVE */
+    int         naddrs;
+    struct if_addr addrs[MAX_ADDRS];
+    unsigned    history_next;   /* events ever recorded in history */
+    struct history_entry history[HISTORY_LEN];
 };
 
-struct if_info *if_info_get_interface(struct nlmsghdr *hdr,
-                                      struct rtattr *attrs[]);
-struct if_info *if_info_update_interface(struct nlmsghdr *hdr,
-                                         struct rtattr *attrs[]);
+/* A link or address message, decoded so it no longer refers to the
+   receive buffer */
+struct link_event {
+    int netns;
+    int msgtype;                /* RTM_{NEW,DEL}LINK or RTM_{NEW,DEL}ADDR */
+    int index;
+    int type;
+    unsigned flags;
+    int addr_len;
+    unsigned char addr[8];
+    char name[16];
+    int operstate;              /* IF_OPER_* */
+    int master;                 /* ifindex of bond/bridge master, or 0 */
+    unsigned mtu;
+    char kind[16];
+    struct if_addr ifa;         /* for address messages */
+    unsigned long long rx_ns;   /* monotonic time it was received */
+    unsigned long long id;      /* unique, and increasing, from 1 */
+    int wait_online;            /* from the initial dump; see udev.c */
+};
+
+int link_event_decode(struct link_event *ev, struct netns *ns,
+                      struct nlmsghdr *hdr);
+struct if_info *if_info_get_interface(const struct link_event *ev);
+void if_info_update_interface(struct if_info *i, const struct link_event *ev);
+void if_info_handle_event(struct link_event *ev);
+
+/* single-producer, single-consumer queues between threads */
+
+struct ring {
+    char *slots;
+    size_t elem;
+    unsigned size;              /* number of slots, a power of 2 */
+    unsigned head __attribute__ ((aligned (64))); /* written by producer */
+    unsigned tail __attribute__ ((aligned (64))); /* written by consumer */
+    unsigned high_water;
+    int waiting;                /* producer is stalled on a full ring */
+    int wake_fd;                /* producer -> consumer: entries queued */
+    int space_fd;               /* consumer -> producer: room again */
+};
+
+void ring_init(struct ring *r, unsigned nelem, size_t elem);
+void *ring_slot(struct ring *r);
+void *ring_try_slot(struct ring *r);
+unsigned ring_commit(struct ring *r);
+void ring_consume(struct ring *r, void (*func)(void *));
+void ring_wake(struct ring *r);
+unsigned ring_high_water(struct ring *r);
+
+/* netlink reader thread */
+
+int reader_start(void);
+int reader_drain(void (*func)(struct link_event *));
+
+/* state machine shards */
+
+struct child_exit
+{
+    pid_t       pid;
+    int         status;
+    int         early;          /* said it was done; still running */
+    int         owner;          /* shard that started it, plus one, or 0 */
+};
+
+extern __thread int shard_self;
+
+void shard_start(int n, void (*link)(struct link_event *),
+                 void (*child)(struct child_exit *), int (*idle)(void));
+int shard_count(void);
+void shard_dispatch_link(struct link_event *ev);
+void shard_dispatch_child(struct child_exit *ce);
+void shard_fork_begin(void);
+void shard_fork_end(pid_t pid);
+int shard_reap(struct child_exit *ce);
 int if_info_save_interface(struct nlmsghdr *hdr, void *arg);
-void parse_rtattrs(struct rtattr *tb[], int max, struct rtattr *rta, int len);
+int if_info_bucket(int netns, int index);
 void for_each_iface(int (*func)(struct if_info *));
+void for_each_iface_all(int (*func)(struct if_info *));
 
 void ifsm_flagpoll(struct if_info *info);
 void ifsm_flagchange(struct if_info *info, unsigned int newflags);
-void ifsm_scriptdone(pid_t pid, int exitstatus);
+int ifsm_scriptdone(pid_t pid, int exitstatus);
+int ifsm_scriptnotify(pid_t pid, int exitstatus);
+const char *ifsm_check(const struct if_info *info);
+void ifsm_set_timeout(int action, unsigned seconds);
+void ifsm_set_slow(unsigned seconds);
+void ifsm_set_retry(int action, unsigned attempts);
+void ifsm_set_backoff(unsigned initial_ms, unsigned max_ms);
+int ifsm_timeout(void);
+void ifsm_expire(void);
+const char *statename(enum ifstate s);
+void if_info_clear(void);
 
-/* utilities */
+struct ifsm_hooks {
+    pid_t (*spawn)(struct if_info *info, char *action);
+    void (*kill)(pid_t pid);
+    void (*signal)(pid_t pid, int sig);
+    void (*transition)(struct if_info *info, enum ifstate from);
+    unsigned long long (*clock)(void); /* nanoseconds, never going back */
+};
+
+extern struct ifsm_hooks ifsm_hooks;
+
+/* metrics */
+
+#define HIST_BUCKETS    28
+#define NR_STATES       (ST_INSANE + 1)
+
+enum { ACT_PROBE, ACT_IN, ACT_OUT, ACT_READY, NR_ACTIONS };
+
+struct histogram {
+    const char *name;
+    const char *help;
+    const char *action;         /* label, for per-action histograms */
+    unsigned long long count;
+    unsigned long long sum;     /* nanoseconds */
+    unsigned long long bucket[HIST_BUCKETS];
+};
+
+struct metrics {
+    unsigned long long messages;
+    unsigned long long events;
+    unsigned long long ignored;
+    unsigned long long poll_missed;
+    unsigned long long started[NR_ACTIONS];
+    unsigned long long exited_ok[NR_ACTIONS];
+    unsigned long long exited_failed[NR_ACTIONS];
+    unsigned long long slow;
+    unsigned long long timed_out[NR_ACTIONS];
+    unsigned long long killed;
+    unsigned long long early[NR_ACTIONS];
+    unsigned long long retries[NR_ACTIONS];
+    unsigned long long dad_failed;
+    unsigned long long dump_retries;
+    unsigned long long udev_held;
+    unsigned long long renamed_scripts;
+    unsigned long long recovered;
+    unsigned long long transitions[NR_STATES][NR_STATES];
+    unsigned queue_high_water;
+
+    struct histogram decode;
+    struct histogram event;
+    struct histogram event_to_spawn;
+    struct histogram spawn;
+    struct histogram script[NR_ACTIONS];
+};
+
+extern struct metrics metrics;
+
+#define metrics_inc(field) \
+    __atomic_fetch_add(&metrics.field, 1, __ATOMIC_RELAXED)
+#define metrics_add(field, n) \
+    __atomic_fetch_add(&metrics.field, (n), __ATOMIC_RELAXED)
+
+void hist_observe(struct histogram *h, unsigned long long ns);
+int action_index(const char *action);
+const char *action_name(int action);
+void metrics_write(FILE *fp);
+void metrics_to_file(const char *path, int interval);
+void metrics_to_socket(const char *path);
+int metrics_fd(void);
+void metrics_accept(void);
+int metrics_timeout(void);
+void metrics_tick(void);
+
+/* state change notifications */
+
+void notify_open(const char *path);
+void notify_start(int nshards);
+void notify_transition(struct if_info *info, enum ifstate from);
+void notify_ready(struct if_info *info);
+
+/* cgroups for scripts */
+
+void cgroup_use(const char *dir);
+void cgroup_limit(const char *file, const char *value);
+void cgroup_open(void);
+void cgroup_enter(const char *action);
+int cgroup_kill(pid_t pid);
+void cgroup_reap(pid_t pid);
+int cgroup_timeout(void);
+void cgroup_tick(void);
+void cgroup_usage(int action, long long *cpu_usec, long long *memory_peak);
+
+/* scripts saying they are done before they exit */
+
+void early_open(void);
+int early_fd(void);
+int early_script_fd(void);
+void early_inherit(void);
+void early_receive(void (*func)(struct child_exit *));
+
+/* directories of hooks run in place of the script */
 
-void do_log(int pri, const char *fmt, ...)
+void hooks_use(const char *dir);
+int hooks_path(const char *action, char *path, size_t size);
+void hooks_run(const char *dir, char *ifname, char *action)
+    __attribute__ ((noreturn));
+
+/* holding new interfaces back until udev is done with them */
+
+void udev_open(void);
+int udev_fd(void);
+int udev_hold(struct link_event *ev);
+void udev_receive(void);
+void udev_release(void (*func)(struct link_event *));
+int udev_timeout(void);
+
+/* readiness once the interfaces present at startup have settled */
+
+void online_set_file(const char *path);
+void online_set_timeout(int seconds);
+void online_pending(struct if_info *info);
+void online_hold(void);
+void online_unhold(void);
+void online_check(struct if_info *info);
+void online_start(void);
+int online_timeout(void);
+void online_tick(void);
+int wait_online(const char *path, int seconds);
+
+/* shared-memory state table; see npstate.h */
+
+void state_open(const char *path);
+void state_set_pid(void);
+void state_publish(struct if_info *info);
+
+/* per-interface event history */
+
+void history_set_file(const char *path);
+void history_add(struct if_info *info, enum ifstate from, unsigned oldflags,
+                 int status);
+void history_dump(int fd);
+int history_write(void);
+
+/* USDT probes, for perf, bpftrace and SystemTap; provider netplugd */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define NP_TRACE(name, ...) STAP_PROBEV(netplugd, name, __VA_ARGS__)
+#else
+#define NP_TRACE(name, ...) do { } while (0)
+#endif
+
+/* logging */
+
+#ifdef NP_NO_DEBUG_LOG
+#define LOG_DEBUG_ENABLED 0
+#else
+#define LOG_DEBUG_ENABLED 1
+#endif
+
+/* With NP_NO_DEBUG_LOG, LOG_DEBUG messages and their arguments are
+   compiled out altogether. */
+#define do_log(pri, ...) do {                                   \
+        if (LOG_DEBUG_ENABLED || (pri) != LOG_DEBUG)            \
+            log_message((pri), __VA_ARGS__);                    \
+    } while (0)
+
+static inline int
+log_enabled(int pri)
+{
+    if (pri == LOG_DEBUG && (!LOG_DEBUG_ENABLED || !debug))
+        return 0;
+
+    return pri <= log_threshold;
+}
+
+void log_message(int pri, const char *fmt, ...)
     __attribute__ ((format (printf, 2, 3)));
-pid_t run_netplug_bg(char *ifname, char *action);
-int run_netplug(char *ifname, char *action);
+void log_start(void);
+void log_flush(void);
+void log_forked(void);
+
+/* utilities */
+
+pid_t run_netplug_bg(struct netns *ns, char *ifname, char *action,
+                     char **env);
+int run_netplug(struct netns *ns, char *ifname, char *action);
 void kill_script(pid_t pid);
+void signal_script(pid_t pid, int sig);
+void thread_start(void *(*func)(void *), void *arg);
+unsigned long long monotonic_ns(void);
 void *xmalloc(size_t n);
 
 
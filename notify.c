@@ -0,0 +1,376 @@
+/*
+ * notify.c - tell subscribers about interface state changes
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Subscribers connect to a Unix seqpacket socket and send one packet
+ * per interface pattern they care about.  From then on, each state
+ * transition of a matching interface arrives as one packet holding a
+ * line of text:
+ *
+ *     TIMESTAMP NETNS IFINDEX IFNAME FROM TO
+ *
+ * The timestamp is CLOCK_MONOTONIC in nanoseconds, and NETNS is "-"
+ * for the daemon's own namespace.  With --addresses, an ACTIVE
+ * interface whose addresses have become ready is announced the same
+ * way, as going from ACTIVE to READY, although it stays ACTIVE.
+ *
+ * All the socket work happens on a thread of its own.  Whoever runs
+ * the state machine (the main thread, or each shard) formats a
+ * transition once and hands it over through a ring of its own.  The
+ * notifier appends it to a backlog shared by every subscriber, each of
+ * which just keeps its own position in it; that position can fall at
+ * most BACKLOG records behind, after which the subscriber is told how
+ * many it lost and skips ahead.  Sockets are never blocked on, so a
+ * subscriber that stops reading costs nothing but its place in line.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "netplug.h"
+
+#define RING_SIZE       1024    /* per producer; must be a power of 2 */
+#define BACKLOG         1024    /* must be a power of 2 */
+#define MAX_CLIENTS     1024
+#define MAX_PATTERNS    32      /* per client */
+
+struct notify_rec {
+    char name[16];
+    unsigned short len;
+    char text[238];
+};
+
+struct client {
+    int fd;
+    unsigned long seq;          /* next backlog record to look at */
+    unsigned long lost;         /* records skipped, not yet reported */
+    int blocked;                /* last send would have blocked */
+    int npats;
+    char *pats[MAX_PATTERNS];
+};
+
+static int listen_fd = -1;
+static const char *socket_path;
+
+static struct ring *rings;      /* the main thread's, then each shard's */
+static int nr_rings;
+
+static struct notify_rec backlog[BACKLOG];
+static unsigned long head;      /* records ever appended */
+
+static struct client *clients;
+static int nr_clients;
+
+
+static void
+tidy_socket(void)
+{
+    unlink(socket_path);
+}
+
+
+/* Listen for subscribers at path.  Nothing is sent until
+   notify_start(). */
+void
+notify_open(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        do_log(LOG_ERR, "%s: socket path too long", path);
+        exit(1);
+    }
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+                            SOCK_CLOEXEC, 0)) == -1) {
+        do_log(LOG_ERR, "can't create notification socket: %m");
+        exit(1);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        listen(listen_fd, 64) == -1) {
+        do_log(LOG_ERR, "%s: %m", path);
+        exit(1);
+    }
+
+    socket_path = path;
+    atexit(tidy_socket);
+}
+
+
+static void
+send_line(struct if_info *info, const char *from, const char *to)
+{
+    if (rings == NULL)
+        return;
+
+    struct ring *r = &rings[shard_self + 1];
+    struct notify_rec *rec = ring_slot(r);
+    const char *ns = netns_name(netns_get(info->netns));
+    int n;
+
+    strcpy(rec->name, info->name);
+    n = snprintf(rec->text, sizeof(rec->text), "%llu %s %d %s %s %s\n",
+                 monotonic_ns(), *ns ? ns : "-", info->index, info->name,
+                 from, to);
+    rec->len = n < sizeof(rec->text) ? n : sizeof(rec->text) - 1;
+
+    ring_commit(r);
+}
+
+
+/* Called by whichever thread changed info's state. */
+void
+notify_transition(struct if_info *info, enum ifstate from)
+{
+    send_line(info, statename(from), statename(info->state));
+}
+
+
+/* info is ACTIVE, and its addresses are now ready. */
+void
+notify_ready(struct if_info *info)
+{
+    send_line(info, statename(info->state), "READY");
+}
+
+
+static void
+append(void *arg)
+{
+    backlog[head++ & (BACKLOG - 1)] = *(struct notify_rec *) arg;
+}
+
+
+static void
+drop_client(struct client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+
+    for (int i = 0; i < c->npats; i++) {
+        free(c->pats[i]);
+    }
+}
+
+
+static void
+accept_clients(void)
+{
+    int fd;
+
+    while ((fd = accept4(listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        if (nr_clients == MAX_CLIENTS) {
+            do_log(LOG_WARNING, "too many subscribers; refusing another");
+            close(fd);
+            continue;
+        }
+
+        struct client *c = &clients[nr_clients++];
+
+        memset(c, 0, sizeof(*c));
+        c->fd = fd;
+        c->seq = head;
+    }
+}
+
+
+/* Each packet a client sends us is another pattern to match. */
+static void
+read_patterns(struct client *c)
+{
+    char buf[64];
+    ssize_t n;
+
+    while ((n = recv(c->fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\0'))
+            n--;
+        buf[n] = '\0';
+
+        if (n == 0 || c->npats == MAX_PATTERNS)
+            continue;
+
+        char *pat = strdup(buf);
+
+        if (pat == NULL) {
+            do_log(LOG_ERR, "strdup: %m");
+            exit(1);
+        }
+        c->pats[c->npats++] = pat;
+    }
+
+    if (n == 0 || errno != EAGAIN)
+        drop_client(c);
+}
+
+
+static int
+wants(struct client *c, const char *name)
+{
+    for (int i = 0; i < c->npats; i++) {
+        if (fnmatch(c->pats[i], name, 0) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/* Send c as much of the backlog as it will take without blocking.
+   Returns 0 if it went away. */
+static int
+flush_client(struct client *c)
+{
+    if (c->npats == 0) {
+        c->seq = head;
+        return 1;
+    }
+
+    if (head - c->seq > BACKLOG) {
+        c->lost += head - BACKLOG - c->seq;
+        c->seq = head - BACKLOG;
+    }
+
+    if (c->lost) {
+        char buf[32];
+        int n = snprintf(buf, sizeof(buf), "lost %lu\n", c->lost);
+
+        if (send(c->fd, buf, n, MSG_NOSIGNAL) == -1)
+            goto failed;
+        c->lost = 0;
+    }
+
+    for (; c->seq != head; c->seq++) {
+        struct notify_rec *rec = &backlog[c->seq & (BACKLOG - 1)];
+
+        if (wants(c, rec->name) &&
+            send(c->fd, rec->text, rec->len, MSG_NOSIGNAL) == -1)
+            goto failed;
+    }
+
+    c->blocked = 0;
+    return 1;
+
+ failed:
+    if (errno == EAGAIN) {
+        c->blocked = 1;
+        return 1;
+    }
+
+    drop_client(c);
+    return 0;
+}
+
+
+static void *
+notify_main(void *arg)
+{
+    struct pollfd *fds = xmalloc((nr_rings + 1 + MAX_CLIENTS) *
+                                 sizeof(*fds));
+
+    for (int i = 0; i < nr_rings; i++) {
+        fds[i].fd = rings[i].wake_fd;
+        fds[i].events = POLLIN;
+    }
+    fds[nr_rings].fd = listen_fd;
+    fds[nr_rings].events = POLLIN;
+
+    for (;;) {
+        struct pollfd *cfds = fds + nr_rings + 1;
+
+        for (int i = 0; i < nr_clients; i++) {
+            cfds[i].fd = clients[i].fd;
+            cfds[i].events = clients[i].blocked ? POLLIN | POLLOUT : POLLIN;
+        }
+
+        if (poll(fds, nr_rings + 1 + nr_clients, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            do_log(LOG_ERR, "notifier poll failed: %m");
+            exit(1);
+        }
+
+        for (int i = 0; i < nr_rings; i++) {
+            if (fds[i].revents & POLLIN)
+                ring_consume(&rings[i], append);
+        }
+
+        for (int i = 0; i < nr_clients; i++) {
+            if (cfds[i].revents & POLLIN)
+                read_patterns(&clients[i]);
+            else if (cfds[i].revents & (POLLHUP | POLLERR))
+                drop_client(&clients[i]);
+        }
+
+        /* Clients accepted below start at the current head, so they
+           have nothing to flush yet. */
+        int n = 0;
+
+        for (int i = 0; i < nr_clients; i++) {
+            if (clients[i].fd != -1 && flush_client(&clients[i]))
+                clients[n++] = clients[i];
+        }
+        nr_clients = n;
+
+        if (fds[nr_rings].revents & POLLIN)
+            accept_clients();
+    }
+
+    return NULL;
+}
+
+
+/* Start sending notifications, if a socket was opened.  Transitions
+   come from the main thread and from nshards shards.  Each has a ring
+   of its own, as a ring has room for one producer only. */
+void
+notify_start(int nshards)
+{
+    if (listen_fd == -1)
+        return;
+
+    clients = xmalloc(MAX_CLIENTS * sizeof(*clients));
+    rings = xmalloc((nshards + 1) * sizeof(*rings));
+    nr_rings = nshards + 1;
+
+    for (int i = 0; i < nr_rings; i++) {
+        ring_init(&rings[i], RING_SIZE, sizeof(struct notify_rec));
+    }
+
+    thread_start(notify_main, NULL);
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
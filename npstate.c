@@ -0,0 +1,209 @@
+/*
+ * npstate.c - read netplugd's shared-memory interface state table
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * This is built into a small static library, libnpstate.a, and knows
+ * nothing of the rest of netplugd; see npstate.h for how the table
+ * works.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "npstate.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax()     __builtin_ia32_pause()
+#else
+#define cpu_relax()     do { } while (0)
+#endif
+
+struct npstate {
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    size_t size;
+    const struct npstate_header *hdr;
+    const struct npstate_slot *slots;
+};
+
+
+/* Map the table at path.  Returns NULL, with errno set, on failure. */
+struct npstate *
+npstate_open(const char *path)
+{
+    struct npstate *st;
+    struct stat sb;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return NULL;
+
+    if (fstat(fd, &sb) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    if (sb.st_size < sizeof(struct npstate_header)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const struct npstate_header *hdr = map;
+
+    if (memcmp(hdr->magic, NPSTATE_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->slot_size != sizeof(struct npstate_slot) ||
+        hdr->header_size < sizeof(*hdr) ||
+        hdr->header_size + (size_t) hdr->nslots * hdr->slot_size >
+        sb.st_size) {
+        munmap(map, sb.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if ((st = malloc(sizeof(*st))) == NULL ||
+        (st->path = strdup(path)) == NULL) {
+        free(st);
+        munmap(map, sb.st_size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    st->dev = sb.st_dev;
+    st->ino = sb.st_ino;
+    st->size = sb.st_size;
+    st->hdr = hdr;
+    st->slots = (const void *) ((const char *) map + hdr->header_size);
+
+    return st;
+}
+
+
+void
+npstate_close(struct npstate *st)
+{
+    munmap((void *) st->hdr, st->size);
+    free(st->path);
+    free(st);
+}
+
+
+/* Has a newer daemon replaced the file since we mapped it?  This one
+   does make a system call, so don't ask on every read. */
+int
+npstate_stale(struct npstate *st)
+{
+    struct stat sb;
+
+    if (stat(st->path, &sb) == -1)
+        return 1;
+
+    return sb.st_dev != st->dev || sb.st_ino != st->ino;
+}
+
+
+int
+npstate_count(struct npstate *st)
+{
+    uint32_t n = __atomic_load_n(&st->hdr->nused, __ATOMIC_ACQUIRE);
+
+    return n < st->hdr->nslots ? n : st->hdr->nslots;
+}
+
+
+/* Copy a consistent snapshot of one slot into out.  Returns 0, or -1
+   if there is no such slot or it has not been filled in yet. */
+int
+npstate_read(struct npstate *st, int slot, struct npstate_slot *out)
+{
+    if (slot < 0 || slot >= npstate_count(st))
+        return -1;
+
+    const struct npstate_slot *s = &st->slots[slot];
+    uint32_t seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1) {
+            cpu_relax();
+            continue;
+        }
+
+        memcpy(out, s, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == seq)
+            break;
+    }
+
+    out->seq = seq;
+
+    return out->ifindex ? 0 : -1;
+}
+
+
+/* Look an interface up by name.  Returns its slot number, or -1. */
+int
+npstate_find(struct npstate *st, int netns, const char *name,
+             struct npstate_slot *out)
+{
+    int n = npstate_count(st);
+
+    for (int i = 0; i < n; i++) {
+        const struct npstate_slot *s = &st->slots[i];
+
+        /* Cheap unlocked look first; most slots won't be it. */
+        if (strncmp(s->name, name, sizeof(s->name)) != 0)
+            continue;
+
+        if (npstate_read(st, i, out) == 0 && out->netns == netns &&
+            strncmp(out->name, name, sizeof(out->name)) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+
+const char *
+npstate_statename(struct npstate *st, int state)
+{
+    if (state < 0 || state >= NPSTATE_NAMES || !st->hdr->statenames[state][0])
+        return "???";
+
+    return st->hdr->statenames[state];
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
@@ -0,0 +1,82 @@
+/*
+ * npstate.h - read netplugd's shared-memory interface state table
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * When started with --state-file, netplugd keeps one slot per
+ * interface it knows of in a file that readers map into memory.  Each
+ * slot is protected by its own sequence lock: the daemon makes the
+ * sequence number odd while it rewrites the slot and even again when
+ * it is done, and a reader copies the slot out and tries again if the
+ * number was odd or changed underneath it.  Reading never makes a
+ * system call or waits for the daemon.
+ *
+ * Slots are handed out in the order the daemon first sees interfaces
+ * and are never reused.  A slot whose ifindex is still 0 has been
+ * handed out but not yet filled in.
+ */
+
+#ifndef __npstate_h
+#define __npstate_h
+
+#include <stdint.h>
+
+#define NPSTATE_MAGIC   "NPSTATE1"
+#define NPSTATE_NAMES   16      /* room for this many state names */
+
+struct npstate_header {
+    char magic[8];
+    uint32_t header_size;       /* slots start this far into the file */
+    uint32_t slot_size;
+    uint32_t nslots;            /* room for this many */
+    uint32_t nused;             /* handed out so far; only ever grows */
+    uint32_t pid;               /* of the daemon that made the file */
+    uint32_t pad;
+    char statenames[NPSTATE_NAMES][16]; /* indexed by npstate_slot.state */
+};
+
+struct npstate_slot {
+    uint32_t seq;               /* odd while the daemon is writing */
+    int32_t netns;              /* namespace, in netplugd -n order */
+    int32_t ifindex;
+    uint32_t flags;             /* IFF_* */
+    int64_t lastchange;         /* time(2) of the last UP/RUNNING change */
+    uint32_t flaps;             /* times carrier has come or gone */
+    int32_t state;              /* see npstate_statename() */
+    uint32_t operstate;         /* IF_OPER_* */
+    char name[16];
+    char pad[12];
+};
+
+struct npstate;
+
+struct npstate *npstate_open(const char *path);
+void npstate_close(struct npstate *st);
+int npstate_stale(struct npstate *st);
+int npstate_count(struct npstate *st);
+int npstate_read(struct npstate *st, int slot, struct npstate_slot *out);
+int npstate_find(struct npstate *st, int netns, const char *name,
+                 struct npstate_slot *out);
+const char *npstate_statename(struct npstate *st, int state);
+
+
+#endif /* __npstate_h */
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
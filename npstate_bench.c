@@ -0,0 +1,217 @@
+/*
+ * npstate_bench.c - list, or measure reads from, the shared state table
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Only uses the public interface in npstate.h, so it doubles as an
+ * example of how to read the table.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "npstate.h"
+
+struct worker {
+    pthread_t thread;
+    struct npstate *st;
+    const char *name;           /* look this up, or read every slot */
+    int netns;
+    unsigned long long reads;
+};
+
+static volatile int stop;
+
+
+static unsigned long long
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void *
+bench(void *arg)
+{
+    struct worker *w = arg;
+    struct npstate_slot slot;
+
+    while (!stop) {
+        if (w->name) {
+            npstate_find(w->st, w->netns, w->name, &slot);
+            w->reads++;
+        } else {
+            int n = npstate_count(w->st);
+
+            for (int i = 0; i < n; i++) {
+                npstate_read(w->st, i, &slot);
+            }
+            w->reads += n;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+list(struct npstate *st)
+{
+    struct npstate_slot slot;
+    int n = npstate_count(st);
+
+    printf("%-5s %-5s %-16s %-10s %-10s %6s %s\n", "NETNS", "INDEX",
+           "NAME", "STATE", "FLAGS", "FLAPS", "LASTCHANGE");
+
+    for (int i = 0; i < n; i++) {
+        if (npstate_read(st, i, &slot) == -1)
+            continue;
+
+        printf("%-5d %-5d %-16.16s %-10s 0x%08x %6u %lld\n", slot.netns,
+               slot.ifindex, slot.name, npstate_statename(st, slot.state),
+               slot.flags, slot.flaps, (long long) slot.lastchange);
+    }
+}
+
+
+static void
+usage(char *progname, int exitcode)
+{
+    fprintf(stderr, "Usage: %s [-l] [-i interface] [-n netns] "
+            "[-s seconds] [-t threads] state-file\n", progname);
+
+    fprintf(stderr, "\t-l\t\t"
+            "list the table instead of benchmarking\n");
+    fprintf(stderr, "\t-i interface\t"
+            "look this interface up, instead of reading every slot\n");
+    fprintf(stderr, "\t-n netns	"
+            "namespace number of the interface (default 0)\n");
+    fprintf(stderr, "\t-s seconds\t"
+            "how long to run for (default 5)\n");
+    fprintf(stderr, "\t-t threads\t"
+            "number of reader threads (default 1)\n");
+
+    exit(exitcode);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    const char *name = NULL;
+    int netns = 0;
+    int listing = 0;
+    int seconds = 5;
+    int nthreads = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "hli:n:s:t:")) != EOF) {
+        switch (c) {
+        case 'l':
+            listing = 1;
+            break;
+        case 'i':
+            name = optarg;
+            break;
+        case 'n':
+            netns = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0], 0);
+            break;
+        case '?':
+            usage(argv[0], 1);
+        }
+    }
+
+    if (optind != argc - 1 || seconds < 1 || nthreads < 1)
+        usage(argv[0], 1);
+
+    struct npstate *st = npstate_open(argv[optind]);
+
+    if (st == NULL) {
+        perror(argv[optind]);
+        exit(1);
+    }
+
+    if (listing) {
+        list(st);
+        return 0;
+    }
+
+    struct worker *w = calloc(nthreads, sizeof(*w));
+
+    if (w == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    unsigned long long start = now_ns();
+
+    for (int i = 0; i < nthreads; i++) {
+        w[i].st = st;
+        w[i].name = name;
+        w[i].netns = netns;
+        if (pthread_create(&w[i].thread, NULL, bench, &w[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    sleep(seconds);
+    stop = 1;
+
+    unsigned long long reads = 0;
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(w[i].thread, NULL);
+        reads += w[i].reads;
+    }
+
+    double secs = (now_ns() - start) / 1e9;
+
+    printf("slots:        %d\n", npstate_count(st));
+    printf("threads:      %d\n", nthreads);
+    printf("reads:        %llu\n", reads);
+    printf("throughput:   %.0f reads/s\n", reads / secs);
+    if (reads)
+        printf("latency:      %.1f ns/read per thread\n",
+               secs * 1e9 * nthreads / reads);
+
+    npstate_close(st);
+
+    return 0;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
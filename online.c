@@ -0,0 +1,334 @@
+/*
+ * online.c - say when the interfaces present at startup have settled
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Every interface in the initial dump that we manage holds up
+ * readiness until it has no script running, which is to say it is
+ * ACTIVE, INACTIVE with no carrier, DOWN, or INSANE; see ifsm_check().
+ * That is looked at each time the state machine is done with it, on
+ * whichever thread that is.  Once the last one has settled, or the
+ * timeout has passed, we say so, once: to systemd, if it started us
+ * with Type=notify, and in the online file, which
+ * "netplugd --wait-online" waits for.
+ *
+ * One udev.c holds back from the dump holds up readiness too, with
+ * online_hold(), until the state machine has taken it on.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <libgen.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "netplug.h"
+
+static const char *online_file;
+static char *online_tmp;
+static int online_secs = 60;
+
+static unsigned pending;        /* interfaces yet to settle */
+static unsigned total;
+static int started;
+static int announced;
+static unsigned long long start_ns;
+static unsigned long long deadline;
+
+
+void
+online_set_file(const char *path)
+{
+    online_file = path[0] ? path : NULL;
+}
+
+
+void
+online_set_timeout(int seconds)
+{
+    online_secs = seconds;
+}
+
+
+/* info, from the initial dump, is one to wait for. */
+void
+online_pending(struct if_info *info)
+{
+    if (info->wait_online)
+        return;
+
+    info->wait_online = 1;
+    __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&total, 1, __ATOMIC_RELAXED);
+}
+
+
+/* Tell systemd, if it is listening.  No libsystemd: this is all
+   sd_notify() does. */
+static void
+sd_notify(const char *state)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    struct sockaddr_un addr;
+    int fd;
+
+    if (path == NULL || (path[0] != '/' && path[0] != '@') ||
+        strlen(path) >= sizeof(addr.sun_path))
+        return;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (addr.sun_path[0] == '@')
+        addr.sun_path[0] = '\0';    /* abstract namespace */
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+        do_log(LOG_ERR, "can't create notify socket: %m");
+        return;
+    }
+
+    if (sendto(fd, state, strlen(state), MSG_NOSIGNAL,
+               (struct sockaddr *) &addr,
+               offsetof(struct sockaddr_un, sun_path) + strlen(path)) == -1)
+        do_log(LOG_ERR, "%s: %m", path);
+
+    close(fd);
+}
+
+
+static void
+announce(int timed_out)
+{
+    if (__atomic_exchange_n(&announced, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    unsigned left = __atomic_load_n(&pending, __ATOMIC_RELAXED);
+    unsigned long long ms = (monotonic_ns() - start_ns) / 1000000;
+    char status[128], notify[192];
+
+    if (timed_out)
+        snprintf(status, sizeof(status), "%u of %u interfaces not settled "
+                 "after %llums", left, total, ms);
+    else
+        snprintf(status, sizeof(status), "%u interfaces settled in %llums",
+                 total, ms);
+
+    do_log(timed_out ? LOG_WARNING : LOG_NOTICE, "online: %s", status);
+
+    snprintf(notify, sizeof(notify), "READY=1\nMAINPID=%d\nSTATUS=%s",
+             getpid(), status);
+    sd_notify(notify);
+
+    if (online_file == NULL)
+        return;
+
+    FILE *fp = fopen(online_tmp, "w");
+
+    if (fp == NULL) {
+        do_log(LOG_ERR, "%s: %m", online_tmp);
+        return;
+    }
+
+    fprintf(fp, "%s %s\n", timed_out ? "timeout" : "ready", status);
+
+    if (fclose(fp) == EOF || rename(online_tmp, online_file) == -1)
+        do_log(LOG_ERR, "%s: %m", online_file);
+}
+
+
+/* The state machine is done with info for now. */
+void
+online_check(struct if_info *info)
+{
+    if (!info->wait_online || info->worker != -1 || info->deferred)
+        return;
+
+    info->wait_online = 0;
+
+    if (__atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL) == 0 &&
+        __atomic_load_n(&started, __ATOMIC_ACQUIRE))
+        announce(0);
+}
+
+
+/* Something from the initial dump is not yet in the state machine's
+   hands. */
+void
+online_hold(void)
+{
+    __atomic_add_fetch(&pending, 1, __ATOMIC_RELAXED);
+}
+
+
+/* Now it is, and online_pending() has been called for it if it is one
+   to wait for. */
+void
+online_unhold(void)
+{
+    if (__atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL) == 0 &&
+        __atomic_load_n(&started, __ATOMIC_ACQUIRE))
+        announce(0);
+}
+
+
+static void
+tidy_online(void)
+{
+    unlink(online_file);
+}
+
+
+/* Start the clock, once the initial dump is in.  Until then there is
+   nobody to tell. */
+void
+online_start(void)
+{
+    if (online_file) {
+        if (asprintf(&online_tmp, "%s.tmp", online_file) == -1) {
+            do_log(LOG_ERR, "asprintf: %m");
+            exit(1);
+        }
+
+        /* What is there is from an earlier run. */
+        unlink(online_file);
+        atexit(tidy_online);
+    }
+
+    start_ns = monotonic_ns();
+    deadline = online_secs ? start_ns + online_secs * 1000000000ULL : 0;
+
+    __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == 0)
+        announce(0);
+}
+
+
+/* How long the main loop may sleep before we give up waiting, in
+   milliseconds, or -1 if that never happens. */
+int
+online_timeout(void)
+{
+    if (deadline == 0 || __atomic_load_n(&announced, __ATOMIC_RELAXED))
+        return -1;
+
+    unsigned long long now = monotonic_ns();
+
+    if (deadline <= now)
+        return 0;
+
+    return (deadline - now + 999999) / 1000000;
+}
+
+
+void
+online_tick(void)
+{
+    if (deadline && monotonic_ns() >= deadline)
+        announce(1);
+}
+
+
+/* What the online file says: 1 for ready, 0 for timed out, -1 if it
+   isn't there yet. */
+static int
+read_online(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char word[16];
+    int ret = -1;
+
+    if (fp == NULL)
+        return -1;
+
+    if (fscanf(fp, "%15s", word) == 1)
+        ret = strcmp(word, "ready") == 0;
+
+    fclose(fp);
+
+    return ret;
+}
+
+
+/* "netplugd --wait-online": wait for a running netplugd to say its
+   interfaces have settled, for at most seconds, or for ever if 0.
+   Returns the exit status: 0 if they have. */
+int
+wait_online(const char *path, int seconds)
+{
+    char *dir = strdup(path);
+    int fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    unsigned long long until = seconds ?
+        monotonic_ns() + seconds * 1000000000ULL : 0;
+
+    /* It is renamed into place, so that is all we need to watch for.
+       Without inotify, look every tenth of a second. */
+    if (fd != -1 && inotify_add_watch(fd, dirname(dir), IN_MOVED_TO) == -1) {
+        close(fd);
+        fd = -1;
+    }
+    free(dir);
+
+    for (;;) {
+        int ret = read_online(path);
+
+        if (ret == 1)
+            return 0;
+        if (ret == 0) {
+            fprintf(stderr, "netplugd gave up waiting for interfaces "
+                    "to settle\n");
+            return 1;
+        }
+
+        int timeout = fd == -1 ? 100 : -1;
+
+        if (until) {
+            unsigned long long now = monotonic_ns();
+
+            if (now >= until) {
+                fprintf(stderr, "timed out waiting for netplugd\n");
+                return 1;
+            }
+            if (timeout == -1 || (until - now) / 1000000 < timeout)
+                timeout = (until - now + 999999) / 1000000;
+        }
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        char buf[4096];
+
+        if (poll(&pfd, fd == -1 ? 0 : 1, timeout) == -1 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+
+        while (fd != -1 && read(fd, buf, sizeof(buf)) > 0) {
+        }
+    }
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
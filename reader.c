@@ -0,0 +1,124 @@
+/*
+ * reader.c - optional thread that drains netlink into an event ring
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * The reader thread does nothing but receive and decode netlink
+ * messages, so the kernel's socket buffer is emptied even while the
+ * main thread is busy forking scripts or killing them.  Decoded
+ * events are handed over through a ring (see ring.c).
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "netplug.h"
+
+#define RING_SIZE       16384   /* must be a power of 2 */
+
+static struct ring ring;
+static int reader_done;         /* netlink went away under the reader */
+
+
+static int
+enqueue(struct nlmsghdr *hdr, void *arg)
+{
+    struct link_event *ev = ring_slot(&ring);
+    int ret = link_event_decode(ev, arg, hdr);
+
+    if (ret <= 0)
+        return ret;
+
+    unsigned depth = ring_commit(&ring);
+
+    if (depth > metrics.queue_high_water) {
+        __atomic_store_n(&metrics.queue_high_water, depth, __ATOMIC_RELAXED);
+        if (depth >= 64 && (depth & (depth - 1)) == 0)
+            do_log(LOG_INFO, "event queue reached %u entries", depth);
+    }
+
+    return 0;
+}
+
+
+static void *
+reader_main(void *arg)
+{
+    int nfds = netns_count();
+    struct pollfd *fds = xmalloc(nfds * sizeof(*fds));
+
+    for (int n = 0; n < nfds; n++) {
+        fds[n].fd = netns_get(n)->nlfd;
+        fds[n].events = POLLIN;
+    }
+
+    for (;;) {
+        if (poll(fds, nfds, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            do_log(LOG_ERR, "reader poll failed: %m");
+            break;
+        }
+
+        for (int n = 0; n < nfds; n++) {
+            if ((fds[n].revents & POLLIN) &&
+                netlink_listen(fds[n].fd, enqueue, netns_get(n)) == 0)
+                goto out;
+        }
+    }
+
+ out:
+    /* Nothing more is coming; wake the main thread so that it notices
+       on its next drain. */
+    __atomic_store_n(&reader_done, 1, __ATOMIC_RELEASE);
+    ring_wake(&ring);
+    return NULL;
+}
+
+
+/* Start the reader thread.  Returns the fd the main thread should
+   poll for readability; it then calls reader_drain(). */
+int
+reader_start(void)
+{
+    ring_init(&ring, RING_SIZE, sizeof(struct link_event));
+    thread_start(reader_main, NULL);
+
+    return ring.wake_fd;
+}
+
+
+/* Hand every queued event to func.  Returns 0 once the reader has
+   exited and the ring is empty, otherwise 1. */
+int
+reader_drain(void (*func)(struct link_event *))
+{
+    /* Look before draining, so nothing queued ahead of the reader's
+       exit can be left behind. */
+    int done = __atomic_load_n(&reader_done, __ATOMIC_ACQUIRE);
+
+    ring_consume(&ring, (void (*)(void *)) func);
+
+    return !done;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
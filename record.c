@@ -0,0 +1,130 @@
+/*
+ * record.c - record netlink traffic for later replay
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * A recording is an 8-byte magic string followed by one entry per
+ * netlink message: a struct record_hdr, then the message itself,
+ * exactly as the kernel sent it.  Everything is in host byte order,
+ * as netlink is; recordings are meant to be replayed on the same kind
+ * of machine they were made on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "netplug.h"
+
+#define RECORD_MAGIC    "NPREC001"
+
+static FILE *record_fp;
+
+
+static void
+record_message(struct nlmsghdr *hdr, void *arg, int dump)
+{
+    struct netns *ns = arg;
+    struct record_hdr rh = {
+        .ts = monotonic_ns(),
+        .len = hdr->nlmsg_len,
+        .netns = ns ? ns->id : 0,
+        .dump = dump,
+    };
+
+    if (fwrite(&rh, sizeof(rh), 1, record_fp) != 1 ||
+        fwrite(hdr, hdr->nlmsg_len, 1, record_fp) != 1) {
+        do_log(LOG_ERR, "can't write recording: %m; recording stopped");
+        netlink_tap = NULL;
+    }
+}
+
+
+/* Start appending every netlink message we handle to path. */
+void
+record_open(const char *path)
+{
+    if ((record_fp = fopen(path, "a")) == NULL) {
+        do_log(LOG_ERR, "%s: %m", path);
+        exit(1);
+    }
+
+    close_on_exec(fileno(record_fp));
+    setvbuf(record_fp, NULL, _IOFBF, 65536);
+
+    if (ftell(record_fp) == 0)
+        fwrite(RECORD_MAGIC, 8, 1, record_fp);
+
+    netlink_tap = record_message;
+    atexit(record_flush);
+}
+
+
+/* Called from the main loop, so a recording is never more than one
+   batch of events behind. */
+void
+record_flush(void)
+{
+    if (record_fp)
+        fflush(record_fp);
+}
+
+
+FILE *
+record_open_replay(const char *path)
+{
+    char magic[8];
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        do_log(LOG_ERR, "%s: %m", path);
+        return NULL;
+    }
+
+    if (fread(magic, sizeof(magic), 1, fp) != 1 ||
+        memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0) {
+        do_log(LOG_ERR, "%s: not a netplugd recording", path);
+        fclose(fp);
+        return NULL;
+    }
+
+    return fp;
+}
+
+
+/* Read the next message into buf.  Returns 1 on success, 0 at end of
+   file, and -1 if the recording is damaged. */
+int
+record_read(FILE *fp, struct record_hdr *rh, void *buf, size_t size)
+{
+    if (fread(rh, sizeof(*rh), 1, fp) != 1)
+        return feof(fp) ? 0 : -1;
+
+    if (rh->len < sizeof(struct nlmsghdr) || rh->len > size)
+        return -1;
+
+    if (fread(buf, rh->len, 1, fp) != 1)
+        return -1;
+
+    return 1;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
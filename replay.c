@@ -0,0 +1,355 @@
+/*
+ * replay.c - feed a netplugd recording back through the state machine
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Messages go through the same decode and state machine code as in
+ * the daemon, but no scripts are run: starting one just hands out a
+ * made-up pid, and every script "exits" successfully as soon as the
+ * message that started it has been dealt with.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "netplug.h"
+
+int use_syslog;
+int debug;
+
+#define NSTATES         (ST_INSANE + 1)
+
+struct message {
+    struct record_hdr rh;
+    struct nlmsghdr *hdr;
+};
+
+static struct message *messages;
+static size_t nr_messages;
+
+static pid_t *running;          /* scripts yet to "exit", oldest first */
+static size_t nr_running, max_running;
+static pid_t next_pid = 1 << 22;
+
+static unsigned long transitions[NSTATES][NSTATES];
+static unsigned long nr_probe, nr_in, nr_out, nr_killed;
+
+
+static pid_t
+fake_spawn(struct if_info *info, char *action)
+{
+    if (strcmp(action, "probe") == 0)
+        nr_probe++;
+    else if (strcmp(action, "in") == 0)
+        nr_in++;
+    else if (strcmp(action, "out") == 0)
+        nr_out++;
+
+    if (nr_running == max_running) {
+        max_running = max_running ? max_running * 2 : 64;
+        running = realloc(running, max_running * sizeof(*running));
+        if (running == NULL) {
+            do_log(LOG_ERR, "realloc: %m");
+            exit(1);
+        }
+    }
+
+    running[nr_running++] = next_pid;
+
+    return next_pid++;
+}
+
+
+static void
+fake_kill(pid_t pid)
+{
+    /* It exits along with the rest, in finish_scripts(), and what is
+       to run after it starts then. */
+    nr_killed++;
+}
+
+
+/* Nothing runs the watchdog, but a script told to stop gets SIGKILL
+   as it exits. */
+static void
+fake_signal(pid_t pid, int sig)
+{
+}
+
+
+static void
+count_transition(struct if_info *info, enum ifstate from)
+{
+    transitions[from][info->state]++;
+}
+
+
+/* Finishing one script may start another, so keep going until they
+   have all gone. */
+static void
+finish_scripts(void)
+{
+    while (nr_running) {
+        pid_t pid = running[0];
+
+        memmove(&running[0], &running[1],
+                (nr_running - 1) * sizeof(*running));
+        nr_running--;
+
+        ifsm_scriptdone(pid, 0);
+    }
+}
+
+
+static void
+load(const char *path)
+{
+    FILE *fp = record_open_replay(path);
+    size_t max = 0;
+    char buf[65536];
+    struct record_hdr rh;
+    int ret;
+
+    if (fp == NULL)
+        exit(1);
+
+    while ((ret = record_read(fp, &rh, buf, sizeof(buf))) == 1) {
+        if (nr_messages == max) {
+            max = max ? max * 2 : 1024;
+            messages = realloc(messages, max * sizeof(*messages));
+            if (messages == NULL) {
+                do_log(LOG_ERR, "realloc: %m");
+                exit(1);
+            }
+        }
+
+        messages[nr_messages].rh = rh;
+        messages[nr_messages].hdr = xmalloc(rh.len);
+        memcpy(messages[nr_messages].hdr, buf, rh.len);
+        nr_messages++;
+    }
+
+    if (ret == -1)
+        do_log(LOG_WARNING, "%s: recording is damaged after %zu messages",
+               path, nr_messages);
+
+    fclose(fp);
+}
+
+
+static struct netns *
+replay_netns(int id)
+{
+    static struct netns *ns;
+    static int nr_ns;
+
+    if (id >= nr_ns) {
+        ns = realloc(ns, (id + 1) * sizeof(*ns));
+        if (ns == NULL) {
+            do_log(LOG_ERR, "realloc: %m");
+            exit(1);
+        }
+        for (; nr_ns <= id; nr_ns++) {
+            memset(&ns[nr_ns], 0, sizeof(*ns));
+            ns[nr_ns].id = nr_ns;
+            ns[nr_ns].nsfd = ns[nr_ns].nlfd = ns[nr_ns].sockfd = -1;
+        }
+    }
+
+    return &ns[id];
+}
+
+
+/* How long decoding alone takes, without the state machine. */
+static double
+time_decode(void)
+{
+    struct link_event ev;
+    unsigned long long start = monotonic_ns();
+
+    for (size_t i = 0; i < nr_messages; i++) {
+        link_event_decode(&ev, replay_netns(messages[i].rh.netns),
+                          messages[i].hdr);
+    }
+
+    return nr_messages ?
+        (double) (monotonic_ns() - start) / nr_messages : 0;
+}
+
+
+static void
+sleep_until(unsigned long long start, unsigned long long offset)
+{
+    unsigned long long now = monotonic_ns();
+
+    if (now - start < offset) {
+        unsigned long long ns = offset - (now - start);
+        struct timespec ts = { ns / 1000000000ULL, ns % 1000000000ULL };
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+static void
+usage(char *progname, int exitcode)
+{
+    fprintf(stderr, "Usage: %s [-DRv] [-c config-file] [-i interface] "
+            "recording\n", progname);
+
+    fprintf(stderr, "\t-D\t\t"
+            "print extra debugging messages\n");
+    fprintf(stderr, "\t-R\t\t"
+            "replay at the speed the events were recorded\n");
+    fprintf(stderr, "\t-v\t\t"
+            "show the daemon's log messages\n");
+    fprintf(stderr, "\t-c config_file\t"
+            "read interface patterns from this config file\n");
+    fprintf(stderr, "\t-i interface\t"
+            "only handle interfaces matching this pattern\n");
+
+    exit(exitcode);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int realtime = 0;
+    int verbose = 0;
+    int patterns = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "DRvc:hi:")) != EOF) {
+        switch (c) {
+        case 'D':
+            debug = verbose = 1;
+            break;
+        case 'R':
+            realtime = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'c':
+            read_config(optarg);
+            patterns = 1;
+            break;
+        case 'h':
+            usage(argv[0], 0);
+            break;
+        case 'i':
+            if (save_pattern(optarg) == -1) {
+                fprintf(stderr, "Bad pattern for '-i %s'\n", optarg);
+                exit(1);
+            }
+            patterns = 1;
+            break;
+        case '?':
+            usage(argv[0], 1);
+        }
+    }
+
+    if (optind != argc - 1)
+        usage(argv[0], 1);
+
+    if (!patterns)
+        save_pattern("*");
+
+    if (!verbose)
+        log_threshold = LOG_WARNING;
+
+    ifsm_hooks.spawn = fake_spawn;
+    ifsm_hooks.kill = fake_kill;
+    ifsm_hooks.signal = fake_signal;
+    ifsm_hooks.transition = count_transition;
+
+    load(argv[optind]);
+
+    double decode_ns = time_decode();
+
+    unsigned long events = 0;
+    int dumping = 1;
+    unsigned long long first = nr_messages ? messages[0].rh.ts : 0;
+    unsigned long long start = monotonic_ns();
+
+    for (size_t i = 0; i < nr_messages; i++) {
+        struct message *m = &messages[i];
+        struct netns *ns = replay_netns(m->rh.netns);
+        struct link_event ev;
+
+        if (realtime && m->rh.ts > first)
+            sleep_until(start, m->rh.ts - first);
+
+        if (m->rh.dump) {
+            if_info_save_interface(m->hdr, ns);
+            continue;
+        }
+
+        /* The daemon does this once its dump is in, before it starts
+           listening. */
+        if (dumping) {
+            int poll_flags(struct if_info *i) {
+                if (if_match(i->name))
+                    ifsm_flagpoll(i);
+                return 0;
+            }
+            for_each_iface(poll_flags);
+            finish_scripts();
+            dumping = 0;
+        }
+
+        if (link_event_decode(&ev, ns, m->hdr) <= 0)
+            continue;
+
+        events++;
+        if_info_handle_event(&ev);
+        finish_scripts();
+    }
+
+    double secs = (monotonic_ns() - start) / 1e9;
+
+    printf("messages:     %zu\n", nr_messages);
+    printf("link events:  %lu\n", events);
+    printf("elapsed:      %.6f s\n", secs);
+    if (secs > 0)
+        printf("throughput:   %.0f events/s\n", events / secs);
+    printf("decode:       %.1f ns/message\n", decode_ns);
+    printf("scripts:      probe %lu, in %lu, out %lu, killed %lu\n",
+           nr_probe, nr_in, nr_out, nr_killed);
+    printf("transitions:\n");
+
+    for (int from = 0; from < NSTATES; from++) {
+        for (int to = 0; to < NSTATES; to++) {
+            if (transitions[from][to])
+                printf("  %-10s -> %-10s %lu\n", statename(from),
+                       statename(to), transitions[from][to]);
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
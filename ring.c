@@ -0,0 +1,191 @@
+/*
+ * ring.c - single-producer, single-consumer queues between threads
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * The only synchronisation between producer and consumer is the pair
+ * of head and tail indices.  Eventfds are used purely for wakeups:
+ * one tells the consumer there is work, the other tells a stalled
+ * producer that there is room again.  Both are only written on the
+ * empty -> non-empty and full -> not-full edges, so a steady stream of
+ * events costs no system calls beyond the first.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "netplug.h"
+
+
+static void
+kick(int fd)
+{
+    uint64_t one = 1;
+
+    while (write(fd, &one, sizeof(one)) == -1 && errno == EINTR) {
+    }
+}
+
+
+static void
+drain_fd(int fd)
+{
+    uint64_t n;
+
+    while (read(fd, &n, sizeof(n)) == -1 && errno == EINTR) {
+    }
+}
+
+
+void
+ring_init(struct ring *r, unsigned nelem, size_t elem)
+{
+    assert((nelem & (nelem - 1)) == 0);
+
+    memset(r, 0, sizeof(*r));
+    r->slots = xmalloc(nelem * elem);
+    r->elem = elem;
+    r->size = nelem;
+
+    if ((r->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+        (r->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        do_log(LOG_ERR, "can't create eventfd: %m");
+        exit(1);
+    }
+}
+
+
+/* Producer: return the next free slot, waiting for the consumer if
+   the ring is full.  Nothing is visible to the consumer until
+   ring_commit(). */
+void *
+ring_slot(struct ring *r)
+{
+    unsigned h = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->size) {
+        struct pollfd pfd = { r->space_fd, POLLIN, 0 };
+
+        __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+
+        while (h - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == r->size) {
+            if (poll(&pfd, 1, -1) == 1)
+                drain_fd(r->space_fd);
+        }
+
+        __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    return r->slots + (h & (r->size - 1)) * r->elem;
+}
+
+
+/* Producer: like ring_slot(), but return NULL instead of waiting if
+   the ring is full. */
+void *
+ring_try_slot(struct ring *r)
+{
+    unsigned h = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    if (h - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == r->size)
+        return NULL;
+
+    return r->slots + (h & (r->size - 1)) * r->elem;
+}
+
+
+/* Producer: publish the slot last returned by ring_slot().  Returns
+   the queue depth as seen just afterwards. */
+unsigned
+ring_commit(struct ring *r)
+{
+    unsigned h = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+    /* Publish the entry, then look at the tail again: if the consumer
+       had already emptied the ring it may be about to sleep, so it
+       needs a wakeup.  Both sides use sequentially consistent accesses
+       here, so one of them always sees the other. */
+    __atomic_store_n(&r->head, h + 1, __ATOMIC_SEQ_CST);
+
+    unsigned t = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST);
+
+    if (t == h)
+        kick(r->wake_fd);
+
+    /* Only the producer writes high_water; the consumer may read a
+       slightly stale value, which is fine for a statistic. */
+    unsigned depth = h + 1 - t;
+
+    if (depth > r->high_water)
+        __atomic_store_n(&r->high_water, depth, __ATOMIC_RELAXED);
+
+    return depth;
+}
+
+
+/* Consumer: hand every queued entry to func, in order. */
+void
+ring_consume(struct ring *r, void (*func)(void *))
+{
+    drain_fd(r->wake_fd);
+
+    for (;;) {
+        unsigned t = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        unsigned h = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+
+        if (t == h)
+            break;
+
+        /* Free each slot as soon as we are done with it, so that a
+           stalled producer can get going again mid-burst. */
+        for (; t != h; t++) {
+            func(r->slots + (t & (r->size - 1)) * r->elem);
+
+            __atomic_store_n(&r->tail, t + 1, __ATOMIC_SEQ_CST);
+
+            if (__atomic_load_n(&r->waiting, __ATOMIC_SEQ_CST))
+                kick(r->space_fd);
+        }
+    }
+}
+
+
+/* Wake the consumer without queueing anything. */
+void
+ring_wake(struct ring *r)
+{
+    kick(r->wake_fd);
+}
+
+
+unsigned
+ring_high_water(struct ring *r)
+{
+    return __atomic_load_n(&r->high_water, __ATOMIC_RELAXED);
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
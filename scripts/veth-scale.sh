@@ -0,0 +1,231 @@
+#!/bin/bash
+#
+# veth-scale.sh - run netplugd against many veth pairs and measure it
+#
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License,
+# version 2, as published by the Free Software Foundation.  You are
+# forbidden from redistributing or modifying it under the terms of
+# any other license, including other versions of the GNU General
+# Public License.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# General Public License for more details.
+#
+# Everything happens in a private network namespace, so all it needs
+# is root and a kernel with veth; no real NICs are touched.  netplugd
+# watches one end of every pair, and carrier on that end is flapped by
+# bringing the other end up and down.  The policy script only records
+# when it was run, and for what.
+#
+# Reported: how long each round of flaps takes to converge, that is
+# from the first "ip link set" to the last script starting; netplugd's
+# CPU time; system calls per event, if perf or strace is around; and
+# netlink messages the kernel dropped because netplugd's socket was
+# full.  Set NP_KEEP to keep the daemon's log and the record of script
+# runs afterwards.
+
+usage() {
+    echo "Usage: $0 [-n pairs] [-f flaps] [-t timeout] [-- netplugd-args]" >&2
+    echo "	-n pairs	veth pairs to make, 1 to 50000 (default 1000)" >&2
+    echo "	-f flaps	times to take carrier down and up (default 3)" >&2
+    echo "	-t timeout	seconds to wait for each round (default 60)" >&2
+    exit $1
+}
+
+pairs=1000
+flaps=3
+timeout=60
+
+while getopts "f:hn:t:" opt; do
+    case $opt in
+    f) flaps=$OPTARG ;;
+    n) pairs=$OPTARG ;;
+    t) timeout=$OPTARG ;;
+    h) usage 0 ;;
+    *) usage 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if [ "$pairs" -lt 1 ] || [ "$pairs" -gt 50000 ] || [ "$flaps" -lt 1 ]; then
+    usage 1
+fi
+
+if [ "$(id -u)" != 0 ]; then
+    echo "$0: must be run as root" >&2
+    exit 1
+fi
+
+netplugd=${NETPLUGD:-$(dirname "$0")/../netplugd}
+netplugd=$(readlink -f "$netplugd")
+
+if [ ! -x "$netplugd" ]; then
+    echo "$0: no netplugd at $netplugd; build it, or set NETPLUGD" >&2
+    exit 1
+fi
+
+ns=npscale$$
+work=$(mktemp -d /tmp/npscale.XXXXXX)
+log=$work/invocations
+pid=
+tracer=
+
+cleanup() {
+    [ -n "$tracer" ] && kill -INT $tracer 2>/dev/null
+    [ -n "$pid" ] && kill $pid 2>/dev/null
+    ip netns del $ns 2>/dev/null
+    if [ -n "$NP_KEEP" ]; then
+        echo "logs kept in $work"
+    else
+        rm -rf "$work"
+    fi
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+now() {
+    date +%s.%N
+}
+
+# Clock ticks netplugd has used, user and system together.
+cpu_ticks() {
+    awk '{ print $14 + $15 }' /proc/$pid/stat
+}
+
+cat > "$work/netplug" <<EOF
+#!/bin/sh
+echo "\$(date +%s.%N) \$1 \$2 \${NETPLUG_EVENT_ID:-0}" >> "$log"
+exit 0
+EOF
+chmod 755 "$work/netplug"
+: > "$log"
+
+echo "making $pairs veth pairs in netns $ns"
+
+ip netns add $ns
+ip -n $ns link set lo up
+
+for ((i = 0; i < pairs; i++)); do
+    echo "link add sa$i type veth peer name sb$i"
+    echo "link set sa$i up"
+done > "$work/create"
+ip -n $ns -batch "$work/create" || exit 1
+
+for ((i = 0; i < pairs; i++)); do
+    echo "link set sb$i up"
+done > "$work/up"
+
+for ((i = 0; i < pairs; i++)); do
+    echo "link set sb$i down"
+done > "$work/down"
+
+ip netns exec $ns "$netplugd" -F -P -c /dev/null -i 'sa*' \
+    -s "$work/netplug" "$@" > "$work/daemon.log" 2>&1 &
+pid=$!
+
+# Give it time to read the initial dump of every interface.
+sleep $((1 + pairs / 5000))
+
+if ! kill -0 $pid 2>/dev/null; then
+    echo "$0: netplugd exited early:" >&2
+    cat "$work/daemon.log" >&2
+    exit 1
+fi
+
+if command -v perf > /dev/null; then
+    perf stat -x, -e raw_syscalls:sys_enter -p $pid \
+        -o "$work/syscalls" 2>/dev/null &
+    tracer=$!
+elif command -v strace > /dev/null; then
+    echo "counting system calls with strace; expect it to be slower"
+    strace -c -f -p $pid -o "$work/syscalls" 2>/dev/null &
+    tracer=$!
+fi
+
+# Wait for count scripts to have been run with action, then print how
+# long after start the last of them was.
+converge() {
+    local action=$1 count=$2 start=$3
+    local deadline=$((SECONDS + timeout)) seen
+
+    while :; do
+        seen=$(grep -c " $action " "$log")
+        [ "$seen" -ge "$count" ] && break
+        if [ $SECONDS -ge $deadline ]; then
+            echo "timeout: $seen of $count $action scripts" >&2
+            return 1
+        fi
+        sleep 0.1
+    done
+
+    grep " $action " "$log" | sort -n | tail -1 |
+        awk -v start=$start '{ printf "%.3f\n", $1 - start }'
+}
+
+ticks0=$(cpu_ticks)
+rounds=0
+total=0
+worst=0
+
+for ((f = 1; f <= flaps; f++)); do
+    for action in in out; do
+        if [ $action = in ]; then batch=up; else batch=down; fi
+
+        start=$(now)
+        ip -n $ns -batch "$work/$batch" || exit 1
+        # Once an event is lost, later rounds can't converge either.
+        if ! secs=$(converge $action $((pairs * f)) $start); then
+            break 2
+        fi
+        rounds=$((rounds + 1))
+
+        printf "round %d %-3s converged in %s s\n" $f $action $secs
+        total=$(echo "$total $secs" | awk '{ print $1 + $2 }')
+        worst=$(echo "$worst $secs" | awk '{ print ($2 > $1) ? $2 : $1 }')
+    done
+done
+
+ticks1=$(cpu_ticks)
+
+events=$(wc -l < "$log")
+hz=$(getconf CLK_TCK)
+cpu=$(echo "$ticks0 $ticks1 $hz" | awk '{ printf "%.2f", ($2 - $1) / $3 }')
+
+# The kernel counts what it couldn't queue on each netlink socket.
+drops=$(ip netns exec $ns awk -v pid=$pid \
+    '$2 == 0 && $3 == pid { print $9 }' /proc/net/netlink)
+enobufs=$(grep -c "No buffer space" "$work/daemon.log")
+
+syscalls=
+if [ -n "$tracer" ]; then
+    kill -INT $tracer 2>/dev/null
+    wait $tracer 2>/dev/null
+    tracer=
+    if command -v perf > /dev/null; then
+        syscalls=$(awk -F, '/sys_enter/ { print $1 }' "$work/syscalls")
+    else
+        syscalls=$(awk '$NF == "total" { print $(NF - 2) }' "$work/syscalls")
+    fi
+fi
+
+echo
+echo "pairs:          $pairs"
+echo "events:         $events of $((pairs * flaps * 2)) expected"
+if [ $rounds -gt 0 ]; then
+    echo "convergence:    $(echo "$total $rounds" |
+        awk '{ printf "%.3f", $1 / $2 }') s mean, $worst s worst"
+else
+    echo "convergence:    none"
+fi
+echo "cpu:            $cpu s, $(echo "$cpu $events" |
+    awk '{ printf "%.1f", $1 * 1e6 / $2 }') us/event"
+if [ -n "$syscalls" ]; then
+    echo "syscalls:       $syscalls, $(echo "$syscalls $events" |
+        awk '{ printf "%.1f", $1 / $2 }') per event"
+else
+    echo "syscalls:       not counted (needs perf or strace)"
+fi
+echo "netlink drops:  ${drops:-unknown} (receive errors logged: $enobufs)"
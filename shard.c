@@ -0,0 +1,255 @@
+/*
+ * shard.c - spread the interface state machine over worker threads
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * Each shard owns every if_info hash bucket whose number is congruent
+ * to the shard's id modulo the number of shards, and nobody else ever
+ * touches those interfaces once the shards are running.  The main
+ * thread becomes a dispatcher: link events go down the owning shard's
+ * ring, so events for any one interface are handled in the order the
+ * kernel sent them.  Script exits go to the shard that started the
+ * script: each shard notes which pids are its own as it forks them,
+ * and the main thread looks them up as it reaps them.  A lock, held
+ * by a shard from fork() until the note is made, and by the main
+ * thread around each waitpid(), means that no script can be reaped
+ * before it is noted.  Anything not noted, such as a script that
+ * says it is done after it has been reaped, goes to every shard, and
+ * only the one whose interface ran that script acts on it.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <sys/wait.h>
+
+#include "netplug.h"
+
+#define LINK_RING_SIZE  4096    /* must be a power of 2 */
+#define CHILD_RING_SIZE 1024    /* must be a power of 2 */
+
+struct shard {
+    int id;
+    struct ring links;          /* link events from the dispatcher */
+    struct ring children;       /* script exits from the dispatcher */
+};
+
+static struct shard *shards;
+static int nr_shards;
+
+/* The shard that started each pid, plus one, or 0 if none did; an
+   array, as pids are small, and only the pages in use are touched. */
+static unsigned char *pid_shard;
+static int pid_max;
+static pthread_rwlock_t reap_lock;
+
+static void (*shard_link)(struct link_event *);
+static void (*shard_child)(struct child_exit *);
+static int (*shard_idle)(void);
+
+/* Which shard the calling thread is; -1 outside of the shards. */
+__thread int shard_self = -1;
+
+
+static void *
+shard_main(void *arg)
+{
+    struct shard *s = arg;
+    struct pollfd fds[] = {
+        { s->links.wake_fd, POLLIN, 0 },
+        { s->children.wake_fd, POLLIN, 0 },
+    };
+
+    shard_self = s->id;
+
+    for (;;) {
+        int timeout = shard_idle();
+
+        if (poll(fds, sizeof(fds)/sizeof(fds[0]), timeout) == -1) {
+            if (errno == EINTR)
+                continue;
+            do_log(LOG_ERR, "shard %d: poll failed: %m", s->id);
+            exit(1);
+        }
+
+        if (fds[0].revents & POLLIN)
+            ring_consume(&s->links, (void (*)(void *)) shard_link);
+
+        if (fds[1].revents & POLLIN)
+            ring_consume(&s->children, (void (*)(void *)) shard_child);
+    }
+
+    return NULL;
+}
+
+
+/* Start n shard threads.  Each runs link() for the events routed to
+   it, child() for every script exit, and idle() each time it has
+   caught up, or idle() says it should be called again; it returns how
+   long that is, in milliseconds, or -1 for not until something else
+   happens. */
+void
+shard_start(int n, void (*link)(struct link_event *),
+            void (*child)(struct child_exit *), int (*idle)(void))
+{
+    shard_link = link;
+    shard_child = child;
+    shard_idle = idle;
+
+    shards = xmalloc(n * sizeof(*shards));
+    nr_shards = n;
+
+    FILE *fp = fopen("/proc/sys/kernel/pid_max", "r");
+
+    if (fp == NULL || fscanf(fp, "%d", &pid_max) != 1 || pid_max < 1)
+        pid_max = 4 * 1024 * 1024; /* PID_MAX_LIMIT */
+    if (fp)
+        fclose(fp);
+
+    pid_shard = calloc(pid_max, 1);
+    if (pid_shard == NULL) {
+        do_log(LOG_ERR, "calloc: %m");
+        exit(1);
+    }
+
+    /* However many shards are forking, the main thread gets its turn. */
+    pthread_rwlockattr_t attr;
+
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&reap_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    for (int i = 0; i < n; i++) {
+        shards[i].id = i;
+        ring_init(&shards[i].links, LINK_RING_SIZE,
+                  sizeof(struct link_event));
+        ring_init(&shards[i].children, CHILD_RING_SIZE,
+                  sizeof(struct child_exit));
+    }
+
+    for (int i = 0; i < n; i++) {
+        thread_start(shard_main, &shards[i]);
+    }
+
+    do_log(LOG_DEBUG, "started %d state machine shards", n);
+}
+
+
+int
+shard_count(void)
+{
+    return nr_shards;
+}
+
+
+void
+shard_dispatch_link(struct link_event *ev)
+{
+    struct shard *s = &shards[if_info_bucket(ev->netns, ev->index) %
+                              nr_shards];
+    struct link_event *slot = ring_slot(&s->links);
+
+    *slot = *ev;
+    ring_commit(&s->links);
+}
+
+
+/* Around fork(), in a shard: pid, once it is known, is noted down as
+   the shard's own before the main thread can reap it.  pid is -1 if
+   fork() failed. */
+void
+shard_fork_begin(void)
+{
+    if (shard_self >= 0)
+        pthread_rwlock_rdlock(&reap_lock);
+}
+
+
+void
+shard_fork_end(pid_t pid)
+{
+    if (shard_self < 0)
+        return;
+
+    if (pid > 0 && pid < pid_max)
+        __atomic_store_n(&pid_shard[pid], shard_self + 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&reap_lock);
+}
+
+
+/* Reap a child that has exited, if there is one, noting which shard
+   started it.  Returns 0 if there is none. */
+int
+shard_reap(struct child_exit *ce)
+{
+    if (nr_shards)
+        pthread_rwlock_wrlock(&reap_lock);
+
+    ce->pid = waitpid(-1, &ce->status, WNOHANG);
+    ce->early = 0;
+    ce->owner = 0;
+
+    if (nr_shards && ce->pid > 0 && ce->pid < pid_max) {
+        ce->owner = pid_shard[ce->pid];
+        pid_shard[ce->pid] = 0;
+    }
+
+    if (nr_shards)
+        pthread_rwlock_unlock(&reap_lock);
+
+    return ce->pid > 0;
+}
+
+
+static void
+dispatch_to(struct shard *s, struct child_exit *ce)
+{
+    struct child_exit *slot = ring_slot(&s->children);
+
+    *slot = *ce;
+    ring_commit(&s->children);
+}
+
+
+void
+shard_dispatch_child(struct child_exit *ce)
+{
+    int owner = ce->owner;
+
+    /* A script saying it is done is still running, and noted. */
+    if (ce->early && ce->pid > 0 && ce->pid < pid_max)
+        owner = __atomic_load_n(&pid_shard[ce->pid], __ATOMIC_RELAXED);
+
+    if (owner) {
+        dispatch_to(&shards[owner - 1], ce);
+        return;
+    }
+
+    for (int i = 0; i < nr_shards; i++)
+        dispatch_to(&shards[i], ce);
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
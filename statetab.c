@@ -0,0 +1,161 @@
+/*
+ * statetab.c - publish interface state in a shared-memory table
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * The writing side of npstate.h.  Each interface's slot is only ever
+ * written by the thread that owns the interface, so the sequence lock
+ * needs no lock of its own; handing out new slots is the only thing
+ * threads share, and that is an atomic add.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "netplug.h"
+#include "npstate.h"
+
+#define HEADER_SIZE     512
+#define NSLOTS          16384
+
+static struct npstate_header *hdr;
+static struct npstate_slot *slots;
+static const char *state_path;
+
+
+static void
+tidy_state(void)
+{
+    unlink(state_path);
+}
+
+
+/* Create the table at path.  It is built under a temporary name and
+   renamed into place, so readers never see it half made. */
+void
+state_open(const char *path)
+{
+    size_t size = HEADER_SIZE + NSLOTS * sizeof(struct npstate_slot);
+    char *tmp;
+    void *map;
+    int fd;
+
+    if (asprintf(&tmp, "%s.tmp", path) == -1) {
+        do_log(LOG_ERR, "asprintf: %m");
+        exit(1);
+    }
+
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1 ||
+        ftruncate(fd, size) == -1) {
+        do_log(LOG_ERR, "%s: %m", tmp);
+        exit(1);
+    }
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        do_log(LOG_ERR, "can't map %s: %m", tmp);
+        exit(1);
+    }
+
+    hdr = map;
+    slots = (void *) ((char *) map + HEADER_SIZE);
+
+    memcpy(hdr->magic, NPSTATE_MAGIC, sizeof(hdr->magic));
+    hdr->header_size = HEADER_SIZE;
+    hdr->slot_size = sizeof(struct npstate_slot);
+    hdr->nslots = NSLOTS;
+    hdr->pid = getpid();
+
+    for (int s = 0; s < NR_STATES && s < NPSTATE_NAMES; s++) {
+        strncpy(hdr->statenames[s], statename(s),
+                sizeof(hdr->statenames[s]) - 1);
+    }
+
+    if (rename(tmp, path) == -1) {
+        do_log(LOG_ERR, "%s: %m", path);
+        exit(1);
+    }
+
+    free(tmp);
+    state_path = path;
+    atexit(tidy_state);
+}
+
+
+/* Daemonizing changes our pid after the table is made. */
+void
+state_set_pid(void)
+{
+    if (hdr)
+        hdr->pid = getpid();
+}
+
+
+/* Copy info's current state into its slot, giving it one first if
+   need be. */
+void
+state_publish(struct if_info *info)
+{
+    if (hdr == NULL)
+        return;
+
+    if (info->state_slot < 0) {
+        unsigned n = __atomic_fetch_add(&hdr->nused, 1, __ATOMIC_RELAXED);
+
+        if (n >= NSLOTS) {
+            if (n == NSLOTS)
+                do_log(LOG_WARNING, "state table is full; %s and later "
+                       "interfaces will not be published", info->name);
+            info->state_slot = NSLOTS;
+        } else {
+            info->state_slot = n;
+        }
+    }
+
+    if (info->state_slot >= NSLOTS)
+        return;
+
+    struct npstate_slot *s = &slots[info->state_slot];
+    uint32_t seq = s->seq;
+
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    s->netns = info->netns;
+    s->ifindex = info->index;
+    s->flags = info->flags;
+    s->lastchange = info->lastchange;
+    s->flaps = info->flaps;
+    s->state = info->state;
+    s->operstate = info->operstate;
+    memcpy(s->name, info->name, sizeof(s->name));
+
+    __atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
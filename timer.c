@@ -0,0 +1,284 @@
+/*
+ * timer.c - a hierarchical timer wheel for each state machine thread
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * The classic cascading wheel.  Time is counted in ticks of 2^20 ns,
+ * about a millisecond.  Level 0 has a slot for each of the next 64
+ * ticks, level 1 one for each of the next 64 runs of those, and so on
+ * up to four levels, nearly five hours; anything further out goes in
+ * the last slot there is, and is put back further on each time it
+ * comes round.  A timer goes in the slot for when it is due,
+ * so adding and cancelling one is O(1) however many there are.  Each
+ * time level 0 comes round to its first slot, the next slot up is
+ * emptied into the levels below, which is the only time a timer
+ * moves.
+ *
+ * A bitmap of the slots in use at each level means that working out
+ * how long to sleep, and skipping over idle stretches, look at a few
+ * words rather than every slot.  Nothing but poll() sleeps, for as
+ * long as timer_timeout() says, so the one kernel timer there is is
+ * always set for the next expiry.
+ *
+ * Timers, and the wheel they are on, belong to the thread that added
+ * them, as the interfaces do; see shard.c.  They go by the state
+ * machine's clock, ifsm_hooks.clock.
+ */
+
+#include <string.h>
+#include <syslog.h>
+
+#include "netplug.h"
+
+#define TICK_SHIFT      20
+#define TICK            (1ULL << TICK_SHIFT)
+#define LEVELS          4
+#define SLOT_BITS       6
+#define SLOTS           (1 << SLOT_BITS)
+#define SLOT_MASK       (SLOTS - 1)
+#define MAX_DELTA       ((1ULL << (LEVELS * SLOT_BITS)) - 1)
+
+static __thread struct wheel {
+    unsigned long long tick;    /* next tick to run */
+    unsigned long long bits[LEVELS]; /* slots with timers in */
+    struct timer *slots[LEVELS][SLOTS];
+    unsigned count;
+    int started;
+} wheel;
+
+
+static void
+link_timer(struct timer *t, int level, int slot)
+{
+    struct timer **head = &wheel.slots[level][slot];
+
+    t->level = level;
+    t->slot = slot;
+    t->next = *head;
+    if (*head)
+        (*head)->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+    wheel.bits[level] |= 1ULL << slot;
+}
+
+
+/* Put t in the slot for the first tick at or after when, so that it
+   is never run early. */
+static void
+place(struct timer *t)
+{
+    unsigned long long expires = (t->when + TICK - 1) >> TICK_SHIFT;
+    unsigned long long delta;
+    int level;
+
+    if (expires < wheel.tick)
+        expires = wheel.tick;   /* overdue: the next tick run */
+
+    delta = expires - wheel.tick;
+    if (delta > MAX_DELTA) {
+        delta = MAX_DELTA;
+        expires = wheel.tick + delta;
+    }
+
+    for (level = 0; level < LEVELS - 1; level++) {
+        if (delta < 1ULL << ((level + 1) * SLOT_BITS))
+            break;
+    }
+
+    link_timer(t, level, (expires >> (level * SLOT_BITS)) & SLOT_MASK);
+}
+
+
+/* Run t's func once when has passed.  t may already be pending, in
+   which case it is moved. */
+void
+timer_add(struct timer *t, unsigned long long when)
+{
+    if (!wheel.started) {
+        wheel.tick = ifsm_hooks.clock() >> TICK_SHIFT;
+        wheel.started = 1;
+    }
+
+    timer_cancel(t);
+    t->when = when;
+    place(t);
+    wheel.count++;
+}
+
+
+void
+timer_cancel(struct timer *t)
+{
+    if (t->pprev == NULL)
+        return;
+
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+
+    /* Not on the list being run, but in a slot of its own. */
+    if (t->level < LEVELS && wheel.slots[t->level][t->slot] == NULL)
+        wheel.bits[t->level] &= ~(1ULL << t->slot);
+
+    t->pprev = NULL;
+    wheel.count--;
+}
+
+
+/* Take everything out of a slot, to put back where it now belongs. */
+static void
+cascade(int level, int slot)
+{
+    struct timer *t = wheel.slots[level][slot];
+
+    wheel.slots[level][slot] = NULL;
+    wheel.bits[level] &= ~(1ULL << slot);
+
+    while (t) {
+        struct timer *next = t->next;
+
+        place(t);
+        t = next;
+    }
+}
+
+
+/* Run every timer in level 0's slot for the current tick. */
+static void
+expire_slot(int slot)
+{
+    struct timer *list = wheel.slots[0][slot];
+
+    if (list == NULL)
+        return;
+
+    /* Functions may add and cancel timers, this slot's included, so
+       take the list away first, and take each off it in turn. */
+    wheel.slots[0][slot] = NULL;
+    wheel.bits[0] &= ~(1ULL << slot);
+    list->pprev = &list;
+    for (struct timer *t = list; t; t = t->next)
+        t->level = LEVELS;
+
+    while (list) {
+        struct timer *t = list;
+
+        timer_cancel(t);
+        t->func(t);
+    }
+}
+
+
+/* Run every timer due by now. */
+void
+timer_run(unsigned long long now)
+{
+    unsigned long long target = now >> TICK_SHIFT;
+
+    if (!wheel.started)
+        return;
+
+    while (wheel.tick <= target) {
+        if (wheel.count == 0) {
+            wheel.tick = target + 1;
+            break;
+        }
+
+        int slot = wheel.tick & SLOT_MASK;
+
+        /* Level 0 has come round: bring down what is due in the next
+           64 ticks, and so on up. */
+        if (slot == 0) {
+            for (int level = 1; level < LEVELS; level++) {
+                int s = (wheel.tick >> (level * SLOT_BITS)) & SLOT_MASK;
+
+                cascade(level, s);
+                if (s != 0)
+                    break;
+            }
+        }
+
+        /* Again, for anything overdue that was added while running
+           it. */
+        while (wheel.slots[0][slot])
+            expire_slot(slot);
+
+        /* Skip straight to the next slot in use, or to level 0 coming
+           round again. */
+        unsigned long long next = (wheel.tick | SLOT_MASK) + 1;
+        unsigned long long ahead = slot < SLOT_MASK ?
+            wheel.bits[0] >> (slot + 1) : 0;
+
+        if (ahead)
+            next = wheel.tick + 1 + __builtin_ctzll(ahead);
+        wheel.tick = next < target + 1 ? next : target + 1;
+    }
+}
+
+
+/* How long until the next timer is due, in milliseconds, or -1 if
+   there is none.  Timers further up are counted as due when their
+   slot is brought down, which may be early, but never late. */
+int
+timer_timeout(unsigned long long now)
+{
+    if (wheel.count == 0)
+        return -1;
+
+    unsigned long long first = ~0ULL;
+
+    for (int level = 0; level < LEVELS; level++) {
+        unsigned long long bits = wheel.bits[level];
+
+        if (bits == 0)
+            continue;
+
+        /* Look from the slot the wheel is at, if it has yet to be run
+           or brought down, or from the next, going round. */
+        int shift = level * SLOT_BITS;
+        int pos = (wheel.tick >> shift) & SLOT_MASK;
+        int from = (wheel.tick & ((1ULL << shift) - 1)) == 0 ? pos : pos + 1;
+        int r = from & SLOT_MASK;
+        unsigned long long rot = r ? bits >> r | bits << (SLOTS - r) : bits;
+        unsigned long long at = ((wheel.tick >> shift) + (from - pos) +
+                                 __builtin_ctzll(rot)) << shift;
+
+        if (at < first)
+            first = at;
+    }
+
+    unsigned long long due = first << TICK_SHIFT;
+
+    if (due <= now)
+        return 0;
+
+    return (due - now + 999999) / 1000000;
+}
+
+
+/* Forget every timer, as if we had just started. */
+void
+timer_clear(void)
+{
+    memset(&wheel, 0, sizeof(wheel));
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
@@ -0,0 +1,176 @@
+/*
+ * timer_bench.c - what the watchdog's timers cost, however many there are
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * One timer per interface, as the watchdog and retries have, on the
+ * wheel in timer.c, driven by a made-up clock.  Each millisecond of
+ * it, some interfaces have their timer moved, as when a script starts
+ * or exits, and the wheel is run; a timer that goes off is set again,
+ * as a slow script's is for its deadline.  The cost of each should
+ * stay the same as the number of interfaces grows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "netplug.h"
+
+int use_syslog;
+int debug;
+
+#define MS              1000000ULL
+
+static int ntimers = 10000;
+static int churn = 100;         /* timers moved each millisecond */
+static int seconds = 60;        /* of made-up time */
+static int spread = 30;         /* timers are set up to this far ahead */
+
+static unsigned long long now;
+static unsigned long long nr_expired;
+static unsigned long long rng = 0x9e3779b97f4a7c15ULL;
+
+
+static unsigned long long
+fake_clock(void)
+{
+    return now;
+}
+
+
+static unsigned long long
+random_ns(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+
+    return rng % (spread * 1000 * MS);
+}
+
+
+static void
+expired(struct timer *t)
+{
+    nr_expired++;
+    timer_add(t, now + random_ns());
+}
+
+
+static void
+usage(char *progname, int exitcode)
+{
+    fprintf(stderr, "Usage: %s [-n timers] [-c churn] [-s seconds] "
+            "[-w spread]\n", progname);
+
+    fprintf(stderr, "\t-n timers\t"
+            "number of timers, one per interface (default 10000)\n");
+    fprintf(stderr, "\t-c churn\t"
+            "timers moved each millisecond (default 100)\n");
+    fprintf(stderr, "\t-s seconds\t"
+            "of made-up time to run for (default 60)\n");
+    fprintf(stderr, "\t-w spread\t"
+            "timers are set up to this many seconds ahead (default 30)\n");
+
+    exit(exitcode);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "c:hn:s:w:")) != EOF) {
+        switch (c) {
+        case 'c':
+            churn = atoi(optarg);
+            break;
+        case 'h':
+            usage(argv[0], 0);
+            break;
+        case 'n':
+            ntimers = atoi(optarg);
+            break;
+        case 's':
+            seconds = atoi(optarg);
+            break;
+        case 'w':
+            spread = atoi(optarg);
+            break;
+        case '?':
+            usage(argv[0], 1);
+        }
+    }
+
+    if (optind != argc || ntimers < 1 || churn < 0 || seconds < 1 ||
+        spread < 1)
+        usage(argv[0], 1);
+
+    ifsm_hooks.clock = fake_clock;
+    now = 1000 * 1000 * MS;
+
+    struct timer *timers = xmalloc(ntimers * sizeof(*timers));
+
+    for (int i = 0; i < ntimers; i++)
+        timers[i] = (struct timer) { .func = expired };
+
+    unsigned long long start = monotonic_ns();
+
+    for (int i = 0; i < ntimers; i++)
+        timer_add(&timers[i], now + random_ns());
+
+    unsigned long long add_ns = monotonic_ns() - start;
+    unsigned long long move_ns = 0, run_ns = 0, nr_moved = 0;
+
+    for (int ms = 0; ms < seconds * 1000; ms++) {
+        now += MS;
+
+        start = monotonic_ns();
+        for (int i = 0; i < churn; i++)
+            timer_add(&timers[rng % ntimers], now + random_ns());
+        unsigned long long mid = monotonic_ns();
+
+        timer_run(now);
+        timer_timeout(now);
+        run_ns += monotonic_ns() - mid;
+
+        move_ns += mid - start;
+        nr_moved += churn;
+    }
+
+    unsigned long long ticks = seconds * 1000ULL;
+
+    printf("timers:       %d\n", ntimers);
+    printf("add:          %.1f ns\n", (double) add_ns / ntimers);
+    if (nr_moved)
+        printf("move:         %.1f ns\n", (double) move_ns / nr_moved);
+    printf("run:          %.1f ns per ms, with the next timeout; "
+           "%.1f ns per expiry\n",
+           (double) run_ns / ticks,
+           nr_expired ? (double) run_ns / nr_expired : 0.0);
+    printf("expired:      %llu\n", nr_expired);
+
+    return 0;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */
@@ -0,0 +1,443 @@
+/*
+ * udev.c - hold new interfaces back until udev is done with them
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.  You are
+ * forbidden from redistributing or modifying it under the terms of
+ * any other license, including other versions of the GNU General
+ * Public License.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+/*
+ * We hear of a new interface as soon as the kernel has it, by
+ * whatever name its driver gave it, and udev goes on to rename it:
+ * anything run for it meanwhile is run for a name it is about to lose.
+ * With --udev, events for an interface in the daemon's own namespace
+ * that udev has yet to finish with are held here, rather than handed
+ * to the state machine.  The latest link event stands for the rest,
+ * and address events are kept in order after it.  Once udev says on
+ * its monitor socket that it is done, and the event held has the name
+ * the interface has now, they are all handed on, as if they had just
+ * come in.  If the name is out of date, the event for the rename is on
+ * its way, and is waited for.
+ *
+ * udev is done with an interface once its database has an entry for
+ * it, so the many already there when we start, or on which udev has
+ * beaten us to it, are never held.  Nor is anything while udev is not
+ * running, or in other namespaces, where it seldom is.  Anything udev
+ * has still not finished with HOLD_MAX later is let go regardless.
+ *
+ * All of this happens in the main thread, before events reach the
+ * shards, which never see a held interface.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "netplug.h"
+
+#define UDEV_GROUP      2       /* udev's own; the kernel's is 1 */
+#define UDEV_MAGIC      0xfeedcafe
+#define UDEV_RUN_DIR    "/run/udev"
+#define HOLD_MAX        (10 * 1000000000ULL)
+#define HELD_ADDRS      16
+
+/* What udev puts ahead of the properties it sends; see libudev's
+   monitor. */
+struct udev_header {
+    char prefix[8];             /* "libudev" */
+    unsigned magic;             /* UDEV_MAGIC, in network order */
+    unsigned header_size;
+    unsigned properties_off;
+    unsigned properties_len;
+    unsigned filter_subsystem_hash;
+    unsigned filter_devtype_hash;
+    unsigned filter_tag_bloom_hi;
+    unsigned filter_tag_bloom_lo;
+};
+
+struct held {
+    struct held *next;
+    unsigned long long since;   /* monotonic time it was first held */
+    int settled;                /* udev is done with it */
+    int ready;                  /* and ev has its name: hand it on */
+    int dump;                   /* from the initial dump; see online.c */
+    struct link_event ev;       /* the latest link event */
+    int naddrs;
+    struct link_event addrs[HELD_ADDRS];
+};
+
+static int sock = -1;
+static struct held *held;
+
+/* A bit for each ifindex udev is known to be done with. */
+static unsigned long *known;
+static int known_max;
+
+
+void
+udev_open(void)
+{
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = UDEV_GROUP,
+    };
+    int one = 1;
+
+    sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                  NETLINK_KOBJECT_UEVENT);
+    if (sock == -1) {
+        do_log(LOG_ERR, "can't open udev monitor socket: %m");
+        exit(1);
+    }
+
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+        setsockopt(sock, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)) == -1) {
+        do_log(LOG_ERR, "can't set up udev monitor socket: %m");
+        exit(1);
+    }
+
+    if (access(UDEV_RUN_DIR "/control", F_OK) == -1)
+        do_log(LOG_WARNING, "udev does not seem to be running; "
+               "not waiting for it until it is");
+}
+
+
+int
+udev_fd(void)
+{
+    return sock;
+}
+
+
+static int
+is_known(int index)
+{
+    const int bits = 8 * sizeof(*known);
+
+    return index < known_max && (known[index / bits] >> index % bits) & 1;
+}
+
+
+static void
+set_known(int index, int on)
+{
+    const int bits = 8 * sizeof(*known);
+
+    if (index >= known_max) {
+        if (!on)
+            return;
+
+        int max = known_max ? known_max : 1024;
+
+        while (max <= index)
+            max *= 2;
+        known = realloc(known, max / 8);
+        if (known == NULL) {
+            do_log(LOG_ERR, "realloc: %m");
+            exit(1);
+        }
+        memset((char *) known + known_max / 8, 0, (max - known_max) / 8);
+        known_max = max;
+    }
+
+    if (on)
+        known[index / bits] |= 1UL << index % bits;
+    else
+        known[index / bits] &= ~(1UL << index % bits);
+}
+
+
+/* Has udev finished with this interface? */
+static int
+in_database(int index)
+{
+    char path[64];
+    struct stat st;
+
+    snprintf(path, sizeof(path), UDEV_RUN_DIR "/data/n%d", index);
+
+    return stat(path, &st) == 0;
+}
+
+
+/* Does the interface still have the name ev gives it? */
+static int
+name_current(const struct link_event *ev)
+{
+    char name[IF_NAMESIZE];
+
+    return if_indextoname(ev->index, name) != NULL &&
+        strcmp(name, ev->name) == 0;
+}
+
+
+static struct held *
+find_held(int index)
+{
+    for (struct held *h = held; h; h = h->next) {
+        if (h->ev.index == index)
+            return h;
+    }
+
+    return NULL;
+}
+
+
+static void
+forget(struct held *h)
+{
+    struct held **hp = &held;
+
+    if (h->dump)
+        online_unhold();
+
+    while (*hp != h)
+        hp = &(*hp)->next;
+    *hp = h->next;
+    free(h);
+}
+
+
+/* Should ev wait until udev is done with its interface?  If so, it is
+   kept, to be handed on by udev_release(), and 1 is returned. */
+int
+udev_hold(struct link_event *ev)
+{
+    if (sock == -1 || ev->netns != 0)
+        return 0;
+
+    struct held *h = find_held(ev->index);
+
+    switch (ev->msgtype) {
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        if (h == NULL)
+            return 0;
+        if (h->naddrs == HELD_ADDRS) {
+            do_log(LOG_WARNING, "%s: too many address changes while "
+                   "waiting for udev; dropping one", h->ev.name);
+            return 1;
+        }
+        h->addrs[h->naddrs++] = *ev;
+        return 1;
+
+    case RTM_DELLINK:
+        set_known(ev->index, 0);
+        if (h == NULL)
+            return 0;
+        do_log(LOG_INFO, "%s: went away while waiting for udev", ev->name);
+        forget(h);
+        return 1;
+    }
+
+    if (h == NULL) {
+        if (is_known(ev->index))
+            return 0;
+
+        /* Without udev running, there is nothing to wait for. */
+        int settled = in_database(ev->index) ||
+            access(UDEV_RUN_DIR "/control", F_OK) == -1;
+
+        if (settled && name_current(ev)) {
+            set_known(ev->index, 1);
+            return 0;
+        }
+
+        h = xmalloc(sizeof(*h));
+        h->next = held;
+        h->since = monotonic_ns();
+        h->settled = settled;
+        h->ready = 0;
+        h->dump = ev->wait_online;
+        h->naddrs = 0;
+        held = h;
+
+        if (h->dump)
+            online_hold();
+
+        metrics_inc(udev_held);
+        do_log(LOG_INFO, "%s: waiting for udev", ev->name);
+    }
+
+    h->ev = *ev;
+    if (h->settled && name_current(ev))
+        h->ready = 1;
+
+    return 1;
+}
+
+
+/* Does a message from udev say it is done with an interface we hold? */
+static void
+parse(char *buf, int len)
+{
+    struct udev_header *hdr = (struct udev_header *) buf;
+
+    if (len < sizeof(*hdr) || strcmp(hdr->prefix, "libudev") != 0 ||
+        ntohl(hdr->magic) != UDEV_MAGIC ||
+        hdr->properties_off > len ||
+        hdr->properties_len > len - hdr->properties_off)
+        return;
+
+    char *p = buf + hdr->properties_off;
+    char *end = p + hdr->properties_len;
+    const char *subsystem = NULL, *action = NULL;
+    int index = 0;
+
+    if (p == end)
+        return;
+
+    /* NUL-terminated KEY=value strings, one after another. */
+    end[-1] = '\0';
+    for (; p < end; p += strlen(p) + 1) {
+        if (strncmp(p, "SUBSYSTEM=", 10) == 0)
+            subsystem = p + 10;
+        else if (strncmp(p, "ACTION=", 7) == 0)
+            action = p + 7;
+        else if (strncmp(p, "IFINDEX=", 8) == 0)
+            index = atoi(p + 8);
+    }
+
+    if (subsystem == NULL || strcmp(subsystem, "net") != 0 || index <= 0)
+        return;
+
+    struct held *h = find_held(index);
+
+    if (h == NULL || h->settled)
+        return;
+
+    do_log(LOG_DEBUG, "%s: udev is done with it (%s)", h->ev.name,
+           action ? action : "?");
+
+    h->settled = 1;
+    if (name_current(&h->ev))
+        h->ready = 1;
+}
+
+
+/* Take in what udev has to say. */
+void
+udev_receive(void)
+{
+    char buf[8192];
+    char cbuf[CMSG_SPACE(sizeof(struct ucred))];
+    struct sockaddr_nl addr;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg = {
+        .msg_name = &addr,
+        .msg_namelen = sizeof(addr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+    };
+    int len;
+
+    for (;;) {
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        msg.msg_namelen = sizeof(addr);
+
+        if ((len = recvmsg(sock, &msg, 0)) == -1) {
+            if (errno == ENOBUFS)
+                continue;       /* anything missed is timed out */
+            if (errno != EAGAIN && errno != EINTR)
+                do_log(LOG_ERR, "udev monitor socket: %m");
+            return;
+        }
+
+        /* Only udev itself, running as root, is believed; the kernel
+           sends nothing to this group. */
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        struct ucred cred;
+
+        if (addr.nl_pid == 0 || cmsg == NULL ||
+            cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_CREDENTIALS)
+            continue;
+        memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+        if (cred.uid != 0)
+            continue;
+
+        parse(buf, len);
+    }
+}
+
+
+/* Hand on, to func, everything held for an interface udev is done
+   with, or that has waited long enough. */
+void
+udev_release(void (*func)(struct link_event *))
+{
+    unsigned long long now = monotonic_ns();
+    struct held *h, *next;
+
+    for (h = held; h; h = next) {
+        next = h->next;
+
+        if (!h->ready && now - h->since < HOLD_MAX)
+            continue;
+
+        if (!h->ready)
+            do_log(LOG_WARNING, "%s: udev is not done with it after %llus; "
+                   "going ahead", h->ev.name, HOLD_MAX / 1000000000ULL);
+        else
+            do_log(LOG_INFO, "%s: udev is done with it", h->ev.name);
+
+        set_known(h->ev.index, 1);
+
+        /* The state machine takes over the hold on readiness. */
+        h->ev.wait_online = h->dump;
+        h->dump = 0;
+
+        func(&h->ev);
+        for (int n = 0; n < h->naddrs; n++)
+            func(&h->addrs[n]);
+        forget(h);
+    }
+}
+
+
+/* How long until udev_release() has something to do, in
+   milliseconds, or -1 if nothing is held. */
+int
+udev_timeout(void)
+{
+    unsigned long long now = monotonic_ns();
+    int timeout = -1;
+
+    for (struct held *h = held; h; h = h->next) {
+        if (h->ready || now - h->since >= HOLD_MAX)
+            return 0;
+
+        int ms = (h->since + HOLD_MAX - now + 999999) / 1000000;
+
+        if (timeout == -1 || ms < timeout)
+            timeout = ms;
+    }
+
+    return timeout;
+}
+
+
+/*
+ * Local variables:
+ * c-file-style: "stroustrup"
+ * End:
+ */